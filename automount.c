@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "report.h"
+#include "view.h"
+#include "log.h"
+
+/*
+mkview-automount is the automounter libmkview starts for a view with lazy directories,
+it isn't run by hand. view_apply execs it with the autofs pipe at <fd> and the view's
+specs, so it can plan the same view again and make each lazy mount point when autofs
+asks for it. Errors go to stderr, it exits once the view is removed.
+*/
+void usage()
+{
+  logf("Usage: mkview-automount <fd> <view_dir> <overlay_options> <stage_dir> <dirs>...");
+}
+
+int main(int argc, const char *argv[])
+{
+  log_init();
+  // the caller's fds are close on exec, unless its kernel couldn't do that
+  syscall(SYS_close_range, 4, ~0U, 0);
+  if (argc < 6) {
+    usage();
+    return 1;
+  }
+  char *end;
+  long fd = strtol(argv[1], &end, 10);
+  if (end == argv[1] || *end || fd < 0 || fd > 3) {
+    errf("invalid fd '%s'", argv[1]);
+    return 1;
+  }
+
+  struct report report;
+  log_report_init(&report);
+  struct view *view = view_alloc(&report);
+  if (!view) {
+    errnof("malloc failed");
+    return 1;
+  }
+  if (view_reset(view, argv[2]))
+    return 1;
+  if (argv[3][0] && view_set_overlay_options(view, argv[3]))
+    return 1;
+  if (argv[4][0] && view_set_stage_dir(view, argv[4]))
+    return 1;
+  for (int i = 5; i < argc; i++) {
+    if (view_add(view, argv[i]))
+      return 1; // error already logged
+  }
+  int result = view_serve_automounts(view, (int)fd);
+  view_free(view);
+  return result ? 1 : 0;
+}
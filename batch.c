@@ -0,0 +1,445 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "report.h"
+#include "view.h"
+#include "log.h"
+#include "batch.h"
+
+/*
+Runs every command in a file inside a view that's only entered once, up to <jobs> of them
+at a time. Each non-empty line that doesn't start with '#' is a command for "/bin/sh -c"
+in the view, numbered by its line. Its output goes to inroot's stdout and stderr a line at
+a time with "[<line>] " in front of each, or to <output_dir>/<line>.out and .err, and
+once it exits its status and how long it ran go to stderr.
+*/
+
+extern char **environ;
+
+// a line longer than this is written out in pieces
+#define MAX_LINE_LENGTH (64 * 1024)
+
+// the kinds of epoll entries a job has, they're in the low bits of the entry's data
+enum { JOB_PIDFD = 0, JOB_STDOUT = 1, JOB_STDERR = 2, JOB_KIND_BITS = 2 };
+
+// a command's stdout or stderr, collected until it has a whole line
+struct job_output
+{
+  int fd; // -1 once it's closed, or if the output goes to a file
+  char *line;
+  size_t length;
+  size_t capacity;
+};
+
+struct job
+{
+  unsigned line_number; // 0 when the slot is free
+  const char *command;
+  int pidfd; // -1 once the command has been reaped
+  int status;
+  struct timespec start;
+  struct job_output output[2];
+};
+
+struct batch
+{
+  int epoll_fd;
+  int null_fd;
+  int output_dir_fd; // -1 if the output is multiplexed
+  unsigned failed;
+};
+
+// reads the commands in a file and the number of the line each one is on
+static err_t read_commands(const char *path, char ***commands_out, unsigned **line_numbers,
+                           size_t *count)
+{
+  char **commands = NULL;
+  size_t capacity = 0;
+  *count = 0;
+  *line_numbers = NULL;
+  FILE *file = fopen(path, "re");
+  if (!file) {
+    errnof("open '%s' failed", path);
+    return err_fail;
+  }
+  char *line = NULL;
+  size_t line_size = 0;
+  for (unsigned line_number = 1; ; line_number++) {
+    ssize_t length = getline(&line, &line_size, file);
+    if (length == -1)
+      break;
+    if (length > 0 && line[length - 1] == '\n')
+      line[--length] = '\0';
+    if (length == 0 || line[0] == '#')
+      continue;
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      char **new_commands = realloc(commands, capacity * sizeof(char*));
+      unsigned *new_numbers = realloc(*line_numbers, capacity * sizeof(unsigned));
+      if (new_commands)
+        commands = new_commands;
+      if (new_numbers)
+        *line_numbers = new_numbers;
+      if (!new_commands || !new_numbers)
+        goto fail;
+    }
+    if (!(commands[*count] = strdup(line)))
+      goto fail;
+    (*line_numbers)[(*count)++] = line_number;
+  }
+  free(line);
+  fclose(file);
+  *commands_out = commands;
+  return err_pass;
+ fail:
+  errnof("out of memory reading '%s'", path);
+  for (size_t i = 0; i < *count; i++)
+    free(commands[i]);
+  free(commands);
+  free(*line_numbers);
+  *line_numbers = NULL;
+  *count = 0;
+  free(line);
+  fclose(file);
+  return err_fail;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// writes out the complete lines collected from a command, or everything if all is set
+static void flush_output(struct job *job, int kind, unsigned char all)
+{
+  struct job_output *output = &job->output[kind - JOB_STDOUT];
+  FILE *stream = (kind == JOB_STDOUT) ? stdout : stderr;
+  size_t start = 0;
+  for (;;) {
+    char *newline = memchr(output->line + start, '\n', output->length - start);
+    size_t end = newline ? (size_t)(newline - output->line) : output->length;
+    if (!newline && (!all || end == start))
+      break;
+    fprintf(stream, "[%u] %.*s\n", job->line_number, (int)(end - start), output->line + start);
+    start = newline ? end + 1 : end;
+  }
+  fflush(stream);
+  memmove(output->line, output->line + start, output->length - start);
+  output->length -= start;
+}
+
+static void close_output(struct batch *batch, struct job *job, int kind)
+{
+  struct job_output *output = &job->output[kind - JOB_STDOUT];
+  flush_output(job, kind, 1);
+  epoll_ctl(batch->epoll_fd, EPOLL_CTL_DEL, output->fd, NULL);
+  close(output->fd);
+  output->fd = -1;
+}
+
+static void read_output(struct batch *batch, struct job *job, int kind)
+{
+  struct job_output *output = &job->output[kind - JOB_STDOUT];
+  if (output->capacity - output->length < 4096) {
+    size_t capacity = output->capacity ? output->capacity * 2 : 8192;
+    char *line = realloc(output->line, capacity);
+    if (!line) {
+      errnof("out of memory for the output of line %u", job->line_number);
+      close_output(batch, job, kind);
+      return;
+    }
+    output->line = line;
+    output->capacity = capacity;
+  }
+  ssize_t size = read(output->fd, output->line + output->length, output->capacity - output->length);
+  if (size == -1 && (errno == EINTR || errno == EAGAIN))
+    return;
+  if (size <= 0) {
+    close_output(batch, job, kind);
+    return;
+  }
+  output->length += size;
+  flush_output(job, kind, output->length >= MAX_LINE_LENGTH);
+}
+
+// returns: 1 if the job's command has exited and all of its output has been written
+static unsigned char is_done(struct job *job)
+{
+  return job->pidfd == -1 && job->output[0].fd == -1 && job->output[1].fd == -1;
+}
+
+static void finish_job(struct batch *batch, struct job *job)
+{
+  int status = job->status;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    batch->failed++;
+  if (WIFEXITED(status)) {
+    fprintf(stderr, "[%u] exit %d in %.3fs: %s\n", job->line_number, WEXITSTATUS(status),
+            seconds_since(&job->start), job->command);
+  } else {
+    fprintf(stderr, "[%u] signal %d in %.3fs: %s\n", job->line_number, WTERMSIG(status),
+            seconds_since(&job->start), job->command);
+  }
+  job->line_number = 0;
+}
+
+static void reap_job(struct batch *batch, struct job *job)
+{
+  siginfo_t info;
+  memset(&info, 0, sizeof(info));
+  if (-1 == waitid(P_PIDFD, job->pidfd, &info, WEXITED)) {
+    errnof("waitid failed");
+    job->status = 127 << 8; // failed, like a command that couldn't be run
+  } else {
+    job->status = (info.si_code == CLD_EXITED) ?
+      (info.si_status & 0xff) << 8 : (info.si_status & 0x7f);
+  }
+  epoll_ctl(batch->epoll_fd, EPOLL_CTL_DEL, job->pidfd, NULL);
+  close(job->pidfd);
+  job->pidfd = -1;
+}
+
+static err_t watch(struct batch *batch, int fd, size_t slot, int kind)
+{
+  struct epoll_event event = { .events = EPOLLIN, .data.u64 = (slot << JOB_KIND_BITS) | kind };
+  if (-1 == epoll_ctl(batch->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+    errnof("epoll_ctl failed");
+    return err_fail;
+  }
+  return err_pass;
+}
+
+// opens where a command's stdout and stderr go, the write ends of pipes unless there's an
+// output directory
+static err_t open_outputs(struct batch *batch, struct job *job, int fds[2])
+{
+  if (batch->output_dir_fd != -1) {
+    static const char *const suffixes[2] = { "out", "err" };
+    for (int i = 0; i < 2; i++) {
+      char name[32];
+      snprintf(name, sizeof(name), "%u.%s", job->line_number, suffixes[i]);
+      fds[i] = openat(batch->output_dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (fds[i] == -1) {
+        errnof("open output '%s' failed", name);
+        if (i == 1)
+          close(fds[0]);
+        return err_fail;
+      }
+    }
+    return err_pass;
+  }
+  for (int i = 0; i < 2; i++) {
+    int pipe_fds[2];
+    if (-1 == pipe2(pipe_fds, O_CLOEXEC)) {
+      errnof("pipe failed");
+      if (i == 1) {
+        close(fds[0]);
+        close(job->output[0].fd);
+        job->output[0].fd = -1;
+      }
+      return err_fail;
+    }
+    job->output[i].fd = pipe_fds[0];
+    fds[i] = pipe_fds[1];
+  }
+  return err_pass;
+}
+
+// waits for a command that can't be followed, its output is lost
+static void abandon_job(struct batch *batch, struct job *job)
+{
+  for (int i = 0; i < 2; i++) {
+    if (job->output[i].fd != -1) {
+      epoll_ctl(batch->epoll_fd, EPOLL_CTL_DEL, job->output[i].fd, NULL);
+      close(job->output[i].fd);
+      job->output[i].fd = -1;
+    }
+  }
+  reap_job(batch, job);
+}
+
+static err_t start_job(struct batch *batch, struct job *job, size_t slot)
+{
+  clock_gettime(CLOCK_MONOTONIC, &job->start);
+  job->status = 127 << 8;
+  job->pidfd = -1;
+  int fds[2];
+  job->output[0].fd = job->output[1].fd = -1;
+  job->output[0].length = job->output[1].length = 0;
+  if (open_outputs(batch, job, fds))
+    return err_fail;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+  posix_spawn_file_actions_adddup2(&actions, batch->null_fd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fds[0], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+  {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+  }
+  const char *argv[] = { "/bin/sh", "-c", job->command, NULL };
+  pid_t pid;
+  int error = posix_spawn(&pid, argv[0], &actions, &attr, (char *const*)argv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[0]);
+  close(fds[1]);
+  if (error) {
+    errno = error;
+    errnof("spawn line %u failed", job->line_number);
+  } else if (-1 == (job->pidfd = pidfd_open(pid, 0))) {
+    errnof("pidfd_open %d failed", pid);
+    waitpid(pid, NULL, 0);
+  }
+  if (error || job->pidfd == -1) {
+    for (int i = 0; i < 2; i++) {
+      if (job->output[i].fd != -1)
+        close(job->output[i].fd);
+    }
+    return err_fail;
+  }
+  if (watch(batch, job->pidfd, slot, JOB_PIDFD) ||
+      (job->output[0].fd != -1 && watch(batch, job->output[0].fd, slot, JOB_STDOUT)) ||
+      (job->output[1].fd != -1 && watch(batch, job->output[1].fd, slot, JOB_STDERR))) {
+    abandon_job(batch, job);
+    return err_fail;
+  }
+  return err_pass;
+}
+
+static err_t run_batch(struct batch *batch, char **commands, unsigned *line_numbers, size_t count,
+                       struct job *jobs, unsigned job_count)
+{
+  size_t next = 0;
+  unsigned running = 0;
+  for (;;) {
+    for (size_t slot = 0; slot < job_count && next < count; slot++) {
+      struct job *job = &jobs[slot];
+      if (job->line_number)
+        continue;
+      job->line_number = line_numbers[next];
+      job->command = commands[next];
+      next++;
+      if (start_job(batch, job, slot)) {
+        // it's counted as failed and the rest still run
+        finish_job(batch, job);
+        continue;
+      }
+      running++;
+    }
+    if (running == 0)
+      return err_pass;
+
+    struct epoll_event events[64];
+    int event_count = epoll_wait(batch->epoll_fd, events, 64, -1);
+    if (event_count == -1) {
+      if (errno == EINTR)
+        continue;
+      errnof("epoll_wait failed");
+      return err_fail;
+    }
+    for (int i = 0; i < event_count; i++) {
+      size_t slot = events[i].data.u64 >> JOB_KIND_BITS;
+      int kind = events[i].data.u64 & ((1 << JOB_KIND_BITS) - 1);
+      struct job *job = &jobs[slot];
+      if (kind == JOB_PIDFD) {
+        if (job->pidfd != -1)
+          reap_job(batch, job);
+      } else if (job->output[kind - JOB_STDOUT].fd != -1) {
+        read_output(batch, job, kind);
+      }
+      if (job->line_number && is_done(job)) {
+        finish_job(batch, job);
+        running--;
+      }
+    }
+  }
+}
+
+int batch_run(const char *root, const char *cwd, const char *command_file, unsigned job_count,
+              const char *output_dir)
+{
+  size_t count;
+  unsigned *line_numbers;
+  char **commands;
+  if (read_commands(command_file, &commands, &line_numbers, &count))
+    return 1; // error already logged
+  struct batch batch = { .epoll_fd = -1, .null_fd = -1, .output_dir_fd = -1, .failed = 0 };
+  struct job *jobs = calloc(job_count, sizeof(struct job));
+  err_t result = err_fail;
+  if (!jobs) {
+    errnof("malloc failed");
+    goto done;
+  }
+  // these are opened outside the view, it may not have a /dev
+  batch.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (batch.null_fd == -1) {
+    errnof("open '/dev/null' failed");
+    goto done;
+  }
+  if (output_dir) {
+    if (-1 == mkdir(output_dir, 0755) && errno != EEXIST) {
+      errnof("mkdir '%s' failed", output_dir);
+      goto done;
+    }
+    batch.output_dir_fd = open(output_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (batch.output_dir_fd == -1) {
+      errnof("open '%s' failed", output_dir);
+      goto done;
+    }
+  }
+  batch.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (batch.epoll_fd == -1) {
+    errnof("epoll_create1 failed");
+    goto done;
+  }
+  struct report report;
+  log_report_init(&report);
+  if (view_enter(&report, root, cwd))
+    goto done; // error already logged
+  signal(SIGPIPE, SIG_IGN);
+  result = run_batch(&batch, commands, line_numbers, count, jobs, job_count);
+  if (!result && batch.failed)
+    errf("%u of %zu commands failed", batch.failed, count);
+
+ done:
+  if (batch.epoll_fd != -1)
+    close(batch.epoll_fd);
+  if (batch.null_fd != -1)
+    close(batch.null_fd);
+  if (batch.output_dir_fd != -1)
+    close(batch.output_dir_fd);
+  for (unsigned i = 0; jobs && i < job_count; i++) {
+    free(jobs[i].output[0].line);
+    free(jobs[i].output[1].line);
+  }
+  free(jobs);
+  for (size_t i = 0; i < count; i++)
+    free(commands[i]);
+  free(commands);
+  free(line_numbers);
+  return (result || batch.failed) ? 1 : 0;
+}
@@ -0,0 +1,6 @@
+// runs each command in command_file in the view at root, entering it once, with up to
+// job_count running at a time. Output is prefixed with the command's line number, or goes
+// to files in output_dir if it isn't NULL.
+// returns: 0 if every command ran and exited with 0, 1 otherwise
+int batch_run(const char *root, const char *cwd, const char *command_file, unsigned job_count,
+              const char *output_dir);
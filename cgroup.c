@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "concat.h"
+#include "cgroup.h"
+
+// returns: where the cgroup2 hierarchy is mounted, /sys/fs/cgroup on most hosts and
+//          /sys/fs/cgroup/unified on hybrid ones, or NULL if it isn't
+static char *get_cgroup2_mount(void)
+{
+  FILE *mnts = setmntent("/proc/mounts", "r");
+  if (mnts == NULL) {
+    errnof("setmntent '/proc/mounts' failed");
+    return NULL;
+  }
+  struct mntent *entry;
+  while ((entry = getmntent(mnts)) && 0 != strcmp(entry->mnt_type, "cgroup2"))
+    ;
+  char *mount_dir = entry ? strdup(entry->mnt_dir) : NULL;
+  if (!entry)
+    errf("there is no cgroup2 filesystem mounted");
+  else if (!mount_dir)
+    errnof("strdup failed");
+  endmntent(mnts);
+  return mount_dir;
+}
+
+static err_t write_file(const char *dir, const char *name, const char *value)
+{
+  char *path = concat(dir, "/", name);
+  if (!path) {
+    errnof("concat failed");
+    return err_fail;
+  }
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  err_t result = err_pass;
+  if (fd == -1 || write(fd, value, strlen(value)) < 0)
+    result = err_fail;
+  int error = errno;
+  if (fd != -1)
+    close(fd);
+  free(path);
+  errno = error;
+  return result;
+}
+
+/*
+A controller's files only show up in a group once every group above it has the
+controller in its cgroup.subtree_control. A group that has processes in it can't give
+controllers to its children (unless it's the root), and a delegated hierarchy may not
+have them to give, so failures are left for the limits that need them to report.
+*/
+static void enable_controllers(const char *dir)
+{
+  static const char *const controllers[] = {"+io", "+memory", "+cpu"};
+  for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++)
+    write_file(dir, "cgroup.subtree_control", controllers[i]);
+}
+
+// makes each group from the root down to group, enabling the controllers in the ones above it
+static err_t make_group(char *group, size_t root_length)
+{
+  group[root_length] = '\0';
+  enable_controllers(group);
+  group[root_length] = '/';
+  for (char *slash = group + root_length; (slash = strchr(slash + 1, '/')); ) {
+    *slash = '\0';
+    int result = mkdir(group, 0755);
+    if (-1 == result && errno != EEXIST) {
+      errnof("mkdir '%s' failed", group);
+      *slash = '/';
+      return err_fail;
+    }
+    enable_controllers(group);
+    *slash = '/';
+  }
+  if (-1 == mkdir(group, 0755) && errno != EEXIST) {
+    errnof("mkdir '%s' failed", group);
+    return err_fail;
+  }
+  return err_pass;
+}
+
+char *cgroup_join(const char *path, const char *memory_high, const char *io_max)
+{
+  char *root = get_cgroup2_mount();
+  if (!root)
+    return NULL;
+  char *group = (path[0] == '/') ? strdup(path) : concat(root, "/", path);
+  if (!group) {
+    errnof("malloc failed");
+    free(root);
+    return NULL;
+  }
+  size_t root_length = strlen(root);
+  if (0 != strncmp(group, root, root_length) || group[root_length] != '/') {
+    errf("cgroup '%s' is not under the cgroup2 mount '%s'", group, root);
+    goto fail;
+  }
+  if (make_group(group, root_length))
+    goto fail;
+  if (memory_high && write_file(group, "memory.high", memory_high)) {
+    errnof("set memory.high of '%s' to '%s' failed", group, memory_high);
+    goto fail;
+  }
+  if (io_max && write_file(group, "io.max", io_max)) {
+    errnof("set io.max of '%s' to '%s' failed", group, io_max);
+    goto fail;
+  }
+  if (write_file(group, "cgroup.procs", "0")) {
+    errnof("join cgroup '%s' failed", group);
+    goto fail;
+  }
+  free(root);
+  return group;
+ fail:
+  free(group);
+  free(root);
+  return NULL;
+}
+
+// writes the "<key> <value>" or "<key>=<value>" fields of a line as JSON members
+static void write_json_fields(FILE *file, char *fields, char separator)
+{
+  unsigned char first = 1;
+  for (char *field = strtok(fields, " \n"); field; field = strtok(NULL, " \n")) {
+    char *value = (separator == ' ') ? strtok(NULL, " \n") : strchr(field, separator);
+    if (!value)
+      break;
+    if (separator != ' ')
+      *value++ = '\0';
+    fprintf(file, "%s\"%s\":%s", first ? "" : ",", field, value);
+    first = 0;
+  }
+}
+
+// returns: the contents of group/name, or NULL if it can't be read (like a controller
+//          that isn't enabled)
+static char *read_file(const char *group, const char *name)
+{
+  char *path = concat(group, "/", name);
+  if (!path)
+    return NULL;
+  FILE *file = fopen(path, "re");
+  free(path);
+  if (!file)
+    return NULL;
+  char *contents = NULL;
+  size_t size = 0;
+  ssize_t length = getdelim(&contents, &size, '\0', file);
+  fclose(file);
+  if (length < 0) {
+    free(contents);
+    return NULL;
+  }
+  return contents;
+}
+
+err_t cgroup_write_stats(const char *group, int status, FILE *file)
+{
+  fputs("{\"cgroup\":\"", file);
+  fputs(group, file);
+  if (WIFEXITED(status))
+    fprintf(file, "\",\"exit_status\":%d", WEXITSTATUS(status));
+  else
+    fprintf(file, "\",\"signal\":%d", WTERMSIG(status));
+
+  // "<major>:<minor> rbytes=<n> wbytes=<n> ..." for each device
+  fputs(",\"io\":{", file);
+  char *io_stat = read_file(group, "io.stat");
+  unsigned char first = 1;
+  for (char *line = io_stat, *next; line && *line; line = next) {
+    next = strchrnul(line, '\n');
+    if (*next)
+      *next++ = '\0';
+    char *device_end = strchr(line, ' ');
+    if (!device_end)
+      continue;
+    *device_end = '\0';
+    fprintf(file, "%s\"%s\":{", first ? "" : ",", line);
+    write_json_fields(file, device_end + 1, '=');
+    fputc('}', file);
+    first = 0;
+  }
+  free(io_stat);
+  fputc('}', file);
+
+  char *memory_peak = read_file(group, "memory.peak");
+  fprintf(file, ",\"memory_peak\":%s", memory_peak ? strtok(memory_peak, "\n") : "null");
+  free(memory_peak);
+
+  // "<key> <value>" lines
+  fputs(",\"cpu\":{", file);
+  char *cpu_stat = read_file(group, "cpu.stat");
+  if (cpu_stat)
+    write_json_fields(file, cpu_stat, ' ');
+  free(cpu_stat);
+  fputs("}}\n", file);
+  if (fflush(file)) {
+    errnof("write cgroup stats failed");
+    return err_fail;
+  }
+  return err_pass;
+}
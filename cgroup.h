@@ -0,0 +1,10 @@
+// Per view cgroup v2 groups for inroot.
+
+// makes the group at path if it doesn't exist (a relative path is under the cgroup2
+// mount), enables the io, memory and cpu controllers above it, applies the limits that
+// aren't NULL and moves this process into it
+// returns: the group's directory, or NULL on error
+char *cgroup_join(const char *path, const char *memory_high, const char *io_max);
+// writes the group's io.stat, memory.peak and cpu.stat as a line of JSON, along with the
+// wait status of the command that ran in it
+err_t cgroup_write_stats(const char *group, int status, FILE *file);
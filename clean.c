@@ -1,14 +1,33 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <mntent.h>
 
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/sysmacros.h>
+
+#include <linux/io_uring.h>
 
 #include "common.h"
+#include "vector.h"
+#include "report.h"
+#include "clean.h"
+#include "uring.h"
+
+// what the functions removing a tree share
+struct clean
+{
+  struct report *report;
+  // NULL to use plain syscalls
+  struct uring *ring;
+};
 
 char *realpath2(const char *path)
 {
@@ -17,14 +36,12 @@ char *realpath2(const char *path)
   return result ? strdup(result) : NULL;
 }
 
-err_t loggy_remove(const char *path)
+err_t loggy_remove(struct report *report, const char *path)
 {
-  logf("[DEBUG] remove '%s'", path);
   int result = remove(path);
-  if (result) {
-    errnof("remove '%s' failed", path);
-    return 1;
-  }
+  report_op(report, REPORT_REMOVE, "remove", path, NULL, result ? errno : 0);
+  if (result)
+    return report_errno(report, "remove '%s' failed", path);
   return 0;
 }
 
@@ -34,9 +51,9 @@ unsigned char is_dot_or_dot_dot(const char *s)
     (s[1] == '\0' || (s[1] == '.' && s[2] == '\0'));
 }
 
-static unsigned clean_dir(dev_t root_dev, const char *dir, dev_t dir_dev);
+static unsigned clean_dir(struct clean *clean, dev_t root_dev, const char *dir, dev_t dir_dev);
 
-static unsigned clean_dir_entries(dev_t root_dev, const char *dir, DIR *dir_handle)
+static unsigned clean_dir_entries(struct clean *clean, dev_t root_dev, const char *dir, DIR *dir_handle)
 {
   unsigned error_count = 0;
   size_t dir_length = strlen(dir);
@@ -47,7 +64,7 @@ static unsigned clean_dir_entries(dev_t root_dev, const char *dir, DIR *dir_hand
     if (entry == NULL) {
       if (errno) {
         error_count++;
-        errnof("readdir '%s' failed", dir);
+        report_errno(clean->report, "readdir '%s' failed", dir);
       }
       break;
     }
@@ -57,7 +74,8 @@ static unsigned clean_dir_entries(dev_t root_dev, const char *dir, DIR *dir_hand
     size_t entry_name_length = dir_length + 1 + strlen(entry->d_name);
     char *entry_name = malloc(entry_name_length + 1);
     if (!entry_name) {
-      errnof("malloc failed");
+      report_errno(clean->report, "malloc failed");
+      error_count++;
       continue;
     }
     memcpy(entry_name, dir, dir_length);
@@ -66,13 +84,13 @@ static unsigned clean_dir_entries(dev_t root_dev, const char *dir, DIR *dir_hand
 
     struct stat entry_stat;
     if (-1 == lstat(entry_name, &entry_stat)) {
-      errnof("lstat on '%s' failed", entry_name);
+      report_errno(clean->report, "lstat on '%s' failed", entry_name);
       error_count++;
     } else {
       if (S_ISDIR(entry_stat.st_mode)) {
-        error_count += clean_dir(root_dev, entry_name, entry_stat.st_dev);
+        error_count += clean_dir(clean, root_dev, entry_name, entry_stat.st_dev);
       } else {
-        error_count += loggy_remove(entry_name);
+        error_count += loggy_remove(clean->report, entry_name);
       }
     }
     free(entry_name);
@@ -80,24 +98,213 @@ static unsigned clean_dir_entries(dev_t root_dev, const char *dir, DIR *dir_hand
   return error_count;
 }
 
-static int loggy_umount(const char *dir)
+/*
+The io_uring version of clean_dir_entries. Entries are read with getdents64 into a
+large buffer, then every file is removed with an IORING_OP_UNLINKAT, keeping up to a
+ring's worth of them in flight. Directories (and entries the filesystem didn't give
+a type for) get an IORING_OP_STATX first, directories need their device number to
+find mount points so they are cleaned with clean_dir once this directory's files
+are gone.
+*/
+#define URING_ENTRIES 256
+#define GETDENTS_BUFFER_SIZE (64 * 1024)
+
+// an entry being statx'd or unlinked, owned by the ring while it is in flight
+struct entry_op
+{
+  unsigned char is_statx;
+  unsigned name_offset;
+  struct statx statx;
+  char path[];
+};
+DEFINE_TYPED_VECTOR(entry_op, struct entry_op);
+
+struct uring_dir
+{
+  struct clean *clean;
+  struct uring *ring;
+  int fd;
+  unsigned in_flight;
+  unsigned error_count;
+  struct entry_op_vector subdirs;
+};
+
+static err_t queue_entry_op(struct uring_dir *dir, struct entry_op *op);
+
+static void complete_entry_op(struct uring_dir *dir, struct entry_op *op, int result)
+{
+  if (op->is_statx) {
+    if (result < 0) {
+      errno = -result;
+      report_errno(dir->clean->report, "statx on '%s' failed", op->path);
+      dir->error_count++;
+    } else if (S_ISDIR(op->statx.stx_mode)) {
+      if (entry_op_vector_add(&dir->subdirs, op) == err_pass)
+        return;
+      report_errno(dir->clean->report, "malloc failed");
+      dir->error_count++;
+    } else {
+      op->is_statx = 0;
+      if (queue_entry_op(dir, op) == err_pass)
+        return;
+      dir->error_count++;
+    }
+    free(op);
+    return;
+  }
+  report_op(dir->clean->report, REPORT_REMOVE, "remove", op->path, NULL, result < 0 ? -result : 0);
+  if (result < 0) {
+    errno = -result;
+    report_errno(dir->clean->report, "remove '%s' failed", op->path);
+    dir->error_count++;
+  }
+  free(op);
+}
+
+// submits what is queued and handles completions, waiting for at least wait_count
+static err_t reap_entry_ops(struct uring_dir *dir, unsigned wait_count)
+{
+  if (uring_submit(dir->ring, wait_count))
+    return report_errno(dir->clean->report, "io_uring_enter failed");
+  for (;;) {
+    struct io_uring_cqe *cqe = uring_peek_cqe(dir->ring);
+    if (!cqe)
+      return err_pass;
+    struct entry_op *op = (struct entry_op*)(uintptr_t)cqe->user_data;
+    int result = cqe->res;
+    uring_cqe_seen(dir->ring);
+    dir->in_flight--;
+    complete_entry_op(dir, op, result);
+  }
+}
+
+static err_t queue_entry_op(struct uring_dir *dir, struct entry_op *op)
 {
-  logf("umount %s", dir);
-  if (-1 == umount(dir)) {
-    errnof("umount '%s' failed", dir);
+  struct io_uring_sqe *sqe;
+  // never have more in flight than the completion queue can hold
+  while (dir->in_flight >= dir->ring->entries || !(sqe = uring_get_sqe(dir->ring))) {
+    if (reap_entry_ops(dir, 1))
+      return err_fail;
+  }
+  sqe->fd = dir->fd;
+  sqe->addr = (uintptr_t)(op->path + op->name_offset);
+  sqe->user_data = (uintptr_t)op;
+  if (op->is_statx) {
+    sqe->opcode = IORING_OP_STATX;
+    sqe->len = STATX_TYPE;
+    sqe->off = (uintptr_t)&op->statx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+  } else {
+    sqe->opcode = IORING_OP_UNLINKAT;
+  }
+  dir->in_flight++;
+  return err_pass;
+}
+
+static unsigned clean_dir_entries_uring(struct clean *clean, dev_t root_dev, const char *dir)
+{
+  struct uring_dir state;
+  memset(&state, 0, sizeof(state));
+  state.clean = clean;
+  state.ring = clean->ring;
+  state.fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (state.fd == -1)
+    return report_errno(clean->report, "open '%s' failed", dir);
+  char *buffer = malloc(GETDENTS_BUFFER_SIZE);
+  if (!buffer) {
+    report_errno(clean->report, "malloc failed");
+    close(state.fd);
+    return 1;
+  }
+  size_t dir_length = strlen(dir);
+  for (;;) {
+    ssize_t size = getdents64(state.fd, buffer, GETDENTS_BUFFER_SIZE);
+    if (size == -1) {
+      report_errno(clean->report, "getdents64 '%s' failed", dir);
+      state.error_count++;
+      break;
+    }
+    if (size == 0)
+      break;
+    for (ssize_t offset = 0; offset < size; ) {
+      struct dirent64 *entry = (struct dirent64*)(buffer + offset);
+      offset += entry->d_reclen;
+      if (is_dot_or_dot_dot(entry->d_name))
+        continue;
+      size_t name_length = strlen(entry->d_name);
+      struct entry_op *op = malloc(sizeof(struct entry_op) + dir_length + 1 + name_length + 1);
+      if (!op) {
+        report_errno(clean->report, "malloc failed");
+        state.error_count++;
+        continue;
+      }
+      memcpy(op->path, dir, dir_length);
+      op->path[dir_length] = '/';
+      memcpy(op->path + dir_length + 1, entry->d_name, name_length + 1);
+      op->name_offset = dir_length + 1;
+      op->is_statx = entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN;
+      if (queue_entry_op(&state, op)) {
+        // the ring is broken, ops that are in flight can't be freed
+        close(state.fd);
+        free(buffer);
+        return state.error_count + 1;
+      }
+    }
+    // get the kernel started on this batch while the next one is read
+    if (uring_submit(state.ring, 0)) {
+      report_errno(clean->report, "io_uring_enter failed");
+      state.error_count++;
+      break;
+    }
+  }
+  while (state.in_flight) {
+    if (reap_entry_ops(&state, 1)) {
+      close(state.fd);
+      free(buffer);
+      return state.error_count + 1;
+    }
+  }
+  close(state.fd);
+  free(buffer);
+
+  for (size_t i = 0; i < entry_op_vector_size(&state.subdirs); i++) {
+    struct entry_op *subdir = entry_op_vector_get(&state.subdirs, i);
+    dev_t subdir_dev = makedev(subdir->statx.stx_dev_major, subdir->statx.stx_dev_minor);
+    state.error_count += clean_dir(clean, root_dev, subdir->path, subdir_dev);
+    free(subdir);
+  }
+  entry_op_vector_free(&state.subdirs);
+  return state.error_count;
+}
+
+static int loggy_umount(struct report *report, const char *dir)
+{
+  int result = umount(dir);
+  report_op(report, REPORT_UMOUNT, "umount", dir, NULL, result ? errno : 0);
+  if (-1 == result) {
+    report_errno(report, "umount '%s' failed", dir);
     return -1; // fail
   }
   return 0; // success
 }
 
-static char *get_biggest_mount(const char *prefix, size_t prefix_length)
+// returns: 1 if mnt_dir is prefix or somewhere under it, "/a/b1" isn't under "/a/b"
+static unsigned char mount_is_under(const char *prefix, size_t prefix_length, const char *mnt_dir)
+{
+  if (0 != strncmp(prefix, mnt_dir, prefix_length))
+    return 0;
+  return mnt_dir[prefix_length] == '\0' || mnt_dir[prefix_length] == '/' ||
+    (prefix_length && prefix[prefix_length - 1] == '/');
+}
+
+static char *get_biggest_mount(struct report *report, const char *prefix, size_t prefix_length)
 {
   char *biggest_mount = NULL;
   size_t biggest_mount_length = 0;
 
   FILE *mnts = setmntent("/proc/mounts", "r");
   if (mnts == NULL) {
-    errnof("setmntent 'proc/mounts' failed");
+    report_errno(report, "setmntent 'proc/mounts' failed");
     return NULL;
   }
   for (;;) {
@@ -106,7 +313,7 @@ static char *get_biggest_mount(const char *prefix, size_t prefix_length)
       // TODO: check errno
       break;
     }
-    if (0 == strncmp(prefix, entry->mnt_dir, prefix_length)) {
+    if (mount_is_under(prefix, prefix_length, entry->mnt_dir)) {
       size_t new_length = strlen(entry->mnt_dir);
       if (new_length > biggest_mount_length) {
         if (biggest_mount)
@@ -121,17 +328,17 @@ static char *get_biggest_mount(const char *prefix, size_t prefix_length)
 }
 
 // TODO: this could be coded to be faster
-static unsigned try_clean_mounts(const char *dir)
+static unsigned try_clean_mounts(struct report *report, const char *dir)
 {
   unsigned unmount_count = 0;
   size_t dir_length = strlen(dir);
   // unmount the biggest ones first, because mounts higher
   // in the tree will not get unmounted if they have submounts
   for (;;) {
-    char *biggest_mount = get_biggest_mount(dir, dir_length);
+    char *biggest_mount = get_biggest_mount(report, dir, dir_length);
     if (!biggest_mount)
       break;
-    int mount_result = loggy_umount(biggest_mount);
+    int mount_result = loggy_umount(report, biggest_mount);
     free(biggest_mount);
     if (mount_result == -1)
       break;
@@ -140,7 +347,9 @@ static unsigned try_clean_mounts(const char *dir)
   return unmount_count;
 }
 
-static unsigned char is_bind_mount(const char *dir, size_t dir_length)
+// returns: 1 if dir is a bind mount, 0 if it isn't, -1 if the check is broken and it can't
+// tell, the caller must then leave dir alone rather than empty it
+static int is_bind_mount(struct report *report, const char *dir, size_t dir_length)
 {
   // http://blog.schmorp.de/2016-03-03-detecting-a-mount-point.html
   // This is a hack to determine if a path is a bind mount. It attempts
@@ -154,8 +363,8 @@ static unsigned char is_bind_mount(const char *dir, size_t dir_length)
   strcpy(to   + dir_length, "/.");
   int result = rename(from, to);
   if (result != -1) {
-    errf("rename '%s' to '%s' should not have worked!!!!", from, to);
-    exit(1);
+    report_error(report, EINVAL, "rename '%s' to '%s' should not have worked!!!!", from, to);
+    return -1;
   }
   return errno == EXDEV;
 }
@@ -169,16 +378,21 @@ clean_dir uses this to know when a subdirectory is just a mount point to
 another filesystem.  it will then proceed to unmount instead of removing
 files inside the mount point
 */
-static unsigned clean_dir(dev_t root_dev, const char *dir, dev_t dir_dev)
+static unsigned clean_dir(struct clean *clean, dev_t root_dev, const char *dir, dev_t dir_dev)
 {
   //logf("[DEBUG] clean_dir '%s' (root_dev=%lu, dev=%lu)", dir, root_dev, dir_dev);
   // unmount the directory
-  while (dir_dev != root_dev || is_bind_mount(dir, strlen(dir))) {
+  for (;;) {
+    int mounted = (dir_dev != root_dev) ? 1 : is_bind_mount(clean->report, dir, strlen(dir));
+    if (mounted == -1)
+      return 1; // error already logged, nothing in dir is removed
+    if (!mounted)
+      break;
     // TODO: maybe this loop should have a max number of attempts?
 
     //loggy.run(["sudo", "umount", dir])
-    if (-1 == loggy_umount(dir)) {
-      unsigned removed = try_clean_mounts(dir);
+    if (-1 == loggy_umount(clean->report, dir)) {
+      unsigned removed = try_clean_mounts(clean->report, dir);
       if (removed == 0) {
         // errors already logged
         return 1;
@@ -187,51 +401,143 @@ static unsigned clean_dir(dev_t root_dev, const char *dir, dev_t dir_dev)
     }
 
     struct stat dir_stat;
-    if (-1 == stat(dir, &dir_stat)) {
-      errnof("stat on '%s' failed after unmounting it", dir);
-      return 1;
-    }
+    if (-1 == stat(dir, &dir_stat))
+      return report_errno(clean->report, "stat on '%s' failed after unmounting it", dir);
     dir_dev = dir_stat.st_dev;
   }
 
-  DIR *dir_handle = opendir(dir);
-  if (dir_handle == NULL) {
-    errnof("opendir '%s' failed", dir);
-    return 1;
+  unsigned error_count;
+  if (clean->ring) {
+    error_count = clean_dir_entries_uring(clean, root_dev, dir);
+  } else {
+    DIR *dir_handle = opendir(dir);
+    if (dir_handle == NULL)
+      return report_errno(clean->report, "opendir '%s' failed", dir);
+    error_count = clean_dir_entries(clean, root_dev, dir, dir_handle);
+    closedir(dir_handle);
   }
-  unsigned error_count = clean_dir_entries(root_dev, dir, dir_handle);
-  closedir(dir_handle);
 
-  error_count += loggy_remove(dir);
+  error_count += loggy_remove(clean->report, dir);
   return error_count;
 }
 
-unsigned loggy_rmtree(const char *dir)
+// cleans realdir with io_uring if the kernel supports it, plain syscalls otherwise
+static unsigned clean_root_dir(struct report *report, const char *realdir, dev_t root_dev,
+                               unsigned char sync)
 {
-  logf("[DEBUG] rmtree '%s'", dir);
-  struct stat dir_stat;
-  if (-1 == stat(dir, &dir_stat)) {
-    errnof("stat '%s' failed", dir);
-    return 1;
+  static const unsigned char opcodes[] = { IORING_OP_STATX, IORING_OP_UNLINKAT };
+  struct clean clean = { report, NULL };
+  struct uring ring;
+  if (sync || uring_init(&ring, URING_ENTRIES, opcodes, sizeof(opcodes)))
+    return clean_dir(&clean, root_dev, realdir, root_dev);
+  clean.ring = &ring;
+  unsigned error_count = clean_dir(&clean, root_dev, realdir, root_dev);
+  uring_free(&ring);
+  return error_count;
+}
+
+err_t read_mount_dirs(struct report *report, struct string_vector *mount_dirs)
+{
+  FILE *mnts = setmntent("/proc/mounts", "r");
+  if (mnts == NULL)
+    return report_errno(report, "setmntent 'proc/mounts' failed");
+  for (;;) {
+    struct mntent *entry = getmntent(mnts);
+    if (entry == NULL)
+      break;
+    char *mnt_dir = strdup(entry->mnt_dir);
+    if (!mnt_dir || string_vector_add(mount_dirs, mnt_dir)) {
+      report_errno(report, "failed to add '%s' to the mount list", entry->mnt_dir);
+      free(mnt_dir);
+      endmntent(mnts);
+      return err_fail;
+    }
   }
-  if (!S_ISDIR(dir_stat.st_mode)) {
-    errf("'%s' exists but is not a directory", dir);
-    return 1;
+  endmntent(mnts);
+  return err_pass;
+}
+
+static int compare_length_descending(const void *left, const void *right)
+{
+  size_t left_length = strlen(*(char**)left);
+  size_t right_length = strlen(*(char**)right);
+  return (left_length < right_length) - (left_length > right_length);
+}
+
+/*
+Gives each mount in mount_dirs to the view in realdirs that it lives under, if a
+mount lives under multiple views (because they are nested) the deepest one gets it.
+NULL entries in realdirs are skipped. view_mounts is an array of count vectors, each one ends up sorted so the deepest
+mounts come first, which is the order they need to be unmounted in.
+*/
+err_t split_mount_dirs(struct report *report, struct string_vector *mount_dirs, char **realdirs,
+                       size_t count, struct string_vector *view_mounts)
+{
+  for (size_t i = 0; i < string_vector_size(mount_dirs); i++) {
+    char *mnt_dir = string_vector_get(mount_dirs, i);
+    size_t owner = count;
+    size_t owner_length = 0;
+    for (size_t view = 0; view < count; view++) {
+      if (!realdirs[view])
+        continue;
+      size_t length = strlen(realdirs[view]);
+      if (length >= owner_length && mount_is_under(realdirs[view], length, mnt_dir)) {
+        owner = view;
+        owner_length = length;
+      }
+    }
+    if (owner < count && string_vector_add(&view_mounts[owner], mnt_dir))
+      return report_errno(report, "failed to add '%s' to the mount list", mnt_dir);
   }
-  // get the realdir so we can find it's mount points
-  const char *realdir = realpath2(dir);
-  if (!realdir) {
-    errnof("realpath '%s' failed", dir);
-    return 1;
+  for (size_t view = 0; view < count; view++) {
+    qsort(view_mounts[view].items, string_vector_size(&view_mounts[view]),
+          sizeof(char*), compare_length_descending);
   }
-  // start by trying to clean up the mounts
-  try_clean_mounts(realdir);
+  return err_pass;
+}
 
-  // need to get the new root dev number in case it changed from being unmounted
-  if (-1 == stat(realdir, &dir_stat)) {
-    errnof("stat '%s' failed", dir);
-    return 1;
+/*
+Like loggy_rmtree but starts by unmounting the given mounts instead of scanning the
+mount table for them. realdir must already be a real path and mounts must be sorted
+deepest first (see split_mount_dirs).
+*/
+unsigned loggy_rmtree_with_mounts(struct report *report, const char *realdir,
+                                  struct string_vector *mounts, unsigned char sync)
+{
+  for (size_t i = 0; i < string_vector_size(mounts); i++) {
+    // a failure here is ok, clean_dir will see the mount and try again
+    const char *mount = string_vector_get(mounts, i);
+    int result = umount(mount);
+    report_op(report, REPORT_UMOUNT, "umount", mount, NULL, result ? errno : 0);
   }
+  struct stat dir_stat;
+  if (-1 == stat(realdir, &dir_stat))
+    return report_errno(report, "stat '%s' failed", realdir);
+  if (!S_ISDIR(dir_stat.st_mode))
+    return report_error(report, ENOTDIR, "'%s' exists but is not a directory", realdir);
+  return clean_root_dir(report, realdir, dir_stat.st_dev, sync);
+}
+
+unsigned loggy_rmtree(struct report *report, const char *dir, unsigned char sync)
+{
+  struct stat dir_stat;
+  if (-1 == stat(dir, &dir_stat))
+    return report_errno(report, "stat '%s' failed", dir);
+  if (!S_ISDIR(dir_stat.st_mode))
+    return report_error(report, ENOTDIR, "'%s' exists but is not a directory", dir);
+  // get the realdir so we can find it's mount points
+  char *realdir = realpath2(dir);
+  if (!realdir)
+    return report_errno(report, "realpath '%s' failed", dir);
+  // start by trying to clean up the mounts
+  try_clean_mounts(report, realdir);
 
-  return clean_dir(dir_stat.st_dev, realdir, dir_stat.st_dev);
+  // need to get the new root dev number in case it changed from being unmounted
+  unsigned error_count;
+  if (-1 == stat(realdir, &dir_stat))
+    error_count = report_errno(report, "stat '%s' failed", dir);
+  else
+    error_count = clean_root_dir(report, realdir, dir_stat.st_dev, sync);
+  free(realdir);
+  return error_count;
 }
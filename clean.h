@@ -1,3 +1,13 @@
+DEFINE_TYPED_VECTOR(string, char);
+
+char *realpath2(const char *path);
 unsigned char is_dot_or_dot_dot(const char *s);
-err_t loggy_remove(const char *path);
-unsigned loggy_rmtree(const char *dir);
+err_t loggy_remove(struct report *report, const char *path);
+// sync removes files with plain syscalls even if io_uring is available
+unsigned loggy_rmtree(struct report *report, const char *dir, unsigned char sync);
+
+err_t read_mount_dirs(struct report *report, struct string_vector *mount_dirs);
+err_t split_mount_dirs(struct report *report, struct string_vector *mount_dirs, char **realdirs,
+                       size_t count, struct string_vector *view_mounts);
+unsigned loggy_rmtree_with_mounts(struct report *report, const char *realdir,
+                                  struct string_vector *mounts, unsigned char sync);
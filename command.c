@@ -0,0 +1,31 @@
+#include <errno.h>
+#include <spawn.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sys/wait.h>
+
+#include "common.h"
+#include "report.h"
+#include "command.h"
+
+extern char **environ;
+
+err_t run_command(struct report *report, const char *const argv[])
+{
+  pid_t pid;
+  int error = posix_spawnp(&pid, argv[0], NULL, NULL, (char**)argv, environ);
+  if (error)
+    return report_error(report, error, "run '%s' failed: %s", argv[0], strerror(error));
+  int status;
+  while (-1 == waitpid(pid, &status, 0)) {
+    if (errno != EINTR)
+      return report_errno(report, "wait for '%s' failed", argv[0]);
+  }
+  if (WIFSIGNALED(status))
+    return report_error(report, EIO, "'%s' was killed by signal %d", argv[0], WTERMSIG(status));
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return report_error(report, EIO, "'%s' failed with exit status %d", argv[0],
+                        WEXITSTATUS(status));
+  return err_pass;
+}
@@ -0,0 +1,5 @@
+// Running helper programs, include report.h first.
+
+// runs argv[0] from PATH with argv and waits for it
+// returns: an error unless it exits with status 0
+err_t run_command(struct report *report, const char *const argv[]);
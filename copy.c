@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <linux/fs.h>
+#include <linux/limits.h>
+
+#include "common.h"
+#include "concat.h"
+#include "report.h"
+#include "copy.h"
+
+err_t copy_data(struct report *report, int from, int to, const char *path, unsigned char *buffer)
+{
+  if (0 == ioctl(to, FICLONE, from))
+    return err_pass;
+  if (-1 == lseek(from, 0, SEEK_SET))
+    return report_errno(report, "lseek '%s' failed", path);
+  for (;;) {
+    ssize_t size = copy_file_range(from, NULL, to, NULL, COPY_BUFFER_SIZE, 0);
+    if (size == 0)
+      return err_pass;
+    if (size == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)
+        break;
+      return report_errno(report, "copy '%s' failed", path);
+    }
+  }
+  // nothing has been copied yet when copy_file_range can't be used at all
+  for (;;) {
+    ssize_t size = read(from, buffer, COPY_BUFFER_SIZE);
+    if (size == 0)
+      return err_pass;
+    if (size == -1) {
+      if (errno == EINTR)
+        continue;
+      return report_errno(report, "read '%s' failed", path);
+    }
+    for (ssize_t written = 0; written < size; ) {
+      ssize_t result = write(to, buffer + written, size - written);
+      if (result == -1) {
+        if (errno == EINTR)
+          continue;
+        return report_errno(report, "write '%s' failed", path);
+      }
+      written += result;
+    }
+  }
+}
+
+err_t copy_metadata(struct report *report, int fd, const struct stat *file_stat, const char *path)
+{
+  if (-1 == fchown(fd, file_stat->st_uid, file_stat->st_gid))
+    return report_errno(report, "chown '%s' failed", path);
+  if (-1 == fchmod(fd, file_stat->st_mode & 07777))
+    return report_errno(report, "chmod '%s' failed", path);
+  struct timespec times[2] = { file_stat->st_atim, file_stat->st_mtim };
+  if (-1 == futimens(fd, times))
+    return report_errno(report, "set times on '%s' failed", path);
+  return err_pass;
+}
+
+err_t copy_special(struct report *report, int dir_fd, int to_fd, const char *name,
+                   const struct stat *file_stat, const char *path)
+{
+  if (S_ISLNK(file_stat->st_mode)) {
+    char target[PATH_MAX];
+    ssize_t length = readlinkat(dir_fd, name, target, sizeof(target) - 1);
+    if (length == -1)
+      return report_errno(report, "readlink '%s' failed", path);
+    target[length] = '\0';
+    if (-1 == symlinkat(target, to_fd, name))
+      return report_errno(report, "symlink '%s' failed", path);
+  } else if (-1 == mknodat(to_fd, name, file_stat->st_mode, file_stat->st_rdev)) {
+    return report_errno(report, "mknod '%s' failed", path);
+  }
+  struct timespec times[2] = { file_stat->st_atim, file_stat->st_mtim };
+  if (-1 == fchownat(to_fd, name, file_stat->st_uid, file_stat->st_gid, AT_SYMLINK_NOFOLLOW) ||
+      -1 == utimensat(to_fd, name, times, AT_SYMLINK_NOFOLLOW))
+    return report_errno(report, "copy the metadata of '%s' failed", path);
+  return err_pass;
+}
+
+/*
+copy_tree's workers share a queue of directories. A worker takes one, copies its files
+and queues its subdirectories, so a wide tree keeps every worker busy and a reflink is
+only a metadata update, the time goes to the syscalls rather than the data. Making a
+directory's entries changes its times, so the directories get their metadata at the end,
+each one before its parent.
+*/
+struct copy_dir
+{
+  struct copy_dir *next;
+  char *path;
+  char *copy;
+  struct stat dir_stat;
+};
+
+struct copy_work
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  // directories waiting for a worker
+  struct copy_dir *queue;
+  // directories whose entries have been copied, newest first
+  struct copy_dir *done;
+  // the number of directories being copied right now
+  unsigned busy;
+  unsigned char failed;
+};
+
+struct copy_worker
+{
+  pthread_t thread;
+  struct copy_work *work;
+  // a worker doesn't share the caller's report, its callbacks may not be thread safe
+  struct report report;
+  unsigned char *buffer;
+};
+
+static void free_dirs(struct copy_dir *dir)
+{
+  while (dir) {
+    struct copy_dir *next = dir->next;
+    free(dir->path);
+    free(dir->copy);
+    free(dir);
+    dir = next;
+  }
+}
+
+static err_t copy_file(struct copy_worker *worker, int dir_fd, int copy_fd, const char *name,
+                       const struct stat *file_stat, const char *path)
+{
+  int from = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (-1 == from)
+    return report_errno(&worker->report, "open '%s' failed", path);
+  err_t result = err_pass;
+  int to = openat(copy_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR);
+  if (-1 == to) {
+    result = report_errno(&worker->report, "create the copy of '%s' failed", path);
+  } else {
+    result = copy_data(&worker->report, from, to, path, worker->buffer);
+    if (!result)
+      result = copy_metadata(&worker->report, to, file_stat, path);
+    close(to);
+  }
+  close(from);
+  return result;
+}
+
+// copies an entry of dir, a subdirectory is made empty and added to found
+static err_t copy_entry(struct copy_worker *worker, struct copy_dir *dir, int dir_fd, int copy_fd,
+                        const char *name, struct copy_dir **found)
+{
+  char *path = concat(dir->path, "/", name);
+  if (!path)
+    return report_errno(&worker->report, "concat paths failed");
+  err_t result = err_pass;
+  struct stat entry_stat;
+  if (-1 == fstatat(dir_fd, name, &entry_stat, AT_SYMLINK_NOFOLLOW)) {
+    result = report_errno(&worker->report, "stat '%s' failed", path);
+  } else if (S_ISREG(entry_stat.st_mode)) {
+    result = copy_file(worker, dir_fd, copy_fd, name, &entry_stat, path);
+  } else if (!S_ISDIR(entry_stat.st_mode)) {
+    result = copy_special(&worker->report, dir_fd, copy_fd, name, &entry_stat, path);
+  } else if (-1 == mkdirat(copy_fd, name, S_IRWXU)) {
+    result = report_errno(&worker->report, "mkdir the copy of '%s' failed", path);
+  } else {
+    struct copy_dir *sub_dir = calloc(1, sizeof(struct copy_dir));
+    if (sub_dir) {
+      sub_dir->path = path;
+      sub_dir->copy = concat(dir->copy, "/", name);
+      sub_dir->dir_stat = entry_stat;
+      sub_dir->next = *found;
+      *found = sub_dir;
+    }
+    if (!sub_dir || !sub_dir->copy)
+      return report_errno(&worker->report, "out of memory");
+    return err_pass;
+  }
+  free(path);
+  return result;
+}
+
+static err_t copy_entries(struct copy_worker *worker, struct copy_dir *dir, struct copy_dir **found)
+{
+  int dir_fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  DIR *dir_handle = (dir_fd == -1) ? NULL : fdopendir(dir_fd);
+  if (!dir_handle) {
+    if (dir_fd != -1)
+      close(dir_fd);
+    return report_errno(&worker->report, "opendir '%s' failed", dir->path);
+  }
+  int copy_fd = open(dir->copy, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (-1 == copy_fd) {
+    closedir(dir_handle);
+    return report_errno(&worker->report, "open '%s' failed", dir->copy);
+  }
+  err_t result = err_pass;
+  for (;;) {
+    errno = 0;
+    struct dirent *entry = readdir(dir_handle);
+    if (!entry) {
+      if (errno)
+        result = report_errno(&worker->report, "readdir '%s' failed", dir->path);
+      break;
+    }
+    if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+      continue;
+    if ((result = copy_entry(worker, dir, dir_fd, copy_fd, entry->d_name, found)))
+      break;
+  }
+  close(copy_fd);
+  closedir(dir_handle);
+  return result;
+}
+
+static void *copy_worker(void *arg)
+{
+  struct copy_worker *worker = arg;
+  struct copy_work *work = worker->work;
+  pthread_mutex_lock(&work->lock);
+  for (;;) {
+    // the copy is done when nothing is queued and nobody is copying a directory that
+    // could queue more
+    while (!work->queue && work->busy && !work->failed)
+      pthread_cond_wait(&work->changed, &work->lock);
+    if (!work->queue || work->failed)
+      break;
+    struct copy_dir *dir = work->queue;
+    work->queue = dir->next;
+    work->busy++;
+    pthread_mutex_unlock(&work->lock);
+
+    struct copy_dir *found = NULL;
+    err_t result = copy_entries(worker, dir, &found);
+
+    pthread_mutex_lock(&work->lock);
+    work->busy--;
+    dir->next = work->done;
+    work->done = dir;
+    while (found) {
+      struct copy_dir *next = found->next;
+      found->next = work->queue;
+      work->queue = found;
+      found = next;
+    }
+    if (result)
+      work->failed = 1;
+    pthread_cond_broadcast(&work->changed);
+  }
+  pthread_mutex_unlock(&work->lock);
+  return NULL;
+}
+
+err_t copy_tree(struct report *report, const char *dir, const char *copy, unsigned job_count)
+{
+  struct copy_work work;
+  memset(&work, 0, sizeof(work));
+  pthread_mutex_init(&work.lock, NULL);
+  pthread_cond_init(&work.changed, NULL);
+  struct copy_worker *workers = calloc(job_count, sizeof(struct copy_worker));
+  work.queue = calloc(1, sizeof(struct copy_dir));
+  if (work.queue) {
+    work.queue->path = strdup(dir);
+    work.queue->copy = strdup(copy);
+  }
+  err_t result = err_pass;
+  if (!workers || !work.queue || !work.queue->path || !work.queue->copy)
+    result = report_errno(report, "out of memory");
+  else if (-1 == stat(dir, &work.queue->dir_stat))
+    result = report_errno(report, "stat '%s' failed", dir);
+
+  unsigned started = 0;
+  for (; !result && started < job_count; started++) {
+    struct copy_worker *worker = &workers[started];
+    worker->work = &work;
+    worker->buffer = malloc(COPY_BUFFER_SIZE);
+    int error = worker->buffer ? pthread_create(&worker->thread, NULL, copy_worker, worker) : ENOMEM;
+    if (error) {
+      free(worker->buffer);
+      // the workers that did start can do it all
+      if (started == 0)
+        result = report_error(report, error, "start a thread to copy '%s' failed", dir);
+      break;
+    }
+  }
+  for (unsigned i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+    free(workers[i].buffer);
+    if (workers[i].report.error_count) {
+      report_error(report, workers[i].report.first_error, "%s", workers[i].report.first_message);
+      result = err_fail;
+    }
+  }
+
+  for (struct copy_dir *done = work.done; !result && done; done = done->next) {
+    int copy_fd = open(done->copy, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (-1 == copy_fd) {
+      result = report_errno(report, "open '%s' failed", done->copy);
+    } else {
+      result = copy_metadata(report, copy_fd, &done->dir_stat, done->path);
+      close(copy_fd);
+    }
+  }
+  free_dirs(work.queue);
+  free_dirs(work.done);
+  free(workers);
+  pthread_cond_destroy(&work.changed);
+  pthread_mutex_destroy(&work.lock);
+  return result;
+}
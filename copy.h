@@ -0,0 +1,17 @@
+// Copying files and trees, sharing extents where the filesystem can, include report.h
+// and sys/stat.h first.
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+// copies from's content to to, buffer (COPY_BUFFER_SIZE bytes) is only used if the
+// filesystem can't copy it by itself
+err_t copy_data(struct report *report, int from, int to, const char *path, unsigned char *buffer);
+// gives fd the owner and mode of file_stat, then its times so nothing else changes them
+err_t copy_metadata(struct report *report, int fd, const struct stat *file_stat, const char *path);
+// copies the symlink or special file name in dir_fd to to_fd, with its metadata
+err_t copy_special(struct report *report, int dir_fd, int to_fd, const char *name,
+                   const struct stat *file_stat, const char *path);
+// copies everything in dir into the empty directory copy with job_count threads, every
+// file is a reflink (FICLONE) of the original if their filesystem supports it, a copy
+// otherwise. hard links are copied as separate files
+err_t copy_tree(struct report *report, const char *dir, const char *copy, unsigned job_count);
@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "common.h"
+#include "concat.h"
+#include "report.h"
+#include "sha256.h"
+#include "copy.h"
+#include "view.h"
+
+/*
+The layer store. view_ingest copies a directory into a new layer whose regular files are
+hard links to objects in a store, named by their content and the metadata a link shares.
+Every layer ingested into the same store has one inode for each distinct file, so the
+page cache holds one copy of a library however many layers and views have it.
+
+An object is "<store>/<2 hex>/<sha256 of content>-<mode>-<uid>-<gid>", a link shares its
+object's times too, they come from the first file ingested with that content. The store
+and the layers need to be on one filesystem. Extended attributes aren't copied.
+*/
+
+#define DEFAULT_STORE_NAME ".mkview-store"
+// "<2 hex>/<64 hex>-<mode>-<uid>-<gid>"
+#define OBJECT_NAME_SIZE (3 + SHA256_DIGEST_SIZE * 2 + 3 * 12)
+
+struct ingest
+{
+  struct report *report;
+  const char *store;
+  int store_fd;
+  unsigned char *buffer;
+  unsigned long files;
+  unsigned long shared;
+};
+
+static err_t hash_fd(struct ingest *ingest, int fd, const char *path,
+                     unsigned char digest[SHA256_DIGEST_SIZE])
+{
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  struct sha256 sha;
+  sha256_init(&sha);
+  for (;;) {
+    ssize_t size = read(fd, ingest->buffer, COPY_BUFFER_SIZE);
+    if (size == 0)
+      break;
+    if (size == -1) {
+      if (errno == EINTR)
+        continue;
+      return report_errno(ingest->report, "read '%s' failed", path);
+    }
+    sha256_update(&sha, ingest->buffer, size);
+  }
+  sha256_final(&sha, digest);
+  return err_pass;
+}
+
+// adds the content of fd to the store as object, another ingest may have added it first
+static err_t add_object(struct ingest *ingest, int fd, const struct stat *file_stat,
+                        const char *object, const char *path)
+{
+  char subdir[3] = { object[0], object[1], '\0' };
+  if (-1 == mkdirat(ingest->store_fd, subdir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) &&
+      errno != EEXIST)
+    return report_errno(ingest->report, "mkdir '%s/%s' failed", ingest->store, subdir);
+  // an unnamed file only gets a name once it's complete
+  int object_fd = openat(ingest->store_fd, subdir, O_TMPFILE | O_WRONLY | O_CLOEXEC, S_IRUSR);
+  if (-1 == object_fd)
+    return report_errno(ingest->report, "open a new object in '%s/%s' failed", ingest->store, subdir);
+  err_t result = copy_data(ingest->report, fd, object_fd, path, ingest->buffer);
+  if (!result)
+    result = copy_metadata(ingest->report, object_fd, file_stat, path);
+  if (!result) {
+    char proc_path[32];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", object_fd);
+    if (-1 == linkat(AT_FDCWD, proc_path, ingest->store_fd, object, AT_SYMLINK_FOLLOW) &&
+        errno != EEXIST)
+      result = report_errno(ingest->report, "link object '%s/%s' failed", ingest->store, object);
+  }
+  close(object_fd);
+  return result;
+}
+
+static err_t ingest_file(struct ingest *ingest, int dir_fd, int layer_fd, const char *name,
+                         const struct stat *file_stat, const char *path)
+{
+  int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (-1 == fd)
+    return report_errno(ingest->report, "open '%s' failed", path);
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  err_t result = hash_fd(ingest, fd, path, digest);
+  char object[OBJECT_NAME_SIZE];
+  size_t length = snprintf(object, sizeof(object), "%02x/", digest[0]);
+  for (unsigned i = 0; i < SHA256_DIGEST_SIZE; i++)
+    length += snprintf(object + length, sizeof(object) - length, "%02x", digest[i]);
+  snprintf(object + length, sizeof(object) - length, "-%o-%u-%u", file_stat->st_mode & 07777,
+           (unsigned)file_stat->st_uid, (unsigned)file_stat->st_gid);
+
+  if (!result) {
+    ingest->files++;
+    if (0 == linkat(ingest->store_fd, object, layer_fd, name, 0)) {
+      ingest->shared++;
+    } else if (errno != ENOENT && errno != EMLINK) {
+      result = report_errno(ingest->report, "link '%s/%s' to '%s' failed", ingest->store, object, path);
+    } else if (errno == EMLINK) {
+      // the object has as many links as its filesystem allows, this one gets a copy
+      int copy = openat(layer_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR);
+      if (-1 == copy) {
+        result = report_errno(ingest->report, "create '%s' failed", path);
+      } else {
+        result = copy_data(ingest->report, fd, copy, path, ingest->buffer);
+        if (!result)
+          result = copy_metadata(ingest->report, copy, file_stat, path);
+        close(copy);
+      }
+    } else if (!(result = add_object(ingest, fd, file_stat, object, path)) &&
+               -1 == linkat(ingest->store_fd, object, layer_fd, name, 0)) {
+      result = report_errno(ingest->report, "link '%s/%s' to '%s' failed", ingest->store, object, path);
+    }
+  }
+  close(fd);
+  return result;
+}
+
+static err_t ingest_dir(struct ingest *ingest, int dir_fd, int layer_fd, const char *path);
+
+static err_t ingest_entry(struct ingest *ingest, int dir_fd, int layer_fd, const char *name,
+                          const char *path)
+{
+  struct stat entry_stat;
+  if (-1 == fstatat(dir_fd, name, &entry_stat, AT_SYMLINK_NOFOLLOW))
+    return report_errno(ingest->report, "stat '%s' failed", path);
+
+  if (S_ISREG(entry_stat.st_mode))
+    return ingest_file(ingest, dir_fd, layer_fd, name, &entry_stat, path);
+
+  if (S_ISDIR(entry_stat.st_mode)) {
+    if (-1 == mkdirat(layer_fd, name, S_IRWXU))
+      return report_errno(ingest->report, "mkdir '%s' failed", path);
+    int sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (-1 == sub_fd)
+      return report_errno(ingest->report, "open '%s' failed", path);
+    int sub_layer_fd = openat(layer_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (-1 == sub_layer_fd) {
+      close(sub_fd);
+      return report_errno(ingest->report, "open the copy of '%s' failed", path);
+    }
+    err_t result = ingest_dir(ingest, sub_fd, sub_layer_fd, path);
+    if (!result)
+      result = copy_metadata(ingest->report, sub_layer_fd, &entry_stat, path);
+    close(sub_fd);
+    close(sub_layer_fd);
+    return result;
+  }
+
+  // links and special files are small, they're copied instead of shared
+  return copy_special(ingest->report, dir_fd, layer_fd, name, &entry_stat, path);
+}
+
+static err_t ingest_dir(struct ingest *ingest, int dir_fd, int layer_fd, const char *path)
+{
+  int list_fd = dup(dir_fd);
+  DIR *dir = (list_fd == -1) ? NULL : fdopendir(list_fd);
+  if (!dir) {
+    if (list_fd != -1)
+      close(list_fd);
+    return report_errno(ingest->report, "opendir '%s' failed", path);
+  }
+  err_t result = err_pass;
+  for (;;) {
+    errno = 0;
+    struct dirent *entry = readdir(dir);
+    if (!entry) {
+      if (errno)
+        result = report_errno(ingest->report, "readdir '%s' failed", path);
+      break;
+    }
+    if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+      continue;
+    char *entry_path = concat(path, "/", entry->d_name);
+    if (!entry_path) {
+      result = report_errno(ingest->report, "concat paths failed");
+      break;
+    }
+    result = ingest_entry(ingest, dir_fd, layer_fd, entry->d_name, entry_path);
+    free(entry_path);
+    if (result)
+      break;
+  }
+  closedir(dir);
+  return result;
+}
+
+static err_t ingest_root(struct ingest *ingest, const char *dir, const char *new_layer)
+{
+  struct stat dir_stat;
+  int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (-1 == dir_fd || -1 == fstat(dir_fd, &dir_stat)) {
+    report_errno(ingest->report, "open '%s' failed", dir);
+    if (dir_fd != -1)
+      close(dir_fd);
+    return err_fail;
+  }
+  err_t result = err_pass;
+  int layer_fd = -1;
+  if (-1 == mkdir(new_layer, S_IRWXU) ||
+      -1 == (layer_fd = open(new_layer, O_RDONLY | O_DIRECTORY | O_CLOEXEC)))
+    result = report_errno(ingest->report, "mkdir '%s' failed", new_layer);
+  if (!result)
+    result = ingest_dir(ingest, dir_fd, layer_fd, dir);
+  if (!result)
+    result = copy_metadata(ingest->report, layer_fd, &dir_stat, dir);
+  if (layer_fd != -1)
+    close(layer_fd);
+  close(dir_fd);
+  return result;
+}
+
+// builds the layer under another name and renames it once it's complete
+static err_t ingest_layer(struct ingest *ingest, const char *dir, const char *layer)
+{
+  if (-1 == mkdir(ingest->store, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) &&
+      errno != EEXIST)
+    return report_errno(ingest->report, "mkdir '%s' failed", ingest->store);
+  ingest->store_fd = open(ingest->store, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (-1 == ingest->store_fd)
+    return report_errno(ingest->report, "open '%s' failed", ingest->store);
+  ingest->buffer = malloc(COPY_BUFFER_SIZE);
+  char *new_layer = concat(layer, ".mkview-new");
+  err_t result = err_pass;
+  if (!ingest->buffer || !new_layer)
+    result = report_errno(ingest->report, "out of memory");
+  if (!result)
+    result = ingest_root(ingest, dir, new_layer);
+  if (!result && -1 == rename(new_layer, layer))
+    result = report_errno(ingest->report, "rename '%s' to '%s' failed", new_layer, layer);
+  if (result && new_layer) {
+    // the objects stay in the store, the next ingest uses them
+    int error = ingest->report->last_error;
+    view_teardown(ingest->report, new_layer, 1);
+    ingest->report->last_error = error;
+  }
+  free(new_layer);
+  free(ingest->buffer);
+  close(ingest->store_fd);
+  return result;
+}
+
+int view_ingest(struct report *report, const char *dir, const char *layer, const char *store,
+                unsigned long *files, unsigned long *shared)
+{
+  if (0 == access(layer, F_OK) || errno != ENOENT) {
+    report_error(report, EEXIST, "layer '%s' already exists", layer);
+    return report->last_error;
+  }
+  // the store goes next to the layer by default, links can't cross filesystems
+  char *default_store = NULL;
+  if (!store) {
+    const char *name = strrchr(layer, '/');
+    char *parent = name ? strndup(layer, name + 1 - layer) : strdup("");
+    default_store = parent ? concat(parent, DEFAULT_STORE_NAME) : NULL;
+    free(parent);
+    if (!default_store) {
+      report_errno(report, "out of memory");
+      return report->last_error;
+    }
+    store = default_store;
+  }
+  struct ingest ingest;
+  memset(&ingest, 0, sizeof(ingest));
+  ingest.report = report;
+  ingest.store = store;
+  err_t result = ingest_layer(&ingest, dir, layer);
+  free(default_store);
+  if (files)
+    *files = ingest.files;
+  if (shared)
+    *shared = ingest.shared;
+  return result ? report->last_error : 0;
+}
@@ -1,12 +1,22 @@
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/wait.h>
 
 #include <linux/limits.h>
 
 #include "common.h"
+#include "report.h"
+#include "view.h"
+#include "log.h"
+#include "server.h"
+#include "cgroup.h"
+#include "batch.h"
 
 char *malloc_getcwd()
 {
@@ -19,11 +29,54 @@ char *malloc_getcwd()
   return strdup(result);
 }
 
+// returns: a stream for the stats written to the file descriptor in arg, or NULL on error
+static FILE *open_stats(const char *arg)
+{
+  char *end;
+  long fd = strtol(arg, &end, 10);
+  if (*end != '\0' || fd < 0) {
+    errf("invalid file descriptor '%s'", arg);
+    return NULL;
+  }
+  // the command doesn't get it
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  FILE *stats = fdopen(fd, "w");
+  if (!stats)
+    errnof("fdopen %ld failed", fd);
+  return stats;
+}
+
 void usage()
 {
   logf("Usage: inroot <root_dir> <command>...");
+  logf("       inroot --server <root_dir> <socket>");
+  logf("       inroot --connect <socket> <command>...");
+  logf("       inroot --record <profile> <root_dir> <command>...");
+  logf("       inroot --prefetch <profile> <root_dir> <command>...");
+  logf("       inroot --cgroup <group> [--memory-high <bytes>] [--io-max <limit>] [--stats <fd>]");
+  logf("              <root_dir> <command>...");
+  logf("       inroot [-j <jobs>] [--output <dir>] --batch <command_file> <root_dir>");
   logf();
   logf("Run the given <command> as if <root_dir> is its root directory");
+  logf();
+  logf("--server enters <root_dir> once and stays resident, spawning commands sent to");
+  logf("<socket> by clients. --connect sends <command> along with the current directory,");
+  logf("environment and stdio to a server and exits with the command's exit status.");
+  logf();
+  logf("--record writes every file <command> opens in <root_dir> to <profile>. --prefetch");
+  logf("starts reading the files in <profile> into the page cache before running <command>,");
+  logf("so a job in a new view starts about as fast as in one that's been used.");
+  logf();
+  logf("--cgroup runs <command> in the cgroup v2 <group>, made if it doesn't exist. A relative");
+  logf("<group> is under the cgroup2 mount. --memory-high and --io-max set its memory.high and");
+  logf("io.max (like '8:0 wbps=10485760'), and --stats writes its io.stat, memory.peak and");
+  logf("cpu.stat to <fd> as JSON once <command> exits. Give each view its own group to see");
+  logf("which view's jobs are loading the host.");
+  logf();
+  logf("--batch enters <root_dir> once and runs each line of <command_file> in it with");
+  logf("/bin/sh -c, -j at a time (default the number of CPUs). Each line of their output is");
+  logf("written with the command's line number in front, or to <dir>/<line>.out and .err with");
+  logf("--output, and each command's exit status and run time are written to stderr.");
 }
 int main(int argc, const char *argv[])
 {
@@ -33,28 +86,131 @@ int main(int argc, const char *argv[])
     usage();
     return 1;
   }
-  if (argc == 1) {
+  if (0 == strcmp(argv[0], "--server")) {
+    if (argc != 3) {
+      errf("--server requires <root_dir> and <socket>");
+      return 1;
+    }
+    return server_run(argv[1], argv[2]);
+  }
+  if (0 == strcmp(argv[0], "--connect")) {
+    if (argc < 3) {
+      errf("--connect requires <socket> and a command to run");
+      return 1;
+    }
+    return server_client(argv[1], argc - 2, argv + 2);
+  }
+  const char *record_profile = NULL;
+  const char *prefetch_profile = NULL;
+  const char *cgroup = NULL;
+  const char *memory_high = NULL;
+  const char *io_max = NULL;
+  FILE *stats = NULL;
+  const char *batch_file = NULL;
+  const char *output_dir = NULL;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  for (; argc > 0 && argv[0][0] == '-'; argc -= 2, argv += 2) {
+    if (argc < 2) {
+      errf("option '%s' requires an argument", argv[0]);
+      return 1;
+    }
+    if (0 == strcmp(argv[0], "--record")) {
+      record_profile = argv[1];
+    } else if (0 == strcmp(argv[0], "--prefetch")) {
+      prefetch_profile = argv[1];
+    } else if (0 == strcmp(argv[0], "--cgroup")) {
+      cgroup = argv[1];
+    } else if (0 == strcmp(argv[0], "--memory-high")) {
+      memory_high = argv[1];
+    } else if (0 == strcmp(argv[0], "--io-max")) {
+      io_max = argv[1];
+    } else if (0 == strcmp(argv[0], "--batch")) {
+      batch_file = argv[1];
+    } else if (0 == strcmp(argv[0], "--output")) {
+      output_dir = argv[1];
+    } else if (0 == strcmp(argv[0], "-j")) {
+      char *end;
+      jobs = strtol(argv[1], &end, 10);
+      if (*end != '\0' || jobs <= 0 || jobs > 65536) {
+        errf("invalid number of jobs '%s'", argv[1]);
+        return 1;
+      }
+    } else if (0 == strcmp(argv[0], "--stats")) {
+      if (!(stats = open_stats(argv[1])))
+        return 1; // error already logged
+    } else {
+      errf("unknown option '%s'", argv[0]);
+      return 1;
+    }
+  }
+  if (argc == 0) {
+    usage();
+    return 1;
+  }
+  if (batch_file) {
+    if (argc != 1) {
+      errf("--batch takes the commands from <command_file>, not the command line");
+      return 1;
+    }
+    if (record_profile || stats) {
+      errf("--record and --stats can't be used with --batch");
+      return 1;
+    }
+  } else if (argc == 1) {
     errf("please supply a command to run");
     return 1;
+  } else if (output_dir) {
+    errf("--output requires --batch");
+    return 1;
+  }
+  if (!cgroup && (memory_high || io_max || stats)) {
+    errf("--memory-high, --io-max and --stats require --cgroup");
+    return 1;
   }
   const char *root = argv[0];
   char *cwd = malloc_getcwd();
   if (!cwd)
     return 1; // error already logged
-  //logf("[DEBUG] cd '%s'", root);
-  if (-1 == chdir(root)) {
-    errnof("chdir '%s' failed", root);
-    return 1;
-  }
-  if (-1 == chroot(".")) {
-    errnof("chroot '%s' failed", root);
-    return 1;
+  struct report report;
+  log_report_init(&report);
+  // inroot joins the group itself, so everything it starts is in it
+  char *group = NULL;
+  if (cgroup && !(group = cgroup_join(cgroup, memory_high, io_max)))
+    return 1; // error already logged
+  if (record_profile) {
+    int status;
+    int error = view_record(&report, root, cwd, argv + 1, record_profile, &status);
+    free(cwd);
+    if (error)
+      return 1; // error already logged
+    if (stats && cgroup_write_stats(group, status, stats))
+      return 1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
   }
-  //logf("[DEBUG] cd '%s'", cwd);
-  if (-1 == chdir(cwd)) {
-    errnof("chdir '%s' after chroot failed", cwd);
-    return 1;
+  if (prefetch_profile && view_prefetch(&report, root, prefetch_profile, 0))
+    return 1; // error already logged
+  if (batch_file)
+    return batch_run(root, cwd, batch_file, jobs > 0 ? jobs : 1, output_dir);
+  if (stats) {
+    // the stats are read once the command exits, so it can't replace this process
+    pid_t pid = fork();
+    if (pid == -1) {
+      errnof("fork failed");
+      return 1;
+    }
+    if (pid != 0) {
+      int status;
+      if (-1 == waitpid(pid, &status, 0)) {
+        errnof("wait for %d failed", pid);
+        return 1;
+      }
+      if (cgroup_write_stats(group, status, stats))
+        return 1;
+      return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
   }
+  if (view_enter(&report, root, cwd))
+    return 1; // error already logged
   argc--;
   argv++;
   //for (int i = 0; i < argc; i++) {
@@ -0,0 +1,48 @@
+// Builds against libmkview the way an embedding program would, with nothing but the
+// installed view.h, and plans a view without applying it, so it needs no privileges.
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "view.h"
+
+static unsigned error_count;
+
+static void on_error(void *context, int error, const char *message)
+{
+  (void)context;
+  (void)error;
+  (void)message;
+  error_count++;
+}
+
+int main(void)
+{
+  struct report report;
+  memset(&report, 0, sizeof(report));
+  report.error = on_error;
+  struct view *view = view_alloc(&report);
+  if (!view) {
+    fprintf(stderr, "view_alloc failed\n");
+    return 1;
+  }
+  // a struct view is reused, the second plan starts from nothing
+  for (int i = 0; i < 2; i++) {
+    int error = view_reset(view, "libmkview-test-view");
+    if (!error)
+      error = view_add(view, "/");
+    if (!error)
+      error = view_add(view, "+tmpfs=size=1m:scratch");
+    if (error) {
+      fprintf(stderr, "planning a view failed: %s\n", report.first_message);
+      return 1;
+    }
+  }
+  int error = view_add(view, "/libmkview-test-missing:missing");
+  if (error != ENOENT || error_count != 1 || report.first_error != ENOENT) {
+    fprintf(stderr, "a missing directory gave error %d after %u errors\n", error, error_count);
+    return 1;
+  }
+  view_free(view);
+  return 0;
+}
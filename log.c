@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "report.h"
+#include "log.h"
+
+/*
+How the tools print what the library reports. Operations (mkdir, mount, umount,
+remove) are only printed one per line at LOG_OPS. With --events <fd> every operation
+is also written to <fd> as a line of JSON:
+
+    {"op":"mount","path":"view/usr","source":"/usr","error":0}
+
+stdout and the event stream are fully buffered, so even at LOG_OPS the cost of
+logging a million removes is a handful of writes rather than a million.
+*/
+
+enum log_level log_level = LOG_SUMMARY;
+static FILE *events;
+
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+// handles the logging options shared by the tools: -q, -v and --events <fd>
+err_t log_parse_option(int argc, const char *argv[], int *arg_index, unsigned char *handled)
+{
+  const char *arg = argv[*arg_index];
+  *handled = 1;
+  if (0 == strcmp(arg, "-q")) {
+    log_level = LOG_QUIET;
+  } else if (0 == strcmp(arg, "-v")) {
+    log_level = LOG_OPS;
+  } else if (0 == strcmp(arg, "--events")) {
+    (*arg_index)++;
+    if (*arg_index >= argc) {
+      errf("option '%s' requires an argument", arg);
+      return err_fail;
+    }
+    char *end;
+    long fd = strtol(argv[*arg_index], &end, 10);
+    if (*end != '\0' || fd < 0) {
+      errf("invalid file descriptor '%s'", argv[*arg_index]);
+      return err_fail;
+    }
+    events = fdopen(fd, "w");
+    if (!events) {
+      errnof("fdopen %ld failed", fd);
+      return err_fail;
+    }
+    setvbuf(events, NULL, _IOFBF, LOG_BUFFER_SIZE);
+  } else {
+    *handled = 0;
+  }
+  return err_pass;
+}
+
+// call once before logging anything, buffered output is flushed when the process exits
+void log_init(void)
+{
+  setvbuf(stdout, NULL, _IOFBF, LOG_BUFFER_SIZE);
+}
+
+static void write_json_string(FILE *file, const char *s)
+{
+  fputc('"', file);
+  for (; s[0]; s++) {
+    unsigned char c = s[0];
+    if (c == '"' || c == '\\')
+      fprintf(file, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(file, "\\u%04x", c);
+    else
+      fputc(c, file);
+  }
+  fputc('"', file);
+}
+
+static void log_op(void *context, enum report_op_kind kind, const char *op, const char *path,
+                   const char *source, int error)
+{
+  if (source)
+    opf("%s %s %s", op, source, path);
+  else
+    opf("%s %s", op, path);
+  if (!events)
+    return;
+  flockfile(events);
+  fprintf(events, "{\"op\":\"%s\",\"path\":", op);
+  write_json_string(events, path);
+  if (source) {
+    fputs(",\"source\":", events);
+    write_json_string(events, source);
+  }
+  fprintf(events, ",\"error\":%d}\n", error);
+  funlockfile(events);
+}
+
+static void log_notice(void *context, const char *message)
+{
+  summaryf("%s", message);
+}
+
+static void log_error(void *context, int error, const char *message)
+{
+  errf("%s", message);
+}
+
+// sends what the library reports to stdout, stderr and the event stream
+void log_report_init(struct report *report)
+{
+  memset(report, 0, sizeof(*report));
+  report->op = log_op;
+  report->notice = log_notice;
+  report->error = log_error;
+}
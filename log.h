@@ -0,0 +1,16 @@
+enum log_level {
+  // only errors
+  LOG_QUIET = 0,
+  // errors and a summary of the operations performed (the default)
+  LOG_SUMMARY = 1,
+  // a line for every operation
+  LOG_OPS = 2,
+};
+extern enum log_level log_level;
+
+#define opf(fmt, ...)      do { if (log_level >= LOG_OPS) logf(fmt, ##__VA_ARGS__); } while (0)
+#define summaryf(fmt, ...) do { if (log_level >= LOG_SUMMARY) logf(fmt, ##__VA_ARGS__); } while (0)
+
+err_t log_parse_option(int argc, const char *argv[], int *arg_index, unsigned char *handled);
+void log_init(void);
+void log_report_init(struct report *report);
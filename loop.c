@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/file.h>
+#include <sys/ioctl.h>
+
+#include <linux/loop.h>
+
+#include "common.h"
+#include "report.h"
+#include "command.h"
+#include "loop.h"
+
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config
+{
+  __u32 fd;
+  __u32 block_size;
+  struct loop_info64 info;
+  __u64 __reserved[8];
+};
+#endif
+
+// LOOP_CONFIGURE (5.8) sets everything at once, older kernels need two calls
+static int configure(int loop, int file, unsigned char read_only)
+{
+  struct loop_config config;
+  memset(&config, 0, sizeof(config));
+  config.fd = file;
+  config.info.lo_flags = LO_FLAGS_AUTOCLEAR | (read_only ? LO_FLAGS_READ_ONLY : 0);
+  if (0 == ioctl(loop, LOOP_CONFIGURE, &config))
+    return 0;
+  if (errno != EINVAL && errno != ENOTTY)
+    return -1;
+  if (-1 == ioctl(loop, LOOP_SET_FD, file))
+    return -1;
+  struct loop_info64 info;
+  memset(&info, 0, sizeof(info));
+  info.lo_flags = LO_FLAGS_AUTOCLEAR;
+  if (-1 == ioctl(loop, LOOP_SET_STATUS64, &info)) {
+    int error = errno;
+    ioctl(loop, LOOP_CLR_FD, 0);
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+// how many times a locked image is tried, 50ms apart
+#define LOCK_ATTEMPTS 20
+
+int loop_attach(struct report *report, const char *file, unsigned char read_only,
+                char *path, size_t path_size)
+{
+  int file_fd = open(file, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+  if (-1 == file_fd) {
+    report_errno(report, "open '%s' failed", file);
+    return -1;
+  }
+  // the loop device keeps file_fd's open file and so its lock until it detaches, so two
+  // views can't write to one image through two devices and corrupt it. a device that
+  // was just unmounted can take a moment to let go of it
+  int locked = -1;
+  for (unsigned attempt = 0; -1 == locked && attempt < LOCK_ATTEMPTS; attempt++) {
+    if (attempt)
+      nanosleep(&(struct timespec){ .tv_nsec = 50 * 1000 * 1000 }, NULL);
+    locked = flock(file_fd, (read_only ? LOCK_SH : LOCK_EX) | LOCK_NB);
+    if (-1 == locked && errno != EWOULDBLOCK)
+      break;
+  }
+  if (-1 == locked) {
+    if (errno == EWOULDBLOCK)
+      report_error(report, EBUSY, "'%s' is already attached to a loop device%s", file,
+                   read_only ? " for writing" : "");
+    else
+      report_errno(report, "lock '%s' failed", file);
+    close(file_fd);
+    return -1;
+  }
+  int control = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+  if (-1 == control) {
+    report_errno(report, "open '/dev/loop-control' failed");
+    close(file_fd);
+    return -1;
+  }
+  int loop = -1;
+  unsigned char reported = 0;
+  // another process can take the free device before we configure it
+  for (unsigned attempt = 0; loop == -1 && attempt < 16; attempt++) {
+    int number = ioctl(control, LOOP_CTL_GET_FREE);
+    if (number < 0) {
+      report_errno(report, "no free loop device for '%s'", file);
+      reported = 1;
+      break;
+    }
+    snprintf(path, path_size, "/dev/loop%d", number);
+    loop = open(path, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (-1 == loop) {
+      report_errno(report, "open '%s' failed", path);
+      reported = 1;
+      break;
+    }
+    if (-1 == configure(loop, file_fd, read_only)) {
+      int error = errno;
+      close(loop);
+      loop = -1;
+      if (error == EBUSY)
+        continue;
+      report_error(report, error, "attach '%s' to '%s' failed: %s", file, path, strerror(error));
+      reported = 1;
+      break;
+    }
+  }
+  if (loop == -1 && !reported)
+    report_error(report, EBUSY, "no free loop device for '%s'", file);
+  close(control);
+  close(file_fd);
+  return loop;
+}
+
+err_t loop_make_image(struct report *report, const char *file, unsigned long long size,
+                      const char *fs_type)
+{
+  int fd = open(file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (-1 == fd)
+    return report_errno(report, "create image '%s' failed", file);
+  if (-1 == ftruncate(fd, size)) {
+    report_errno(report, "resize image '%s' to %llu bytes failed", file, size);
+    close(fd);
+    unlink(file);
+    return err_fail;
+  }
+  close(fd);
+
+  char program[32];
+  snprintf(program, sizeof(program), "mkfs.%s", fs_type);
+  // xfs wants -f to write over anything, mke2fs takes a regular file without asking
+  const char *argv[] = {program, "-q", file, NULL, NULL};
+  if (0 == strcmp(fs_type, "xfs")) {
+    argv[2] = "-f";
+    argv[3] = file;
+  }
+  if (run_command(report, argv)) {
+    unlink(file);
+    return err_fail;
+  }
+  return err_pass;
+}
@@ -0,0 +1,12 @@
+// Loop devices and image files, include report.h first.
+
+// attaches file to a free loop device that detaches itself once it's unmounted and
+// closed, its path (/dev/loop<N>) goes in path. file stays locked while it's attached, a
+// file attached for writing can't be attached again and one attached read only can't be
+// attached for writing
+// returns: the open loop device, or -1 on error
+int loop_attach(struct report *report, const char *file, unsigned char read_only,
+                char *path, size_t path_size);
+// creates a sparse file of size bytes with an empty fs_type filesystem on it
+err_t loop_make_image(struct report *report, const char *file, unsigned long long size,
+                      const char *fs_type);
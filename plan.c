@@ -0,0 +1,375 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sys/stat.h>
+
+#include "common.h"
+#include "vector.h"
+#include "concat.h"
+#include "report.h"
+#include "plan.h"
+
+/*
+The planner turns the directories given to mkview into a tree of mount points and
+decides which of them need a directory made for their sub mount points. It only
+looks at the filesystem through a plan_fs so it can be run without privileges
+against a fake filesystem (see plan_bench.c and plan_fuzz.c).
+*/
+
+static int real_stat(void *context, const char *path, struct stat *buf)
+{
+  return stat(path, buf);
+}
+struct plan_fs plan_real_fs = { real_stat, NULL };
+
+const char *lstrip(const char *str, char strip_char)
+{
+  for (; str[0] == strip_char; str++) { }
+  return str;
+}
+
+// compares paths by whole components, so "a" starts "a/b" but not "ab", and the
+// empty path (the root) starts every other path
+enum string_compare_result compare_strings(const char *left, const char *right)
+{
+  const char *left_start = left;
+  for (;;) {
+    char leftc = left[0];
+    char rightc = right[0];
+    if (leftc == '\0') {
+      if (rightc == '\0')
+        return STRING_COMPARE_EQUAL;
+      return (left == left_start || rightc == '/' || left[-1] == '/') ?
+        STRING_COMPARE_RIGHT_STARTS_WITH_LEFT : STRING_COMPARE_DISJOINT;
+    }
+    if (rightc == '\0') {
+      return (left == left_start || leftc == '/' || left[-1] == '/') ?
+        STRING_COMPARE_LEFT_STARTS_WITH_RIGHT : STRING_COMPARE_DISJOINT;
+    }
+    if (leftc != rightc)
+      return STRING_COMPARE_DISJOINT;
+    left++;
+    right++;
+  }
+}
+
+
+// a new block is this big, unless one allocation needs more
+#define PLAN_BLOCK_SIZE (64 * 1024)
+
+struct plan_block
+{
+  struct plan_block *next;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+};
+
+// makes a block with room for size bytes the one allocations come from
+static struct plan_block *get_block(struct plan_arena *arena, size_t size)
+{
+  struct plan_block **spare = &arena->spare;
+  for (; *spare && (*spare)->size < size; spare = &(*spare)->next) { }
+  struct plan_block *block = *spare;
+  if (block) {
+    *spare = block->next;
+  } else {
+    size_t block_size = (size > PLAN_BLOCK_SIZE) ? size : PLAN_BLOCK_SIZE;
+    block = malloc(sizeof(struct plan_block) + block_size);
+    if (!block)
+      return NULL;
+    block->size = block_size;
+  }
+  block->used = 0;
+  if (arena->blocks && size > PLAN_BLOCK_SIZE / 4) {
+    // a big allocation gets a block of its own, the current one is still filled
+    block->next = arena->blocks->next;
+    arena->blocks->next = block;
+  } else {
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+  return block;
+}
+
+void *plan_alloc(struct plan_arena *arena, size_t size)
+{
+  size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+  if (size <= arena->loose_size) {
+    void *ptr = arena->loose;
+    arena->loose += size;
+    arena->loose_size -= size;
+    arena->reused += size;
+    memset(ptr, 0, size);
+    return ptr;
+  }
+  struct plan_block *block = arena->blocks;
+  if (!block || block->size - block->used < size) {
+    block = get_block(arena, size);
+    if (!block)
+      return NULL;
+  }
+  void *ptr = (unsigned char*)block->data + block->used;
+  block->used += size;
+  arena->used += size;
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+char *plan_join_path(struct plan_arena *arena, const char *dir, const char *path)
+{
+  size_t dir_length = strlen(dir);
+  size_t path_length = strlen(path);
+  char *joined = plan_alloc(arena, dir_length + 1 + path_length + 1);
+  if (!joined)
+    return NULL;
+  memcpy(joined, dir, dir_length);
+  joined[dir_length] = '/';
+  memcpy(joined + dir_length + 1, path, path_length + 1);
+  return joined;
+}
+
+void plan_arena_reset(struct plan_arena *arena)
+{
+  arena->loose = NULL;
+  arena->loose_size = 0;
+  arena->used = 0;
+  arena->outgrown = 0;
+  arena->reused = 0;
+  while (arena->blocks) {
+    struct plan_block *block = arena->blocks;
+    arena->blocks = block->next;
+    block->next = arena->spare;
+    arena->spare = block;
+  }
+}
+
+void plan_arena_free(struct plan_arena *arena)
+{
+  plan_arena_reset(arena);
+  while (arena->spare) {
+    struct plan_block *block = arena->spare;
+    arena->spare = block->next;
+    free(block);
+  }
+}
+
+// adds item to a list in the arena, the items it outgrows are handed out again by
+// plan_alloc, so growing by doubling doesn't leave them behind
+static err_t plan_vector_add(struct plan_arena *arena, struct vector *v, void *item)
+{
+  if (v->size == v->capacity) {
+    size_t capacity = v->capacity ? v->capacity * 2 : 2;
+    void **items = plan_alloc(arena, capacity * sizeof(void*));
+    if (!items)
+      return err_fail;
+    if (v->size)
+      memcpy(items, v->items, v->size * sizeof(void*));
+    // the capacity is a power of two from 2 up, so the old items keep plan_alloc's alignment
+    size_t outgrown = v->capacity * sizeof(void*);
+    arena->outgrown += outgrown;
+    if (outgrown > arena->loose_size) {
+      arena->loose = (unsigned char*)v->items;
+      arena->loose_size = outgrown;
+    }
+    v->items = items;
+    v->capacity = capacity;
+  }
+  v->items[v->size++] = item;
+  return err_pass;
+}
+
+err_t mount_point_add_dir(struct plan_arena *arena, struct mount_point *mount_point, struct dir *dir)
+{
+  return plan_vector_add(arena, (struct vector*)&mount_point->dirs, dir);
+}
+
+static err_t add_sub_mount_point(struct plan_arena *arena, struct mount_point *mount_point,
+                                 struct mount_point *sub_mount_point)
+{
+  return plan_vector_add(arena, (struct vector*)&mount_point->sub_mount_points, sub_mount_point);
+}
+
+err_t mount_point_init(struct plan_arena *arena, struct mount_point *mount_point,
+                       struct dir *first_dir, const char *target_relative)
+{
+  memset(mount_point, 0, sizeof(*mount_point));
+  if (mount_point_add_dir(arena, mount_point, first_dir))
+    return err_fail;
+  mount_point->target_relative = target_relative;
+  return err_pass;
+}
+struct mount_point *mount_point_alloc(struct report *report, struct plan_arena *arena,
+                                      struct dir *first_dir, const char *target_relative)
+{
+  struct mount_point *mount_point = plan_alloc(arena, sizeof(struct mount_point));
+  if (!mount_point || mount_point_init(arena, mount_point, first_dir, target_relative)) {
+    report_errno(report, "could not allocate mount point for '%s'", first_dir->arg);
+    return NULL;
+  }
+  return mount_point;
+}
+
+
+static void print_tab(unsigned depth)
+{
+  // TODO: very inneficient
+  for (unsigned i = 0; i < depth; i++)
+    printf(" ");
+}
+static void print_mount_point(struct mount_point *mount_point, unsigned depth)
+{
+  print_tab(depth);logf("target /%s", mount_point->target_relative);
+  for (size_t i = 0; i < dir_vector_size(&mount_point->dirs); i++) {
+    struct dir *dir = dir_vector_get(&mount_point->dirs, i);
+    if (dir->tmpfs_options) {
+      print_tab(depth);logf("tmpfs upper %s", dir->tmpfs_options);
+      continue;
+    }
+    if (dir->image) {
+      print_tab(depth);logf("image upper %s %s", dir->image, dir->image_options);
+      continue;
+    }
+    if (dir->reflink) {
+      print_tab(depth);logf("reflink copy of %s", dir->reflink);
+      continue;
+    }
+    print_tab(depth);logf("source %s", dir->source);
+    if (dir->workdir) {
+      print_tab(depth);logf("- workdir %s", dir->workdir);
+    }
+  }
+  print_mount_points(&mount_point->sub_mount_points, depth + 1);
+}
+void print_mount_points(struct mount_point_vector *mount_points, unsigned depth)
+{
+  for (size_t i = 0; i < mount_point_vector_size(mount_points); i++) {
+    struct mount_point *mount_point = mount_point_vector_get(mount_points, i);
+    print_mount_point(mount_point, depth);
+  }
+}
+
+static err_t add_new_mount_point(struct report *report, struct plan_arena *arena,
+                                 struct mount_point_vector *mount_points,
+                                 struct dir *first_dir, const char *target_relative)
+{
+  struct mount_point *mount_point = mount_point_alloc(report, arena, first_dir, target_relative);
+  if (!mount_point)
+    return err_fail;
+  if (plan_vector_add(arena, (struct vector*)mount_points, mount_point))
+    return report_errno(report, "failed to add '%s' to mount point list", first_dir->arg);
+  return err_pass;
+}
+
+err_t add_dir(struct report *report, struct plan_arena *arena, struct mount_point_vector *mount_points,
+              struct dir *dir, const char *target_relative)
+{
+  for (size_t i = 0; i < mount_point_vector_size(mount_points); i++) {
+    struct mount_point *mount_point = mount_point_vector_get(mount_points, i);
+    enum string_compare_result compare_result = compare_strings(target_relative,
+                                                                mount_point->target_relative);
+    switch (compare_result) {
+    case STRING_COMPARE_DISJOINT:
+      break;
+    case STRING_COMPARE_EQUAL:
+      if (mount_point_add_dir(arena, mount_point, dir)) {
+        return report_errno(report, "failed to add dir '%s' to mount_point dirs vector", dir->arg);
+      }
+      return err_pass;
+    case STRING_COMPARE_RIGHT_STARTS_WITH_LEFT:
+      // swap the mount points
+      {
+        struct mount_point *new_mount_point;
+        new_mount_point = mount_point_alloc(report, arena, dir, target_relative);
+        if (!new_mount_point)
+          return err_fail;
+        mount_point_vector_set(mount_points, i, new_mount_point);
+        if (add_sub_mount_point(arena, new_mount_point, mount_point))
+          return report_errno(report, "failed to add '%s' to mount point list", dir->arg);
+        // any later mount points under the new target belong to it as well
+        size_t keep = i + 1;
+        for (size_t j = i + 1; j < mount_point_vector_size(mount_points); j++) {
+          struct mount_point *sibling = mount_point_vector_get(mount_points, j);
+          if (STRING_COMPARE_RIGHT_STARTS_WITH_LEFT ==
+              compare_strings(target_relative, sibling->target_relative)) {
+            if (add_sub_mount_point(arena, new_mount_point, sibling))
+              return report_errno(report, "failed to add '%s' to mount point list", dir->arg);
+          } else {
+            mount_point_vector_set(mount_points, keep++, sibling);
+          }
+        }
+        mount_points->size = keep;
+      }
+      return err_pass;
+    case STRING_COMPARE_LEFT_STARTS_WITH_RIGHT:
+      return add_dir(report, arena, &mount_point->sub_mount_points, dir, target_relative);
+    }
+  }
+  return add_new_mount_point(report, arena, mount_points, dir, target_relative);
+}
+
+// returns: 0 on error, 1 if no mount parent, otherwise, the pointer to the parent mount directory
+struct dir *get_mount_parent_for(struct plan_fs *fs, struct report *report,
+                                 struct mount_point *mount_point, struct mount_point *sub_mount_point)
+{
+  const char *target_diff = lstrip(sub_mount_point->target_relative +
+                                   strlen(mount_point->target_relative), '/');
+  //logf("[DEBUG] target '%s' sub-mount target '%s' diff '%s'",
+  //     mount_point->target_relative,
+  //     sub_mount_point->target_relative,
+  //     target_diff);
+  for (int i = 0; i < dir_vector_size(&mount_point->dirs); i++) {
+    struct dir *dir = dir_vector_get(&mount_point->dirs, i);
+    // a tmpfs, image or reflink upper that isn't mounted yet is treated as empty
+    if (!dir->source)
+      continue;
+    // check if dir has a directory to accomodate
+    char *subdir = concat(dir->source, "/", target_diff);
+    if (!subdir) {
+      report_errno(report, "concat paths failed");
+      return 0; // error
+    }
+    struct stat subdir_stat;
+    if (-1 == fs->stat(fs->context, subdir, &subdir_stat)) {
+      if (errno != ENOENT) {
+        report_errno(report, "stat '%s' failed", subdir);
+        free(subdir);
+        return 0; // error
+      }
+    } else {
+      if (S_ISDIR(subdir_stat.st_mode)) {
+        free(subdir);
+        // TODO: should we check all directories to find conflicts?
+        //       maybe not since the first directory with the match would
+        //       probably take precedence in the overlay
+        return dir; // success, have parent dir
+      }
+      report_error(report, ENOTDIR, "invalid mounts: '%s' is not a directory", subdir);
+      free(subdir);
+      return 0; // error
+    }
+    free(subdir);
+  }
+  return (struct dir*)1; // no parent mount
+}
+
+// collects the sub mount points of mount_point that none of its directories have a
+// directory for, they will need one made before they can be mounted
+err_t get_need_dirs(struct plan_fs *fs, struct report *report, struct mount_point *mount_point,
+                    struct mount_point_vector *need_dirs)
+{
+  for (size_t i = 0; i < mount_point_vector_size(&mount_point->sub_mount_points); i++) {
+    struct mount_point *sub_mount_point = mount_point_vector_get(&mount_point->sub_mount_points, i);
+    struct dir *mount_parent = get_mount_parent_for(fs, report, mount_point, sub_mount_point);
+    if (mount_parent == 0)
+      return err_fail;
+    if (mount_parent == (struct dir*)1) {
+      if (mount_point_vector_add(need_dirs, sub_mount_point))
+        return report_errno(report, "malloc failed");
+    }
+  }
+  return err_pass;
+}
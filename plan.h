@@ -0,0 +1,104 @@
+struct dir
+{
+  const char *arg;
+  const char *source;
+  // if given, this directory is to be writeable, and should be the
+  // upper directory of an overlay
+  const char *workdir;
+  // extra options for the overlay at this directory's mount point, from '@<options>'
+  const char *overlay_options;
+  // if given, this is a writeable layer on a private tmpfs mounted with these options
+  // (possibly empty) from '+tmpfs[=<options>]', source and workdir are set once the
+  // tmpfs is mounted
+  const char *tmpfs_options;
+  // if given, this is a writeable layer on the loop mounted image file from
+  // '+image=<file>[,<options>]', source and workdir are set once it's mounted
+  const char *image;
+  const char *image_options;
+  // if given, this is a writeable reflink copy of this directory from '+reflink=<dir>',
+  // made next to it for each view and bind mounted, source is set once it's mounted
+  const char *reflink;
+  // from '@lazy', the mount point is made the first time something walks into its target
+  unsigned char lazy;
+};
+DEFINE_TYPED_VECTOR(dir, struct dir);
+
+struct mount_point;
+DEFINE_TYPED_VECTOR(mount_point, struct mount_point);
+
+static const unsigned char MOUNT_POINT_CAN_MKDIRS = 0x01;
+
+/*
+Where a plan's mount points, their lists and their paths are allocated. They're packed
+into large blocks, so planning a big view makes a few allocations instead of several
+per directory, and a whole plan is thrown away (or its blocks kept for the next one)
+at once instead of node by node.
+*/
+struct plan_block;
+struct plan_arena
+{
+  // the block being filled first, then the full ones
+  struct plan_block *blocks;
+  // blocks from earlier plans, used again before new ones are allocated
+  struct plan_block *spare;
+  // what is left of the items a list outgrew, handed out before the blocks. a bigger
+  // outgrown list replaces it
+  unsigned char *loose;
+  size_t loose_size;
+  // bytes taken from the blocks for this plan, how many of them lists outgrew and how
+  // many of those were handed out again
+  size_t used;
+  size_t outgrown;
+  size_t reused;
+};
+
+// returns: zeroed memory that lives until the arena is reset, or NULL if out of memory
+void *plan_alloc(struct plan_arena *arena, size_t size);
+// returns: "<dir>/<path>" in the arena, or NULL if out of memory
+char *plan_join_path(struct plan_arena *arena, const char *dir, const char *path);
+// forgets every allocation but keeps the blocks for the next plan
+void plan_arena_reset(struct plan_arena *arena);
+void plan_arena_free(struct plan_arena *arena);
+
+// dirs and sub_mount_points grow in the plan's arena, use mount_point_add_dir and
+// add_dir to add to them rather than the vector functions
+struct mount_point
+{
+  struct dir_vector dirs;
+  struct mount_point_vector sub_mount_points;
+  const char *target_relative;
+  char *private_target_absolute;
+  unsigned char flags;
+};
+
+// the filesystem the planner looks at, this lets it run against a fake one
+struct plan_fs
+{
+  int (*stat)(void *context, const char *path, struct stat *buf);
+  void *context;
+};
+extern struct plan_fs plan_real_fs;
+
+const char *lstrip(const char *str, char strip_char);
+
+enum string_compare_result {
+  // neither string starts with the other
+  STRING_COMPARE_DISJOINT = 0,
+  STRING_COMPARE_EQUAL = 1,
+  STRING_COMPARE_RIGHT_STARTS_WITH_LEFT = 2,
+  STRING_COMPARE_LEFT_STARTS_WITH_RIGHT = 3,
+};
+enum string_compare_result compare_strings(const char *left, const char *right);
+
+err_t mount_point_init(struct plan_arena *arena, struct mount_point *mount_point,
+                       struct dir *first_dir, const char *target_relative);
+err_t mount_point_add_dir(struct plan_arena *arena, struct mount_point *mount_point, struct dir *dir);
+struct mount_point *mount_point_alloc(struct report *report, struct plan_arena *arena,
+                                      struct dir *first_dir, const char *target_relative);
+void print_mount_points(struct mount_point_vector *mount_points, unsigned depth);
+err_t add_dir(struct report *report, struct plan_arena *arena, struct mount_point_vector *mount_points,
+              struct dir *dir, const char *target_relative);
+struct dir *get_mount_parent_for(struct plan_fs *fs, struct report *report,
+                                 struct mount_point *mount_point, struct mount_point *sub_mount_point);
+err_t get_need_dirs(struct plan_fs *fs, struct report *report, struct mount_point *mount_point,
+                    struct mount_point_vector *need_dirs);
@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include "common.h"
+#include "vector.h"
+#include "report.h"
+#include "plan.h"
+
+/*
+Times the planner on synthetic specs against a fake filesystem. Each spec has
+<count> directories with targets up to <depth> components deep. <overlap> is the
+percentage of directories whose target reuses or nests under an earlier target,
+those are the ones that make overlays and sub mount points.
+*/
+
+// errors are only looked at once something has failed
+static struct report report;
+
+static uint64_t rng_state = 88172645463325252ULL;
+static unsigned next_random(unsigned limit)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state % limit;
+}
+
+// the fake filesystem is a sorted list of the directories in it
+struct fake_fs
+{
+  char **dirs;
+  size_t count;
+};
+static int compare_paths(const void *left, const void *right)
+{
+  return strcmp(*(char**)left, *(char**)right);
+}
+static int fake_stat(void *context, const char *path, struct stat *buf)
+{
+  struct fake_fs *fs = context;
+  if (!bsearch(&path, fs->dirs, fs->count, sizeof(char*), compare_paths)) {
+    errno = ENOENT;
+    return -1;
+  }
+  memset(buf, 0, sizeof(*buf));
+  buf->st_mode = S_IFDIR | 0755;
+  return 0;
+}
+
+static char *format(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static char *format(const char *fmt, ...)
+{
+  char *result;
+  va_list args;
+  va_start(args, fmt);
+  if (-1 == vasprintf(&result, fmt, args)) {
+    errnof("vasprintf failed");
+    exit(1);
+  }
+  va_end(args);
+  return result;
+}
+
+static double elapsed_ms(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static size_t count_need_dirs(struct plan_fs *fs, struct mount_point *mount_point, size_t *mount_point_count)
+{
+  struct mount_point_vector need_dirs;
+  memset(&need_dirs, 0, sizeof(need_dirs));
+  if (get_need_dirs(fs, &report, mount_point, &need_dirs)) {
+    errf("get_need_dirs failed: %s", report.first_message);
+    exit(1);
+  }
+  size_t count = mount_point_vector_size(&need_dirs);
+  mount_point_vector_free(&need_dirs);
+  for (size_t i = 0; i < mount_point_vector_size(&mount_point->sub_mount_points); i++) {
+    (*mount_point_count)++;
+    count += count_need_dirs(fs, mount_point_vector_get(&mount_point->sub_mount_points, i),
+                             mount_point_count);
+  }
+  return count;
+}
+
+static void run(unsigned count, unsigned depth, unsigned overlap)
+{
+  struct dir *dirs = calloc(count, sizeof(struct dir));
+  char **targets = calloc(count, sizeof(char*));
+  // every source has a few of the directories that targets are made of
+  const unsigned fake_dirs_per_source = 4;
+  struct fake_fs fake = { calloc(count * fake_dirs_per_source, sizeof(char*)), 0 };
+  if (!dirs || !targets || !fake.dirs) {
+    errnof("calloc failed");
+    exit(1);
+  }
+  for (unsigned i = 0; i < count; i++) {
+    if (i > 0 && next_random(100) < overlap) {
+      const char *base = targets[next_random(i)];
+      targets[i] = next_random(2) ? strdup(base) : format("%s/c%u", base, next_random(8));
+    } else {
+      unsigned components = 1 + next_random(depth);
+      targets[i] = format("d%u", i);
+      for (unsigned c = 1; c < components; c++) {
+        char *longer = format("%s/c%u", targets[i], next_random(8));
+        free(targets[i]);
+        targets[i] = longer;
+      }
+    }
+    dirs[i].arg = dirs[i].source = format("/src/%u", i);
+    for (unsigned j = 0; j < fake_dirs_per_source; j++)
+      fake.dirs[fake.count++] = format("/src/%u/c%u", i, next_random(8));
+  }
+  qsort(fake.dirs, fake.count, sizeof(char*), compare_paths);
+  struct plan_fs fs = { fake_stat, &fake };
+
+  struct dir view_dir = { .arg = "view", .source = "view" };
+  struct plan_arena arena;
+  memset(&arena, 0, sizeof(arena));
+  struct mount_point root;
+  if (mount_point_init(&arena, &root, &view_dir, "")) {
+    errf("mount_point_init failed");
+    exit(1);
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned i = 0; i < count; i++) {
+    if (add_dir(&report, &arena, &root.sub_mount_points, &dirs[i], targets[i])) {
+      errf("add_dir failed: %s", report.first_message);
+      exit(1);
+    }
+  }
+  double add_ms = elapsed_ms(&start);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t mount_point_count = 0;
+  size_t need_dirs = count_need_dirs(&fs, &root, &mount_point_count);
+  double need_ms = elapsed_ms(&start);
+  // the outgrown lists that were used again are memory saved, the rest is left idle
+  logf("%8u %6u %6u%% %12.3f %12.3f %12lu %10lu %10lu %12lu %10lu", count, depth, overlap,
+       add_ms, need_ms, (unsigned long)mount_point_count, (unsigned long)need_dirs,
+       (unsigned long)(arena.used / 1024), (unsigned long)(arena.outgrown / 1024),
+       (unsigned long)(arena.reused / 1024));
+  plan_arena_free(&arena);
+  for (unsigned i = 0; i < count; i++) {
+    free(targets[i]);
+    free((char*)dirs[i].source);
+  }
+  for (size_t i = 0; i < fake.count; i++)
+    free(fake.dirs[i]);
+  free(fake.dirs);
+  free(targets);
+  free(dirs);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned max_count = 100000;
+  if (argc > 1)
+    max_count = strtoul(argv[1], NULL, 10);
+  static const unsigned depths[] = { 1, 4, 8 };
+  static const unsigned overlaps[] = { 0, 10, 50 };
+  logf("%8s %6s %7s %12s %12s %12s %10s %10s %12s %10s", "dirs", "depth", "overlap",
+       "add_dir ms", "need_dirs ms", "mount_points", "need_dirs", "arena KiB", "outgrown KiB",
+       "reused KiB");
+  for (unsigned count = 10; count <= max_count; count *= 10) {
+    for (unsigned d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+      for (unsigned o = 0; o < sizeof(overlaps) / sizeof(overlaps[0]); o++) {
+        run(count, depths[d], overlaps[o]);
+      }
+    }
+  }
+  return 0;
+}
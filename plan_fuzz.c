@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sys/stat.h>
+
+#include "common.h"
+#include "vector.h"
+#include "report.h"
+#include "plan.h"
+
+/*
+libFuzzer target that checks the planner against a simple reference model.
+
+The input is turned into a list of directories with targets made of the components
+"a", "b" and "ab" (so paths share prefixes that are not whole components) and one
+of a few sources. Whether a path exists in the fake filesystem is decided by hashing
+it with a seed taken from the input. The model then says:
+
+- every distinct target is one mount point, whose parent is the mount point with
+  the longest other target that is a whole component prefix of it, or the root
+- a mount point's directories are the ones with its target, in the order given
+- a sub mount point needs a directory made if none of its parent's directories
+  have a directory at the sub mount point's relative path
+
+Build with -fsanitize=fuzzer (see the 'fuzz' meson option). Building with
+-DPLAN_FUZZ_STANDALONE instead gives a main that runs the inputs in the files
+given to it, which is handy for reproducing a crash without clang.
+*/
+
+#define MAX_DIRS 16
+#define SOURCE_COUNT 4
+
+static const char *components[] = { "a", "b", "ab" };
+static const char *sources[SOURCE_COUNT] = { "/s0", "/s1", "/s2", "/s3" };
+
+static uint64_t hash_path(uint64_t seed, const char *path)
+{
+  uint64_t hash = 14695981039346656037ULL ^ seed;
+  for (; path[0]; path++) {
+    hash ^= (unsigned char)path[0];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+static int fake_stat(void *context, const char *path, struct stat *buf)
+{
+  if (hash_path(*(uint64_t*)context, path) & 1) {
+    memset(buf, 0, sizeof(*buf));
+    buf->st_mode = S_IFDIR | 0755;
+    return 0;
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+struct input
+{
+  uint64_t seed;
+  unsigned count;
+  struct dir dirs[MAX_DIRS];
+  char targets[MAX_DIRS][32];
+};
+
+static void decode(struct input *input, const uint8_t *data, size_t size)
+{
+  memset(input, 0, sizeof(*input));
+  for (unsigned i = 0; i < 8 && i < size; i++)
+    input->seed = (input->seed << 8) | data[i];
+  size_t offset = 8;
+  while (offset + 2 <= size && input->count < MAX_DIRS) {
+    unsigned depth = data[offset] % 4;
+    struct dir *dir = &input->dirs[input->count];
+    char *target = input->targets[input->count];
+    dir->source = dir->arg = sources[data[offset + 1] % SOURCE_COUNT];
+    offset += 2;
+    for (unsigned c = 0; c < depth && offset < size; c++, offset++) {
+      if (c > 0)
+        strcat(target, "/");
+      strcat(target, components[data[offset] % 3]);
+    }
+    input->count++;
+  }
+}
+
+// returns: 1 if prefix is a whole component prefix of path and not equal to it
+static unsigned char model_is_under(const char *prefix, const char *path)
+{
+  size_t length = strlen(prefix);
+  if (0 == strcmp(prefix, path))
+    return 0;
+  if (length == 0)
+    return 1;
+  return 0 == strncmp(prefix, path, length) && path[length] == '/';
+}
+
+// returns: the target of the mount point the model says target belongs under, NULL for the root
+static const char *model_parent(struct input *input, const char *target)
+{
+  const char *parent = NULL;
+  for (unsigned i = 0; i < input->count; i++) {
+    const char *other = input->targets[i];
+    if (model_is_under(other, target) && (!parent || strlen(other) > strlen(parent)))
+      parent = other;
+  }
+  return parent;
+}
+
+static unsigned char model_needs_dir(uint64_t seed, struct mount_point *mount_point,
+                                     struct mount_point *sub_mount_point)
+{
+  const char *diff = sub_mount_point->target_relative + strlen(mount_point->target_relative);
+  for (; diff[0] == '/'; diff++) { }
+  for (size_t i = 0; i < dir_vector_size(&mount_point->dirs); i++) {
+    struct dir *dir = dir_vector_get(&mount_point->dirs, i);
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", dir->source, diff);
+    if (hash_path(seed, path) & 1)
+      return 0;
+  }
+  return 1;
+}
+
+static void check(unsigned char ok, const char *what, const char *target)
+{
+  if (!ok) {
+    fprintf(stderr, "plan does not match the model: %s (target '%s')\n", what, target);
+    abort();
+  }
+}
+
+// returns: the number of mount points under mount_point
+static unsigned check_mount_point(struct input *input, struct plan_fs *fs,
+                                  struct mount_point *mount_point, const char *parent_target)
+{
+  const char *target = mount_point->target_relative;
+  if (parent_target) {
+    const char *expected = model_parent(input, target);
+    check(expected && 0 == strcmp(expected, parent_target), "wrong parent", target);
+  } else {
+    check(NULL == model_parent(input, target), "should not be at the root", target);
+  }
+  unsigned dir_index = 0;
+  for (unsigned i = 0; i < input->count; i++) {
+    if (0 != strcmp(input->targets[i], target))
+      continue;
+    check(dir_index < dir_vector_size(&mount_point->dirs), "missing dir", target);
+    check(dir_vector_get(&mount_point->dirs, dir_index) == &input->dirs[i], "wrong dir order", target);
+    dir_index++;
+  }
+  check(dir_index == dir_vector_size(&mount_point->dirs), "extra dirs", target);
+  return dir_index;
+}
+
+static unsigned check_sub_mount_points(struct input *input, struct plan_fs *fs,
+                                       struct mount_point *mount_point, unsigned char is_root)
+{
+  struct mount_point_vector need_dirs;
+  memset(&need_dirs, 0, sizeof(need_dirs));
+  struct report report;
+  memset(&report, 0, sizeof(report));
+  check(err_pass == get_need_dirs(fs, &report, mount_point, &need_dirs), "get_need_dirs failed",
+        mount_point->target_relative);
+  unsigned dir_count = 0;
+  size_t need_index = 0;
+  for (size_t i = 0; i < mount_point_vector_size(&mount_point->sub_mount_points); i++) {
+    struct mount_point *sub = mount_point_vector_get(&mount_point->sub_mount_points, i);
+    dir_count += check_mount_point(input, fs, sub, is_root ? NULL : mount_point->target_relative);
+    unsigned char needs_dir = model_needs_dir(input->seed, mount_point, sub);
+    unsigned char planned = need_index < mount_point_vector_size(&need_dirs) &&
+      mount_point_vector_get(&need_dirs, need_index) == sub;
+    check(needs_dir == planned, "wrong need_dirs", sub->target_relative);
+    need_index += planned;
+    dir_count += check_sub_mount_points(input, fs, sub, 0);
+  }
+  mount_point_vector_free(&need_dirs);
+  return dir_count;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  struct input input;
+  decode(&input, data, size);
+  struct plan_fs fs = { fake_stat, &input.seed };
+
+  struct report report;
+  memset(&report, 0, sizeof(report));
+  struct dir view_dir = { .arg = "view", .source = "view" };
+  struct plan_arena arena;
+  memset(&arena, 0, sizeof(arena));
+  struct mount_point root;
+  check(err_pass == mount_point_init(&arena, &root, &view_dir, ""), "mount_point_init failed", "");
+  for (unsigned i = 0; i < input.count; i++)
+    check(err_pass == add_dir(&report, &arena, &root.sub_mount_points, &input.dirs[i],
+                              input.targets[i]),
+          "add_dir failed", input.targets[i]);
+
+  // every dir shows up exactly once, so together with the per mount point checks
+  // this means every distinct target got exactly one mount point
+  check(input.count == check_sub_mount_points(&input, &fs, &root, 1), "dirs missing from plan", "");
+
+  plan_arena_free(&arena);
+  return 0;
+}
+
+#ifdef PLAN_FUZZ_STANDALONE
+int main(int argc, char *argv[])
+{
+  for (int i = 1; i < argc; i++) {
+    FILE *file = fopen(argv[i], "rb");
+    if (!file) {
+      errnof("open '%s' failed", argv[i]);
+      return 1;
+    }
+    uint8_t data[4096];
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    LLVMFuzzerTestOneInput(data, size);
+    logf("%s: ok", argv[i]);
+  }
+  return 0;
+}
+#endif
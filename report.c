@@ -0,0 +1,79 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "report.h"
+
+// clears the counts and errors but keeps the callbacks
+void report_reset(struct report *report)
+{
+  memset(report->counts, 0, sizeof(report->counts));
+  report->error_count = 0;
+  report->first_error = 0;
+  report->first_message[0] = '\0';
+  report->last_error = 0;
+}
+
+static int report_verror(struct report *report, int error, const char *suffix,
+                         const char *fmt, va_list args)
+{
+  char message[sizeof(report->first_message)];
+  int length = vsnprintf(message, sizeof(message), fmt, args);
+  if (suffix && length >= 0 && (size_t)length < sizeof(message))
+    snprintf(message + length, sizeof(message) - length, ": %s", suffix);
+  if (!error)
+    error = EIO;
+  if (report->error_count++ == 0) {
+    report->first_error = error;
+    memcpy(report->first_message, message, sizeof(message));
+  }
+  report->last_error = error;
+  if (report->error)
+    report->error(report->context, error, message);
+  return 1;
+}
+
+int report_error(struct report *report, int error, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  report_verror(report, error, NULL, fmt, args);
+  va_end(args);
+  return 1;
+}
+
+int report_errno(struct report *report, const char *fmt, ...)
+{
+  int error = errno;
+  va_list args;
+  va_start(args, fmt);
+  report_verror(report, error, strerror(error), fmt, args);
+  va_end(args);
+  errno = error;
+  return 1;
+}
+
+void report_notice(struct report *report, const char *fmt, ...)
+{
+  if (!report->notice)
+    return;
+  char message[sizeof(report->first_message)];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(message, sizeof(message), fmt, args);
+  va_end(args);
+  report->notice(report->context, message);
+}
+
+void report_op(struct report *report, enum report_op_kind kind, const char *op,
+               const char *path, const char *source, int error)
+{
+  if (!error)
+    report->counts[kind]++;
+  if (report->op) {
+    int saved_errno = errno;
+    report->op(report->context, kind, op, path, source, error);
+    errno = saved_errno;
+  }
+}
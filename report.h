@@ -0,0 +1,58 @@
+// Installed with libmkview, so unlike the internal headers it has a guard and can be
+// included on its own, from C or C++.
+#ifndef MKVIEW_REPORT_H
+#define MKVIEW_REPORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum report_op_kind {
+  REPORT_MKDIR,
+  REPORT_MOUNT,
+  REPORT_UMOUNT,
+  REPORT_REMOVE,
+  REPORT_OP_KINDS,
+};
+
+// The library code never prints, it sends every operation and error here. All of the
+// callbacks are optional.
+struct report
+{
+  // an operation was attempted, error is 0 or the errno it failed with
+  void (*op)(void *context, enum report_op_kind kind, const char *op, const char *path,
+             const char *source, int error);
+  // something worth telling the user that isn't an error
+  void (*notice)(void *context, const char *message);
+  // error is an errno value
+  void (*error)(void *context, int error, const char *message);
+  void *context;
+
+  // the number of operations of each kind that succeeded
+  unsigned long counts[REPORT_OP_KINDS];
+  unsigned error_count;
+  // the errno value and description of the first error
+  int first_error;
+  char first_message[512];
+  // the errno value of the most recent error
+  int last_error;
+};
+
+void report_reset(struct report *report);
+// these return 1 so they can be used as 'return report_error(...)' for an err_t
+int report_error(struct report *report, int error, const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+// reports errno, with its description appended to the message
+int report_errno(struct report *report, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+void report_notice(struct report *report, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+// errno is preserved
+void report_op(struct report *report, enum report_op_kind kind, const char *op,
+               const char *path, const char *source, int error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
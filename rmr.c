@@ -2,46 +2,214 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 
 #include "common.h"
+#include "vector.h"
+#include "report.h"
 #include "clean.h"
+#include "state.h"
+#include "log.h"
 
 void usage()
 {
-  logf("Usage: rmr <dir>...");
+  logf("Usage: rmr [-options] <dir>...");
   logf();
   logf("Unmounts and removes all directories/files in <dir>");
+  logf();
+  logf("Multiple directories are removed concurrently by up to <jobs> workers, the default");
+  logf("is the number of online cpus.");
+  logf();
+  logf("Options:");
+  logf("  -j <jobs>      remove up to <jobs> directories at once");
+  logf("  --sync         remove files with plain syscalls instead of io_uring");
+  logf("  -q             only print errors");
+  logf("  -v             print every umount and remove");
+  logf("  --events <fd>  write every operation to <fd> as a line of JSON");
+}
+
+struct work
+{
+  char **realdirs; // NULL entries are skipped
+  struct string_vector *mounts;
+  // one per view, so the workers don't share them
+  struct report *reports;
+  unsigned *error_counts;
+  unsigned char sync;
+  size_t count;
+  size_t next; // index of the next view to remove, shared by the workers
+};
+
+static void *worker(void *arg)
+{
+  struct work *work = arg;
+  for (;;) {
+    size_t index = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+    if (index >= work->count)
+      return NULL;
+    const char *realdir = work->realdirs[index];
+    if (!realdir)
+      continue;
+    // undo exactly what mkview did if it left a state record, this only falls back
+    // to discovering the mounts and directories if the record is missing or stale
+    struct report *report = &work->reports[index];
+    // waits for a mkview or rmr that's working on the same view
+    char *lock_path;
+    int lock = state_lock(report, realdir, &lock_path);
+    if (-1 == lock) {
+      work->error_counts[index]++;
+      continue;
+    }
+    enum state_result state = state_teardown(report, realdir);
+    if (state == STATE_DONE) {
+      state_unlock(lock, lock_path);
+      continue;
+    }
+    unsigned error_count;
+    if (state == STATE_STALE) {
+      // some mounts were already undone, so our snapshot is out of date
+      error_count = loggy_rmtree(report, realdir, work->sync);
+    } else {
+      error_count = loggy_rmtree_with_mounts(report, realdir, &work->mounts[index], work->sync);
+    }
+    if (error_count == 0)
+      state_remove(report, realdir);
+    state_unlock(lock, lock_path);
+    work->error_counts[index] += error_count;
+  }
 }
 
 int main(int argc, char *argv[])
 {
   argc--;
   argv++;
+  log_init();
+  struct report report;
+  log_report_init(&report);
+  unsigned char sync = 0;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  {
+    int arg_index = 0;
+    for (; arg_index < argc && argv[arg_index][0] == '-'; arg_index++) {
+      const char *arg = argv[arg_index];
+      unsigned char handled;
+      if (log_parse_option(argc, (const char**)argv, &arg_index, &handled))
+        return 1;
+      if (handled)
+        continue;
+      if (0 == strcmp(arg, "--sync")) {
+        sync = 1;
+      } else if (0 == strcmp(arg, "-j")) {
+        arg_index++;
+        if (arg_index >= argc) {
+          errf("option '-j' requires an argument");
+          return 1;
+        }
+        char *end;
+        jobs = strtol(argv[arg_index], &end, 10);
+        if (*end != '\0' || jobs < 1) {
+          errf("invalid job count '%s'", argv[arg_index]);
+          return 1;
+        }
+      } else {
+        errf("unknown option '%s'", arg);
+        return 1;
+      }
+    }
+    argc -= arg_index;
+    argv += arg_index;
+  }
   if (argc == 0) {
     usage();
     return 1;
   }
 
-  unsigned error_count = 0;
+  struct work work;
+  memset(&work, 0, sizeof(work));
+  work.count = argc;
+  work.sync = sync;
+  work.realdirs = calloc(argc, sizeof(char*));
+  work.mounts = calloc(argc, sizeof(struct string_vector));
+  work.reports = calloc(argc, sizeof(struct report));
+  work.error_counts = calloc(argc, sizeof(unsigned));
+  if (!work.realdirs || !work.mounts || !work.reports || !work.error_counts) {
+    errnof("malloc failed");
+    return 1;
+  }
+  for (int i = 0; i < argc; i++)
+    log_report_init(&work.reports[i]);
   for (int i = 0; i < argc; i++) {
     const char *dir = argv[i];
     struct stat dir_stat;
     if (-1 == stat(dir, &dir_stat)) {
-      if (errno == ENOENT) {
-        return 0;
+      if (errno != ENOENT) {
+        errnof("stat '%s' failed", dir);
+        work.error_counts[i]++;
       }
-      errnof("stat '%s' failed", dir);
+      continue;
+    }
+    if (!S_ISDIR(dir_stat.st_mode)) {
+      errf("'%s' exists but is not a directory", dir);
+      work.error_counts[i]++;
+      continue;
+    }
+    // get the realdir so we can find it's mount points
+    work.realdirs[i] = realpath2(dir);
+    if (!work.realdirs[i]) {
+      errnof("realpath '%s' failed", dir);
+      work.error_counts[i]++;
+    }
+  }
+
+  // one snapshot of the mount table is shared by all the views
+  {
+    struct string_vector mount_dirs;
+    memset(&mount_dirs, 0, sizeof(mount_dirs));
+    if (read_mount_dirs(&report, &mount_dirs))
+      return 1;
+    if (split_mount_dirs(&report, &mount_dirs, work.realdirs, argc, work.mounts))
       return 1;
+  }
+
+  if (jobs > argc)
+    jobs = argc;
+  pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+  if (!threads) {
+    errnof("malloc failed");
+    return 1;
+  }
+  long started = 0;
+  for (; started < jobs; started++) {
+    int error = pthread_create(&threads[started], NULL, worker, &work);
+    if (error) {
+      errno = error;
+      errnof("pthread_create failed");
+      break;
     }
-    error_count += loggy_rmtree(dir);
   }
+  // if no threads could be started then do the work on this one
+  if (started == 0)
+    worker(&work);
+  for (long i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
 
+  unsigned error_count = 0;
+  unsigned long remove_count = 0, umount_count = 0;
+  for (int i = 0; i < argc; i++) {
+    if (work.error_counts[i])
+      summaryf("'%s': %u errors", argv[i], work.error_counts[i]);
+    error_count += work.error_counts[i];
+    remove_count += work.reports[i].counts[REPORT_REMOVE];
+    umount_count += work.reports[i].counts[REPORT_UMOUNT];
+  }
+  summaryf("removed %lu files and directories, unmounted %lu", remove_count, umount_count);
   if (error_count == 0)
-    logf("\nSuccess");
+    summaryf("\nSuccess");
   else
-    logf("\n%d Errors", error_count);
+    summaryf("\n%d Errors", error_count);
   return error_count;
 }
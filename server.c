@@ -0,0 +1,757 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+#include "server.h"
+
+// requests larger than this are rejected, it just needs to be bigger than ARG_MAX
+#define MAX_REQUEST_LENGTH (16 * 1024 * 1024)
+// a connection whose request hasn't all arrived by then is dropped
+#define REQUEST_TIMEOUT_MS 10000
+// how often commands that couldn't be watched are checked for, once they're killed
+#define REAP_INTERVAL_MS 100
+
+extern char **environ;
+
+// one per connection, lives until the spawned command has been reaped
+struct job
+{
+  int conn;
+  int pidfd; // -1 until the command is spawned
+  // the request is read as it arrives, so one slow client never holds up the others.
+  // received counts the bytes of the header and then the body
+  struct server_request request;
+  char *body;
+  size_t received;
+  int fds[3];
+  int fd_count;
+  // jobs still receiving their request are in a list, oldest (and first to expire) first
+  long long deadline;
+  struct job *prev;
+  struct job *next;
+};
+
+struct server
+{
+  int epoll_fd;
+  struct job *receiving_head;
+  struct job *receiving_tail;
+  // commands that were killed because they couldn't be watched, reaped without waiting
+  pid_t *abandoned;
+  size_t abandoned_count;
+  size_t abandoned_size;
+};
+
+static long long now_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static err_t make_address(struct sockaddr_un *address, const char *socket_path)
+{
+  size_t length = strlen(socket_path);
+  if (length >= sizeof(address->sun_path)) {
+    errf("socket path '%s' is too long", socket_path);
+    return err_fail;
+  }
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  memcpy(address->sun_path, socket_path, length + 1);
+  return err_pass;
+}
+
+static err_t send_with_fd(int conn, const void *data, size_t size, int fd)
+{
+  struct iovec iov = { .iov_base = (void*)data, .iov_len = size };
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd != -1) {
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  if (-1 == sendmsg(conn, &msg, MSG_NOSIGNAL)) {
+    errnof("sendmsg failed");
+    return err_fail;
+  }
+  return err_pass;
+}
+
+// receives exactly size bytes, and up to max_fds file descriptors with the first byte
+// returns: the number of fds received, or -1 on error
+static int recv_with_fds(int conn, void *data, size_t size, int *fds, unsigned max_fds)
+{
+  struct iovec iov = { .iov_base = data, .iov_len = size };
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * 3)];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * max_fds);
+  ssize_t received = recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  if (received == -1) {
+    errnof("recvmsg failed");
+    return -1;
+  }
+  int fd_count = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * fd_count);
+    }
+  }
+  if (received != size) {
+    errf("connection closed after %ld of %lu bytes", (long)received, (unsigned long)size);
+    for (int i = 0; i < fd_count; i++)
+      close(fds[i]);
+    return -1;
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    errf("received too many file descriptors");
+    for (int i = 0; i < fd_count; i++)
+      close(fds[i]);
+    return -1;
+  }
+  return fd_count;
+}
+
+static err_t read_all(int fd, char *buffer, size_t size)
+{
+  while (size > 0) {
+    ssize_t result = read(fd, buffer, size);
+    if (result <= 0) {
+      if (result == -1 && errno == EINTR)
+        continue;
+      if (result == 0)
+        errf("connection closed before request was complete");
+      else
+        errnof("read failed");
+      return err_fail;
+    }
+    buffer += result;
+    size -= result;
+  }
+  return err_pass;
+}
+
+// splits count null-terminated strings out of buffer into a null-terminated array
+static char **split_strings(char **next, char *limit, uint32_t count)
+{
+  // every string takes at least its null, so a count the buffer can't hold is malformed
+  // and is never allocated for
+  if (count > (size_t)(limit - *next)) {
+    errf("malformed request");
+    return NULL;
+  }
+  char **strings = malloc(sizeof(char*) * (count + 1));
+  if (!strings) {
+    errnof("malloc failed");
+    return NULL;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    char *end = memchr(*next, '\0', limit - *next);
+    if (!end) {
+      errf("malformed request");
+      free(strings);
+      return NULL;
+    }
+    strings[i] = *next;
+    *next = end + 1;
+  }
+  strings[count] = NULL;
+  return strings;
+}
+
+/*
+Finds file the way execvp would, but in the PATH from the client's environment rather
+than the server's, with relative directories in it taken from the client's directory.
+returns: the path to spawn (file itself if it has a slash), or NULL with errno set
+*/
+static const char *find_program(const char *file, char **envp, const char *cwd, char *buffer,
+                                size_t size)
+{
+  if (strchr(file, '/'))
+    return file;
+  // glibc's default when there's no PATH
+  const char *path = "/bin:/usr/bin";
+  for (char **env = envp; *env; env++) {
+    if (0 == strncmp(*env, "PATH=", 5)) {
+      path = *env + 5;
+      break;
+    }
+  }
+  int error = ENOENT;
+  for (const char *dir = path; ; ) {
+    const char *end = strchrnul(dir, ':');
+    int length = end - dir;
+    int written = (length == 0) ? snprintf(buffer, size, "%s/%s", cwd, file) :
+      (dir[0] == '/') ? snprintf(buffer, size, "%.*s/%s", length, dir, file) :
+      snprintf(buffer, size, "%s/%.*s/%s", cwd, length, dir, file);
+    struct stat file_stat;
+    if (written >= 0 && (size_t)written < size && 0 == stat(buffer, &file_stat) &&
+        S_ISREG(file_stat.st_mode)) {
+      if (0 == access(buffer, X_OK))
+        return buffer;
+      error = EACCES;
+    }
+    if (!end[0])
+      break;
+    dir = end + 1;
+  }
+  errno = error;
+  return NULL;
+}
+
+// returns: the pid of the spawned command, or -errno on failure
+static pid_t spawn_request(struct server_request *request, char *body, int fds[3])
+{
+  char *next = body;
+  char *limit = body + request->length;
+  char **cwd = split_strings(&next, limit, 1);
+  if (!cwd)
+    return -EINVAL;
+  char **argv = split_strings(&next, limit, request->argc);
+  char **envp = argv ? split_strings(&next, limit, request->envc) : NULL;
+  pid_t result = -EINVAL;
+  if (!envp || request->argc == 0)
+    goto done;
+
+  char program_buffer[PATH_MAX];
+  const char *program = find_program(argv[0], envp, cwd[0], program_buffer, sizeof(program_buffer));
+  if (!program) {
+    errnof("spawn '%s' failed", argv[0]);
+    result = -errno;
+    goto done;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+  for (int i = 0; i < 3; i++)
+    posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+  posix_spawn_file_actions_addchdir_np(&actions, cwd[0]);
+  {
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  }
+  pid_t pid;
+  int error = posix_spawn(&pid, program, &actions, &attr, argv, envp);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error) {
+    errno = error;
+    errnof("spawn '%s' failed", argv[0]);
+    result = -error;
+  } else {
+    result = pid;
+  }
+ done:
+  free(envp);
+  free(argv);
+  free(cwd);
+  return result;
+}
+
+static void stop_receiving(struct server *server, struct job *job)
+{
+  if (job->prev)
+    job->prev->next = job->next;
+  else if (server->receiving_head == job)
+    server->receiving_head = job->next;
+  if (job->next)
+    job->next->prev = job->prev;
+  else if (server->receiving_tail == job)
+    server->receiving_tail = job->prev;
+  job->prev = job->next = NULL;
+}
+
+static void finish_job(struct server *server, struct job *job)
+{
+  stop_receiving(server, job);
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, job->conn, NULL);
+  close(job->conn);
+  if (job->pidfd != -1) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, job->pidfd, NULL);
+    close(job->pidfd);
+  }
+  for (int i = 0; i < job->fd_count; i++)
+    close(job->fds[i]);
+  free(job->body);
+  free(job);
+}
+
+// kills a command the server can't watch, it's reaped later without waiting for it
+static void abandon_command(struct server *server, pid_t pid)
+{
+  kill(pid, SIGKILL);
+  if (server->abandoned_count == server->abandoned_size) {
+    size_t size = server->abandoned_size ? server->abandoned_size * 2 : 8;
+    pid_t *abandoned = realloc(server->abandoned, size * sizeof(pid_t));
+    if (!abandoned) {
+      // it stays a zombie until the server exits
+      errnof("realloc failed");
+      return;
+    }
+    server->abandoned = abandoned;
+    server->abandoned_size = size;
+  }
+  server->abandoned[server->abandoned_count++] = pid;
+}
+
+static void reap_abandoned(struct server *server)
+{
+  for (size_t i = 0; i < server->abandoned_count; ) {
+    pid_t result = waitpid(server->abandoned[i], NULL, WNOHANG);
+    if (result == 0 || (result == -1 && errno == EINTR)) {
+      i++;
+    } else {
+      server->abandoned[i] = server->abandoned[--server->abandoned_count];
+    }
+  }
+}
+
+/*
+Reads whatever has arrived of a job's request without blocking. The stdio fds come
+with the first byte of the header.
+returns: 1 once the whole request is in, 0 if more is needed, -1 if the connection
+should be dropped, with *error set to the errno to reply with (0 for no reply)
+*/
+static int receive_request(struct job *job, int *error)
+{
+  *error = 0;
+  for (;;) {
+    char *buffer;
+    size_t size;
+    if (job->received < sizeof(job->request)) {
+      buffer = (char*)&job->request + job->received;
+      size = sizeof(job->request) - job->received;
+    } else {
+      size_t body_received = job->received - sizeof(job->request);
+      if (body_received == job->request.length)
+        return 1;
+      buffer = job->body + body_received;
+      size = job->request.length - body_received;
+    }
+    struct iovec iov = { .iov_base = buffer, .iov_len = size };
+    union {
+      char buf[CMSG_SPACE(sizeof(int) * 3)];
+      struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t received = recvmsg(job->conn, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (received == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      errnof("recvmsg failed");
+      return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *fds = (int*)CMSG_DATA(cmsg);
+        for (int i = 0; i < count; i++) {
+          if (job->fd_count < 3)
+            job->fds[job->fd_count++] = fds[i];
+          else
+            close(fds[i]);
+        }
+      }
+    }
+    if (received == 0) {
+      errf("connection closed after %lu bytes of its request", (unsigned long)job->received);
+      return -1;
+    }
+    job->received += received;
+    if (job->received == sizeof(job->request)) {
+      // the cwd and every argument and variable take at least their null in the body
+      if (job->fd_count != 3 || job->request.magic != SERVER_MAGIC ||
+          job->request.length > MAX_REQUEST_LENGTH || (msg.msg_flags & MSG_CTRUNC) ||
+          (uint64_t)job->request.argc + job->request.envc + 1 > job->request.length) {
+        errf("malformed request");
+        *error = EINVAL;
+        return -1;
+      }
+      job->body = malloc(job->request.length ? job->request.length : 1);
+      if (!job->body) {
+        errnof("malloc failed");
+        *error = ENOMEM;
+        return -1;
+      }
+    }
+  }
+}
+
+// reads more of a job's request, spawning it once it's complete
+static void read_job(struct server *server, struct job *job)
+{
+  int error;
+  int result = receive_request(job, &error);
+  if (result == 0)
+    return;
+  stop_receiving(server, job);
+  if (result == -1 && !error) {
+    finish_job(server, job);
+    return;
+  }
+  struct server_reply reply = { .error = error, .pid = 0 };
+  if (result == 1) {
+    pid_t pid = spawn_request(&job->request, job->body, job->fds);
+    if (pid < 0) {
+      reply.error = -pid;
+    } else {
+      job->pidfd = pidfd_open(pid, 0);
+      if (job->pidfd == -1) {
+        errnof("pidfd_open %d failed", pid);
+        // we can't watch for it without a pidfd
+        abandon_command(server, pid);
+        reply.error = EIO;
+      } else {
+        reply.pid = pid;
+      }
+    }
+  }
+  for (int i = 0; i < job->fd_count; i++)
+    close(job->fds[i]);
+  job->fd_count = 0;
+  free(job->body);
+  job->body = NULL;
+  // the client may have gone away, that's fine, we still need to reap the command
+  send_with_fd(job->conn, &reply, sizeof(reply), job->pidfd);
+  if (reply.error) {
+    finish_job(server, job);
+    return;
+  }
+  // stop watching the connection, we only write to it from now on
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, job->conn, NULL);
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = job };
+  if (-1 == epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, job->pidfd, &event)) {
+    errnof("epoll_ctl failed");
+    abandon_command(server, reply.pid);
+    finish_job(server, job);
+  }
+}
+
+static void reap_job(struct server *server, struct job *job)
+{
+  siginfo_t info;
+  memset(&info, 0, sizeof(info));
+  if (-1 == waitid(P_PIDFD, job->pidfd, &info, WEXITED)) {
+    errnof("waitid failed");
+  } else {
+    struct server_exit exit_message;
+    exit_message.status = (info.si_code == CLD_EXITED) ?
+      (info.si_status & 0xff) << 8 : (info.si_status & 0x7f);
+    // a few bytes always fit in the socket buffer of a connection nothing else was sent on
+    send(job->conn, &exit_message, sizeof(exit_message), MSG_NOSIGNAL | MSG_DONTWAIT);
+  }
+  finish_job(server, job);
+}
+
+static err_t accept_job(struct server *server, int listen_fd)
+{
+  int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (conn == -1) {
+    errnof("accept failed");
+    return err_pass; // not fatal
+  }
+  struct ucred cred;
+  socklen_t cred_size = sizeof(cred);
+  if (-1 == getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size)) {
+    errnof("getsockopt SO_PEERCRED failed");
+    close(conn);
+    return err_pass;
+  }
+  if (cred.uid != getuid()) {
+    errf("rejecting connection from uid %u", (unsigned)cred.uid);
+    close(conn);
+    return err_pass;
+  }
+  struct job *job = calloc(1, sizeof(struct job));
+  if (!job) {
+    errnof("malloc failed");
+    close(conn);
+    return err_pass;
+  }
+  job->conn = conn;
+  job->pidfd = -1;
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = job };
+  if (-1 == epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, conn, &event)) {
+    errnof("epoll_ctl failed");
+    close(conn);
+    free(job);
+    return err_fail;
+  }
+  job->deadline = now_ms() + REQUEST_TIMEOUT_MS;
+  job->prev = server->receiving_tail;
+  if (server->receiving_tail)
+    server->receiving_tail->next = job;
+  else
+    server->receiving_head = job;
+  server->receiving_tail = job;
+  return err_pass;
+}
+
+// returns: how long epoll_wait can wait before a request expires or a command needs reaping
+static int get_timeout(struct server *server)
+{
+  int timeout = -1;
+  if (server->receiving_head) {
+    long long remaining = server->receiving_head->deadline - now_ms();
+    timeout = (remaining < 0) ? 0 : remaining;
+  }
+  if (server->abandoned_count && (timeout == -1 || timeout > REAP_INTERVAL_MS))
+    timeout = REAP_INTERVAL_MS;
+  return timeout;
+}
+
+err_t server_run(const char *root, const char *socket_path)
+{
+  struct sockaddr_un address;
+  if (make_address(&address, socket_path))
+    return err_fail;
+  // the socket has to be created before we chroot so it lives outside the view
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) {
+    errnof("socket failed");
+    return err_fail;
+  }
+  mode_t old_umask = umask(0077);
+  int bind_result = bind(listen_fd, (struct sockaddr*)&address, sizeof(address));
+  umask(old_umask);
+  if (-1 == bind_result) {
+    errnof("bind '%s' failed", socket_path);
+    return err_fail;
+  }
+  if (-1 == listen(listen_fd, SOMAXCONN)) {
+    errnof("listen failed");
+    return err_fail;
+  }
+
+  if (-1 == chdir(root)) {
+    errnof("chdir '%s' failed", root);
+    return err_fail;
+  }
+  if (-1 == chroot(".")) {
+    errnof("chroot '%s' failed", root);
+    return err_fail;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  struct server server;
+  memset(&server, 0, sizeof(server));
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (server.epoll_fd == -1) {
+    errnof("epoll_create1 failed");
+    return err_fail;
+  }
+  {
+    // the listen socket is the only entry whose data is NULL
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (-1 == epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event)) {
+      errnof("epoll_ctl failed");
+      return err_fail;
+    }
+  }
+  logf("listening on '%s'", socket_path);
+  fflush(stdout);
+
+  for (;;) {
+    struct epoll_event events[64];
+    int count = epoll_wait(server.epoll_fd, events, 64, get_timeout(&server));
+    if (count == -1) {
+      if (errno != EINTR) {
+        errnof("epoll_wait failed");
+        return err_fail;
+      }
+      count = 0;
+    }
+    for (int i = 0; i < count; i++) {
+      struct job *job = events[i].data.ptr;
+      if (job == NULL) {
+        if (accept_job(&server, listen_fd))
+          return err_fail;
+      } else if (job->pidfd == -1) {
+        read_job(&server, job);
+      } else {
+        reap_job(&server, job);
+      }
+    }
+    long long now = now_ms();
+    while (server.receiving_head && server.receiving_head->deadline <= now) {
+      errf("dropping a connection whose request didn't arrive within %d seconds",
+           REQUEST_TIMEOUT_MS / 1000);
+      finish_job(&server, server.receiving_head);
+    }
+    reap_abandoned(&server);
+  }
+}
+
+static size_t add_string_sizes(size_t size, const char **strings, unsigned count)
+{
+  for (unsigned i = 0; i < count; i++)
+    size += strlen(strings[i]) + 1;
+  return size;
+}
+static char *copy_strings(char *next, const char **strings, unsigned count)
+{
+  for (unsigned i = 0; i < count; i++)
+    next = stpcpy(next, strings[i]) + 1;
+  return next;
+}
+
+int server_client(const char *socket_path, int argc, const char *argv[])
+{
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    errnof("getcwd failed");
+    return 1;
+  }
+  unsigned envc = 0;
+  for (; environ[envc]; envc++) { }
+
+  struct server_request request;
+  request.magic = SERVER_MAGIC;
+  request.argc = argc;
+  request.envc = envc;
+  {
+    const char *cwd_string = cwd;
+    size_t length = add_string_sizes(0, &cwd_string, 1);
+    length = add_string_sizes(length, argv, argc);
+    length = add_string_sizes(length, (const char**)environ, envc);
+    if (length > MAX_REQUEST_LENGTH) {
+      errf("command and environment are too large");
+      return 1;
+    }
+    request.length = length;
+  }
+  char *body = malloc(request.length);
+  if (!body) {
+    errnof("malloc failed");
+    return 1;
+  }
+  {
+    const char *cwd_string = cwd;
+    char *next = copy_strings(body, &cwd_string, 1);
+    next = copy_strings(next, argv, argc);
+    copy_strings(next, (const char**)environ, envc);
+  }
+
+  struct sockaddr_un address;
+  if (make_address(&address, socket_path))
+    return 1;
+  int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn == -1) {
+    errnof("socket failed");
+    return 1;
+  }
+  if (-1 == connect(conn, (struct sockaddr*)&address, sizeof(address))) {
+    errnof("connect '%s' failed", socket_path);
+    return 1;
+  }
+
+  {
+    struct iovec iov[2] = {
+      { .iov_base = &request, .iov_len = sizeof(request) },
+      { .iov_base = body, .iov_len = request.length },
+    };
+    int fds[3] = { 0, 1, 2 };
+    union {
+      char buf[CMSG_SPACE(sizeof(fds))];
+      struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    if (sent == -1) {
+      errnof("sendmsg failed");
+      return 1;
+    }
+    // the header and its fds went out with the first byte, send whatever is left
+    size_t total = sizeof(request) + request.length;
+    for (size_t offset = sent; offset < total; ) {
+      ssize_t result = (offset < sizeof(request)) ?
+        send(conn, (char*)&request + offset, sizeof(request) - offset, MSG_NOSIGNAL) :
+        send(conn, body + (offset - sizeof(request)), total - offset, MSG_NOSIGNAL);
+      if (result == -1) {
+        errnof("send failed");
+        return 1;
+      }
+      offset += result;
+    }
+  }
+  free(body);
+
+  struct server_reply reply;
+  int pidfd = -1;
+  if (-1 == recv_with_fds(conn, &reply, sizeof(reply), &pidfd, 1))
+    return 1;
+  if (reply.error) {
+    errno = reply.error;
+    errnof("server failed to spawn '%s'", argv[0]);
+    return 127;
+  }
+  // we don't use the pidfd ourselves, it's there for clients that want to signal
+  // or poll the command directly
+  if (pidfd != -1)
+    close(pidfd);
+
+  struct server_exit exit_message;
+  if (read_all(conn, (char*)&exit_message, sizeof(exit_message)))
+    return 1;
+  if (WIFEXITED(exit_message.status))
+    return WEXITSTATUS(exit_message.status);
+  return 128 + WTERMSIG(exit_message.status);
+}
@@ -0,0 +1,27 @@
+#define SERVER_MAGIC 0x6d6b7673 // "mkvs"
+
+// A request is this header followed by <length> bytes holding <argc> + <envc> + 1
+// null-terminated strings: the working directory, then the argv strings, then the
+// environment strings. The client's stdin, stdout and stderr are passed with the
+// header as SCM_RIGHTS.
+struct server_request
+{
+  uint32_t magic;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t length;
+};
+// Sent back once the command is spawned, along with a pidfd for it if error is 0.
+struct server_reply
+{
+  int32_t error;
+  int32_t pid;
+};
+// Sent back once the command exits, status is the same as from waitpid.
+struct server_exit
+{
+  int32_t status;
+};
+
+err_t server_run(const char *root, const char *socket_path);
+int server_client(const char *socket_path, int argc, const char *argv[]);
@@ -0,0 +1,109 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t round_constants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotate_right(uint32_t value, unsigned bits)
+{
+  return (value >> bits) | (value << (32 - bits));
+}
+
+static void process_block(uint32_t state[8], const unsigned char *block)
+{
+  uint32_t w[64];
+  for (unsigned i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+      ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+  }
+  for (unsigned i = 16; i < 64; i++) {
+    uint32_t s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (unsigned i = 0; i < 64; i++) {
+    uint32_t s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+    uint32_t choose = (e & f) ^ (~e & g);
+    uint32_t temp1 = h + s1 + choose + round_constants[i] + w[i];
+    uint32_t s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+    uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t temp2 = s0 + majority;
+    h = g;
+    g = f;
+    f = e;
+    e = d + temp1;
+    d = c;
+    c = b;
+    b = a;
+    a = temp1 + temp2;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256_init(struct sha256 *sha)
+{
+  static const uint32_t initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  memcpy(sha->state, initial_state, sizeof(initial_state));
+  sha->length = 0;
+  sha->block_used = 0;
+}
+
+void sha256_update(struct sha256 *sha, const void *data, size_t size)
+{
+  const unsigned char *next = data;
+  sha->length += size;
+  if (sha->block_used) {
+    size_t fill = sizeof(sha->block) - sha->block_used;
+    if (fill > size)
+      fill = size;
+    memcpy(sha->block + sha->block_used, next, fill);
+    sha->block_used += fill;
+    next += fill;
+    size -= fill;
+    if (sha->block_used < sizeof(sha->block))
+      return;
+    process_block(sha->state, sha->block);
+    sha->block_used = 0;
+  }
+  for (; size >= sizeof(sha->block); next += sizeof(sha->block), size -= sizeof(sha->block))
+    process_block(sha->state, next);
+  memcpy(sha->block, next, size);
+  sha->block_used = size;
+}
+
+void sha256_final(struct sha256 *sha, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+  uint64_t bit_length = sha->length * 8;
+  sha->block[sha->block_used++] = 0x80;
+  if (sha->block_used > sizeof(sha->block) - 8) {
+    memset(sha->block + sha->block_used, 0, sizeof(sha->block) - sha->block_used);
+    process_block(sha->state, sha->block);
+    sha->block_used = 0;
+  }
+  memset(sha->block + sha->block_used, 0, sizeof(sha->block) - 8 - sha->block_used);
+  for (unsigned i = 0; i < 8; i++)
+    sha->block[sizeof(sha->block) - 1 - i] = (unsigned char)(bit_length >> (i * 8));
+  process_block(sha->state, sha->block);
+  for (unsigned i = 0; i < 8; i++) {
+    digest[i * 4] = (unsigned char)(sha->state[i] >> 24);
+    digest[i * 4 + 1] = (unsigned char)(sha->state[i] >> 16);
+    digest[i * 4 + 2] = (unsigned char)(sha->state[i] >> 8);
+    digest[i * 4 + 3] = (unsigned char)sha->state[i];
+  }
+}
@@ -0,0 +1,15 @@
+// SHA-256, include stdint.h first.
+
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256
+{
+  uint32_t state[8];
+  uint64_t length;
+  unsigned char block[64];
+  size_t block_used;
+};
+
+void sha256_init(struct sha256 *sha);
+void sha256_update(struct sha256 *sha, const void *data, size_t size);
+void sha256_final(struct sha256 *sha, unsigned char digest[SHA256_DIGEST_SIZE]);
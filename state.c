@@ -0,0 +1,490 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+
+#include "common.h"
+#include "vector.h"
+#include "concat.h"
+#include "report.h"
+#include "clean.h"
+#include "state.h"
+
+/*
+mkview leaves a state record next to each view at <parent>/.<name>.mkview. It's a
+text file with one operation per line in the order they were performed:
+
+    mkview-state 1
+    mkdir <path>
+    mount <mount_id> <path>
+    tree <mount_id> <path>
+    clone <inode> <path>
+
+Paths are relative to the view directory ("." is the view itself) so the record
+stays valid if the view is moved, except for a clone. That's the absolute path of a
+'+reflink' copy, which lives next to the directory it copies, not in the view. A path
+is always the last thing on a line, a newline or backslash in it is escaped with a
+backslash. rmr undoes the operations in reverse, checking that each mount still has
+the recorded mount id first, the unique one (STATX_MNT_ID_UNIQUE) where the kernel
+has it since the other is reused once a mount is gone. A tree is a mount with a copy
+of another view's mounts under it ('mkview --from'), it's detached along with
+everything under it. A clone is removed with everything in it, but only if its path is
+exactly what state_clone_template makes for a directory next to it and it's still the
+directory with the recorded inode, so a stale or edited record can't remove anything
+else.
+*/
+static const char STATE_HEADER[] = "mkview-state 1";
+static const char CLONE_SUFFIX[] = ".mkview-clone-";
+// what mkdtemp replaces in the template
+#define CLONE_RANDOM_LENGTH 6
+
+#ifndef STATX_MNT_ID_UNIQUE
+#define STATX_MNT_ID_UNIQUE 0x00004000U
+#endif
+// the kernel fills in the unique id if it has it, the plain one otherwise
+#define STATX_ANY_MNT_ID (STATX_MNT_ID | STATX_MNT_ID_UNIQUE)
+
+// returns: "<parent>/.<name><suffix>" for dir "<parent>/<name>"
+static char *get_sibling_path(struct report *report, const char *dir, const char *suffix)
+{
+  const char *name = strrchr(dir, '/');
+  if (!name || name[1] == '\0') {
+    report_error(report, EINVAL, "cannot put a state record next to '%s'", dir);
+    return NULL;
+  }
+  char *parent = strndup(dir, name - dir);
+  if (!parent) {
+    report_errno(report, "strndup failed");
+    return NULL;
+  }
+  char *path = concat(parent, "/.", name + 1, suffix);
+  free(parent);
+  if (!path)
+    report_errno(report, "concat paths failed");
+  return path;
+}
+
+char *state_path(struct report *report, const char *realdir)
+{
+  return get_sibling_path(report, realdir, ".mkview");
+}
+
+char *state_clone_template(struct report *report, const char *realdir)
+{
+  return get_sibling_path(report, realdir, ".mkview-clone-XXXXXX");
+}
+
+/*
+The lock is a file next to the view, <parent>/.<name>.mkview-lock, that only exists
+while someone holds it. Whoever unlocks removes it, so one that was waiting may get
+the lock on a file that's already gone. It checks that the file it locked is still
+the one at the path and starts over if it isn't.
+*/
+int state_lock(struct report *report, const char *dir, char **lock_path)
+{
+  // the view may not exist yet, then its parent has to be real for rmr to find the lock
+  char *realdir = realpath2(dir);
+  if (!realdir && errno == ENOENT) {
+    const char *name = strrchr(dir, '/');
+    char *parent = name ? strndup(dir, name - dir + (name == dir)) : strdup(".");
+    char *realparent = parent ? realpath2(parent) : NULL;
+    if (realparent)
+      realdir = concat(realparent, "/", name ? name + 1 : dir);
+    free(realparent);
+    free(parent);
+  }
+  if (!realdir) {
+    report_errno(report, "realpath '%s' failed", dir);
+    return -1;
+  }
+  char *path = get_sibling_path(report, realdir, ".mkview-lock");
+  free(realdir);
+  if (!path)
+    return -1;
+  for (;;) {
+    int lock = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (-1 == lock) {
+      report_errno(report, "open lock '%s' failed", path);
+      break;
+    }
+    int result;
+    while (-1 == (result = flock(lock, LOCK_EX)) && errno == EINTR) { }
+    if (-1 == result) {
+      report_errno(report, "lock '%s' failed", path);
+      close(lock);
+      break;
+    }
+    struct stat lock_stat, path_stat;
+    if (0 == fstat(lock, &lock_stat) && 0 == stat(path, &path_stat) &&
+        lock_stat.st_dev == path_stat.st_dev && lock_stat.st_ino == path_stat.st_ino) {
+      *lock_path = path;
+      return lock;
+    }
+    close(lock);
+  }
+  free(path);
+  return -1;
+}
+
+void state_unlock(int lock, char *lock_path)
+{
+  unlink(lock_path);
+  close(lock);
+  free(lock_path);
+}
+
+FILE *state_create(struct report *report, const char *realdir)
+{
+  char *path = state_path(report, realdir);
+  if (!path)
+    return NULL;
+  FILE *state = fopen(path, "we");
+  if (!state) {
+    report_errno(report, "failed to create state record '%s'", path);
+    free(path);
+    return NULL;
+  }
+  free(path);
+  fprintf(state, "%s\n", STATE_HEADER);
+  fflush(state);
+  return state;
+}
+
+FILE *state_append(struct report *report, const char *realdir)
+{
+  char *path = state_path(report, realdir);
+  if (!path)
+    return NULL;
+  FILE *state = fopen(path, "ae");
+  if (!state)
+    report_errno(report, "failed to open state record '%s'", path);
+  free(path);
+  return state;
+}
+
+// returns: the path relative to view_dir, or NULL if it isn't inside it
+static const char *get_relative_path(const char *view_dir, const char *path)
+{
+  size_t view_dir_length = strlen(view_dir);
+  if (0 != strncmp(view_dir, path, view_dir_length))
+    return NULL;
+  path += view_dir_length;
+  if (path[0] == '\0')
+    return ".";
+  if (path[0] != '/')
+    return NULL;
+  for (; path[0] == '/'; path++) { }
+  return (path[0] == '\0') ? "." : path;
+}
+
+static void write_path(FILE *state, const char *path)
+{
+  for (; path[0]; path++) {
+    if (path[0] == '\n') {
+      fputs("\\n", state);
+    } else {
+      if (path[0] == '\\')
+        fputc('\\', state);
+      fputc(path[0], state);
+    }
+  }
+  fputc('\n', state);
+  fflush(state);
+}
+
+void state_record_mkdir(struct report *report, FILE *state, const char *view_dir, const char *dir)
+{
+  if (!state)
+    return;
+  const char *relative = get_relative_path(view_dir, dir);
+  if (!relative) {
+    report_error(report, EINVAL, "codebug: '%s' is not inside view '%s'", dir, view_dir);
+    return;
+  }
+  fputs("mkdir ", state);
+  write_path(state, relative);
+}
+
+static void record_mount(struct report *report, FILE *state, const char *op, const char *view_dir,
+                         const char *target)
+{
+  if (!state)
+    return;
+  const char *relative = get_relative_path(view_dir, target);
+  if (!relative) {
+    report_error(report, EINVAL, "codebug: '%s' is not inside view '%s'", target, view_dir);
+    return;
+  }
+  struct statx target_statx;
+  // a lazy mount point's trigger is recorded as it is, not what it would mount
+  if (-1 == statx(AT_FDCWD, target, AT_NO_AUTOMOUNT, STATX_ANY_MNT_ID, &target_statx) ||
+      !(target_statx.stx_mask & STATX_ANY_MNT_ID)) {
+    // without the id rmr can't trust the record, leave it out so it falls back to
+    // discovering the mounts
+    report_errno(report, "statx '%s' failed, the state record will be incomplete", target);
+    fputs("incomplete\n", state);
+    fflush(state);
+    return;
+  }
+  fprintf(state, "%s %llu ", op, (unsigned long long)target_statx.stx_mnt_id);
+  write_path(state, relative);
+}
+
+void state_record_mount(struct report *report, FILE *state, const char *view_dir, const char *target)
+{
+  record_mount(report, state, "mount", view_dir, target);
+}
+
+void state_record_tree(struct report *report, FILE *state, const char *view_dir, const char *target)
+{
+  record_mount(report, state, "tree", view_dir, target);
+}
+
+void state_record_clone(struct report *report, FILE *state, const char *clone)
+{
+  if (!state)
+    return;
+  if (clone[0] != '/' || !strstr(clone, CLONE_SUFFIX)) {
+    report_error(report, EINVAL, "codebug: '%s' is not a clone", clone);
+    return;
+  }
+  struct stat clone_stat;
+  if (-1 == lstat(clone, &clone_stat)) {
+    report_errno(report, "stat '%s' failed, the state record will be incomplete", clone);
+    fputs("incomplete\n", state);
+    fflush(state);
+    return;
+  }
+  fprintf(state, "clone %llu ", (unsigned long long)clone_stat.st_ino);
+  write_path(state, clone);
+}
+
+DEFINE_TYPED_VECTOR(line, char);
+
+static void unescape_path(char *path)
+{
+  char *out = path;
+  for (; path[0]; path++) {
+    if (path[0] == '\\' && path[1]) {
+      path++;
+      *out++ = (path[0] == 'n') ? '\n' : path[0];
+    } else {
+      *out++ = path[0];
+    }
+  }
+  out[0] = '\0';
+}
+
+// returns: err_fail if the record is missing or malformed
+static err_t read_state(struct report *report, const char *path, struct line_vector *lines)
+{
+  FILE *state = fopen(path, "re");
+  if (!state) {
+    if (errno != ENOENT)
+      report_errno(report, "failed to open state record '%s'", path);
+    return err_fail;
+  }
+  err_t result = err_pass;
+  char *line = NULL;
+  size_t line_size = 0;
+  for (size_t line_index = 0; ; line_index++) {
+    ssize_t length = getline(&line, &line_size, state);
+    if (length == -1)
+      break;
+    if (length > 0 && line[length - 1] == '\n')
+      line[length - 1] = '\0';
+    if (line_index == 0) {
+      if (0 != strcmp(line, STATE_HEADER)) {
+        report_error(report, EINVAL, "state record '%s' has an unknown format", path);
+        result = err_fail;
+        break;
+      }
+      continue;
+    }
+    if (0 == strcmp(line, "incomplete")) {
+      result = err_fail;
+      break;
+    }
+    char *copy = strdup(line);
+    if (!copy || line_vector_add(lines, copy)) {
+      report_errno(report, "failed to read state record '%s'", path);
+      free(copy);
+      result = err_fail;
+      break;
+    }
+  }
+  free(line);
+  fclose(state);
+  return result;
+}
+
+// returns: 1 if path is exactly what state_clone_template makes for the directory next
+//          to it that it's named after, with its Xs filled in, and that directory's parent
+//          is already a real path
+static unsigned char is_clone_path(struct report *report, const char *path)
+{
+  const char *name = strrchr(path, '/');
+  size_t length = strlen(path);
+  size_t suffix_length = strlen(CLONE_SUFFIX) + CLONE_RANDOM_LENGTH;
+  if (path[0] != '/' || !name || name[1] != '.' || strlen(name + 2) <= suffix_length ||
+      0 != strncmp(path + length - suffix_length, CLONE_SUFFIX, strlen(CLONE_SUFFIX)))
+    return 0;
+  for (const char *c = path + length - CLONE_RANDOM_LENGTH; *c; c++) {
+    if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9')))
+      return 0;
+  }
+  char *parent = strndup(path, (name == path) ? 1 : (size_t)(name - path));
+  char *real_parent = parent ? realpath2(parent) : NULL;
+  // "<parent>/<name>" from "<parent>/.<name>.mkview-clone-<random>"
+  char *source = strndup(path, length - suffix_length);
+  char *template = NULL;
+  if (source) {
+    char *dot = source + (name - path) + 1;
+    memmove(dot, dot + 1, strlen(dot));
+    template = state_clone_template(report, source);
+  }
+  unsigned char result = real_parent && 0 == strcmp(real_parent, parent) && template &&
+    strlen(template) == length && 0 == strncmp(template, path, length - CLONE_RANDOM_LENGTH);
+  free(template);
+  free(source);
+  free(real_parent);
+  free(parent);
+  return result;
+}
+
+// returns: 0 if the clone was removed, 1 if it couldn't be
+static unsigned char remove_clone(struct report *report, char *line)
+{
+  char *path;
+  unsigned long long inode = strtoull(line, &path, 10);
+  if (path == line || path[0] != ' ') {
+    report_error(report, EINVAL, "malformed clone in the state record '%s'", line);
+    return 1;
+  }
+  path++;
+  unescape_path(path);
+  // anything else in the record would be a bad place to start removing a whole tree
+  if (!is_clone_path(report, path)) {
+    report_error(report, EINVAL, "state record has a clone '%s' that mkview wouldn't make", path);
+    return 1;
+  }
+  struct stat clone_stat;
+  if (-1 == lstat(path, &clone_stat)) {
+    // an earlier rmr may have got this far before it failed
+    if (errno == ENOENT)
+      return 0;
+    report_errno(report, "stat '%s' failed", path);
+    return 1;
+  }
+  if (!S_ISDIR(clone_stat.st_mode) || clone_stat.st_ino != inode) {
+    report_notice(report, "state record is stale, '%s' is no longer the clone it made", path);
+    return 1;
+  }
+  return loggy_rmtree(report, path, 0) ? 1 : 0;
+}
+
+// returns: 0 if the operation was undone, 1 if the record doesn't match the view
+static unsigned char undo(struct report *report, const char *realdir, char *line)
+{
+  char *path;
+  unsigned long long mount_id = 0;
+  unsigned char is_tree = 0;
+  if (0 == strncmp(line, "clone ", 6))
+    return remove_clone(report, line + 6);
+  if (0 == strncmp(line, "mkdir ", 6)) {
+    path = line + 6;
+  } else if (0 == strncmp(line, "mount ", 6) || (is_tree = (0 == strncmp(line, "tree ", 5)))) {
+    mount_id = strtoull(line + (is_tree ? 5 : 6), &path, 10);
+    if (path[0] != ' ')
+      return 1;
+    path++;
+  } else {
+    report_error(report, EINVAL, "unknown state record operation '%s'", line);
+    return 1;
+  }
+  unescape_path(path);
+  char *full_path = (0 == strcmp(path, ".")) ? strdup(realdir) : concat(realdir, "/", path);
+  if (!full_path) {
+    report_errno(report, "concat paths failed");
+    return 1;
+  }
+  unsigned char stale = 0;
+  if (mount_id) {
+    struct statx target_statx;
+    if (-1 == statx(AT_FDCWD, full_path, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_ANY_MNT_ID,
+                    &target_statx) ||
+        !(target_statx.stx_mask & STATX_ANY_MNT_ID) ||
+        target_statx.stx_mnt_id != mount_id) {
+      report_notice(report, "state record is stale, '%s' is no longer mount %llu", full_path, mount_id);
+      stale = 1;
+    } else {
+      int result = is_tree ? umount2(full_path, MNT_DETACH) : umount(full_path);
+      report_op(report, REPORT_UMOUNT, "umount", full_path, NULL, result ? errno : 0);
+      if (-1 == result) {
+        report_errno(report, "umount '%s' failed", full_path);
+        stale = 1;
+      }
+    }
+  } else {
+    int result = rmdir(full_path);
+    report_op(report, REPORT_REMOVE, "rmdir", full_path, NULL, result ? errno : 0);
+    // the directory may have lived on a tmpfs that is already gone
+    if (-1 == result && errno != ENOENT) {
+      report_errno(report, "rmdir '%s' failed", full_path);
+      stale = 1;
+    }
+  }
+  free(full_path);
+  return stale;
+}
+
+enum state_result state_teardown(struct report *report, const char *realdir)
+{
+  char *path = state_path(report, realdir);
+  if (!path)
+    return STATE_MISSING;
+  struct line_vector lines;
+  memset(&lines, 0, sizeof(lines));
+  enum state_result result = STATE_MISSING;
+  if (read_state(report, path, &lines))
+    goto done;
+
+  for (size_t i = line_vector_size(&lines); i > 0; i--) {
+    if (undo(report, realdir, line_vector_get(&lines, i - 1))) {
+      result = (i == line_vector_size(&lines)) ? STATE_MISSING : STATE_STALE;
+      goto done;
+    }
+  }
+  // mkview doesn't record the view directory if it already existed
+  if (-1 == rmdir(realdir) && errno != ENOENT) {
+    report_errno(report, "rmdir '%s' failed", realdir);
+    result = STATE_STALE;
+    goto done;
+  }
+  if (-1 == unlink(path))
+    report_errno(report, "failed to remove state record '%s'", path);
+  result = STATE_DONE;
+ done:
+  for (size_t i = 0; i < line_vector_size(&lines); i++)
+    free(line_vector_get(&lines, i));
+  line_vector_free(&lines);
+  free(path);
+  return result;
+}
+
+void state_remove(struct report *report, const char *realdir)
+{
+  char *path = state_path(report, realdir);
+  if (!path)
+    return;
+  if (-1 == unlink(path) && errno != ENOENT)
+    report_errno(report, "failed to remove state record '%s'", path);
+  free(path);
+}
@@ -0,0 +1,32 @@
+char *state_path(struct report *report, const char *realdir);
+// returns: "<parent>/.<name>.mkview-clone-XXXXXX" for mkdtemp, where a '+reflink' copy
+// of realdir goes
+char *state_clone_template(struct report *report, const char *realdir);
+// waits for an exclusive lock on the view at dir, so only one mkview or rmr works on a
+// view at a time, dir doesn't have to exist yet
+// returns: the lock, or -1 on error, release it with state_unlock and lock_path
+int state_lock(struct report *report, const char *dir, char **lock_path);
+void state_unlock(int lock, char *lock_path);
+FILE *state_create(struct report *report, const char *realdir);
+// opens the view's existing state record to add what's mounted after view_apply
+FILE *state_append(struct report *report, const char *realdir);
+void state_record_mkdir(struct report *report, FILE *state, const char *view_dir, const char *dir);
+void state_record_mount(struct report *report, FILE *state, const char *view_dir,
+                        const char *target);
+// target is a copy of a mount tree, teardown detaches it with everything under it
+void state_record_tree(struct report *report, FILE *state, const char *view_dir,
+                       const char *target);
+// clone is the absolute path of a '+reflink' copy from state_clone_template, teardown removes
+// it and everything in it if it's still the directory that was recorded
+void state_record_clone(struct report *report, FILE *state, const char *clone);
+
+enum state_result {
+  // the view was removed by undoing the operations in its state record
+  STATE_DONE = 0,
+  // there is no usable state record, nothing was done
+  STATE_MISSING = 1,
+  // the record stopped matching the view after some operations were undone
+  STATE_STALE = 2,
+};
+enum state_result state_teardown(struct report *report, const char *realdir);
+void state_remove(struct report *report, const char *realdir);
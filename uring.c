@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include "common.h"
+#include "uring.h"
+
+/*
+There is no liburing dependency, this is the few parts of it we need. The rings
+are shared with the kernel so the head/tail indices are accessed with acquire/release
+atomics, see io_uring(7).
+*/
+
+// a ring the kernel keeps refusing is retried this many times, sleeping 1ms, 2ms, 4ms...
+#define MAX_BUSY_RETRIES 10
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned char supports_opcodes(int fd, const unsigned char *opcodes, unsigned count)
+{
+  size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probe_size);
+  if (!probe)
+    return 0;
+  unsigned char supported = 0;
+  if (0 == io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256)) {
+    supported = 1;
+    for (unsigned i = 0; i < count; i++) {
+      if (opcodes[i] > probe->last_op || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED))
+        supported = 0;
+    }
+  }
+  free(probe);
+  return supported;
+}
+
+err_t uring_init(struct uring *ring, unsigned entries, const unsigned char *opcodes, unsigned count)
+{
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = io_uring_setup(entries, &params);
+  if (ring->fd == -1)
+    return err_fail;
+  // IORING_FEAT_SINGLE_MMAP (5.4) is older than any of the opcodes we use
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !supports_opcodes(ring->fd, opcodes, count))
+    goto fail;
+  ring->entries = params.sq_entries;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (ring->cq_ring_size > ring->sq_ring_size)
+    ring->sq_ring_size = ring->cq_ring_size;
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto fail;
+  }
+  ring->cq_ring = ring->sq_ring;
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  char *sq = ring->sq_ring;
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  char *cq = ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return err_pass;
+ fail:
+  uring_free(ring);
+  return err_fail;
+}
+
+void uring_free(struct uring *ring)
+{
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd != -1)
+    close(ring->fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->unsubmitted;
+  if (tail - head >= ring->entries)
+    return NULL;
+  unsigned index = tail & *ring->sq_mask;
+  ring->sq_array[index] = index;
+  ring->unsubmitted++;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+err_t uring_submit(struct uring *ring, unsigned wait_count)
+{
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->unsubmitted, __ATOMIC_RELEASE);
+  ring->unsubmitted = 0;
+  unsigned busy_retries = 0;
+  for (;;) {
+    // the kernel normally takes every sqe, if it runs short of memory the rest
+    // stay in the ring and are passed again
+    unsigned to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    int result = io_uring_enter(ring->fd, to_submit, wait_count,
+                                wait_count ? IORING_ENTER_GETEVENTS : 0);
+    if (result > 0 || (result == 0 && to_submit == 0)) {
+      if ((unsigned)result == to_submit || wait_count == 0)
+        return err_pass;
+      busy_retries = 0;
+      continue;
+    }
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result == -1 && errno != EAGAIN && errno != EBUSY)
+      return err_fail;
+    // the completion queue is full or the kernel is out of memory, the caller can make
+    // room by reaping completions. with none to reap, back off and give up after about
+    // a second rather than spin on a ring the kernel keeps refusing
+    if (uring_peek_cqe(ring))
+      return err_pass;
+    if (busy_retries == MAX_BUSY_RETRIES) {
+      errno = EAGAIN;
+      return err_fail;
+    }
+    struct timespec delay = { 0, 1000000L << busy_retries++ };
+    nanosleep(&delay, NULL);
+  }
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,30 @@
+// A minimal io_uring made with the raw syscalls, include <linux/io_uring.h> first.
+struct uring
+{
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  // sqes that have been filled in but not given to the kernel yet
+  unsigned unsubmitted;
+};
+
+// fails (without logging) if io_uring is unavailable or doesn't support all of
+// the count opcodes, so the caller can fall back to plain syscalls
+err_t uring_init(struct uring *ring, unsigned entries, const unsigned char *opcodes, unsigned count);
+void uring_free(struct uring *ring);
+// returns: a zeroed sqe, or NULL if the submission queue is full
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+// submits the pending sqes and waits for at least wait_count completions, errno is
+// set if it fails
+err_t uring_submit(struct uring *ring, unsigned wait_count);
+// returns: the next completion or NULL, call uring_cqe_seen once done with it
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
@@ -0,0 +1,2640 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#include <linux/limits.h>
+#include <linux/magic.h>
+#include <linux/auto_fs.h>
+
+#include "common.h"
+#include "vector.h"
+#include "concat.h"
+#include "report.h"
+#include "state.h"
+#include "clean.h"
+#include "plan.h"
+#include "loop.h"
+#include "command.h"
+#include "sha256.h"
+#include "copy.h"
+#include "view.h"
+
+// a mkdir, mount or '+reflink' copy that view_apply undoes if the view can't be finished
+enum undo_kind {
+  UNDO_MKDIR,
+  UNDO_MOUNT,
+  UNDO_CLONE,
+};
+struct undo_op
+{
+  unsigned char kind;
+  char path[];
+};
+DEFINE_TYPED_VECTOR(undo_op, struct undo_op);
+
+struct view
+{
+  struct report *report;
+  struct dir root_dir;
+  struct mount_point root_mount_point;
+  // the mount points and their target paths, reset with the view but its blocks are kept
+  struct plan_arena plan;
+  // overlay options applied to every overlay in the view, from '-o <options>'
+  const char *overlay_options;
+  // every dir ever given to view_add, the first dir_count belong to the current view
+  // and the rest are reused by the next views
+  struct dir_vector dirs;
+  size_t dir_count;
+  // memory that belongs to the current view, freed by view_reset
+  struct vector allocations;
+  // the view's state record, every mkdir and mount performed in the view goes in it
+  FILE *state_file;
+  // where mounts shared between views go, /tmp/mkview-<euid> unless it's set
+  const char *stage_dir;
+  // build the view under a hidden name and move it into place once it's done
+  unsigned char atomic;
+  // the view whose mounts are copied before the directories are mounted on top
+  const char *base_dir;
+  // a squashfs or erofs image that is mounted as the whole view instead of any dirs
+  const char *import_image;
+  // every mkdir and mount made by view_apply so far, in order
+  struct undo_op_vector undo_log;
+  // the pipe the view's autofs triggers write to, and the automounter that reads it,
+  // -1 until the first lazy mount point is made
+  int automount_pipe;
+  pid_t automounter;
+  // set in the automounter, where lazy mount points are made right away
+  unsigned char in_automounter;
+  // the mkview-automount view_apply starts, MKVIEW_AUTOMOUNT_HELPER unless it's set
+  const char *automount_helper;
+};
+
+// returns: ptr, which now belongs to the view, or NULL if it's NULL or can't be kept
+static void *view_own(struct view *view, void *ptr)
+{
+  if (!ptr) {
+    report_errno(view->report, "out of memory");
+    return NULL;
+  }
+  if (vector_add(&view->allocations, ptr)) {
+    report_errno(view->report, "out of memory");
+    free(ptr);
+    return NULL;
+  }
+  return ptr;
+}
+
+static unsigned get_dir_length(const char *file)
+{
+  const char * s = strrchr(file, '/');
+  if (s == NULL) {
+    return 0;
+  }
+  return s - file;
+}
+
+// returns: str without trailing strip_chars, or NULL if it couldn't be allocated
+static const char *view_rstrip(struct view *view, const char *str, char strip_char)
+{
+  size_t length = strlen(str);
+  if (length == 0)
+    return str;
+  length--;
+  if (str[length] != strip_char)
+    return str;
+  for (; length > 0 && str[length-1] == strip_char; length--)
+    { }
+  return view_own(view, strndup(str, length));
+}
+
+enum dir_status {
+  DIR_STATUS_DOES_NOT_EXIST = 0,
+  DIR_STATUS_NOT_A_DIR = 1,
+  DIR_STATUS_EMPTY = 2,
+  DIR_STATUS_NOT_EMPTY = 3,
+};
+static err_t get_dir_status(struct report *report, enum dir_status *status, const char *dir)
+{
+  {
+    struct stat dir_stat;
+    if (-1 == stat(dir, &dir_stat)) {
+      if (errno != ENOENT)
+        return report_errno(report, "stat '%s' failed", dir);
+      *status = DIR_STATUS_DOES_NOT_EXIST;
+      return err_pass;
+    }
+    if (!S_ISDIR(dir_stat.st_mode)) {
+      *status = DIR_STATUS_NOT_A_DIR;
+      return err_pass;
+    }
+  }
+
+  DIR *dir_handle = opendir(dir);
+  if (dir_handle == NULL)
+    return report_errno(report, "opendir '%s' failed", dir);
+
+  for (;;) {
+    errno = 0;
+    struct dirent *entry = readdir(dir_handle);
+    if (entry == NULL) {
+      if (errno) {
+        report_errno(report, "readdir '%s' failed", dir);
+        closedir(dir_handle);
+        return err_fail;
+      }
+      *status = DIR_STATUS_EMPTY;
+      break;
+    }
+    if (0 == strcmp(".", entry->d_name) || 0 == strcmp("..", entry->d_name))
+      continue;
+    *status = DIR_STATUS_NOT_EMPTY;
+    break;
+  }
+  closedir(dir_handle);
+  return err_pass;
+}
+
+static void undo(struct view *view, struct undo_op *op)
+{
+  if (op->kind == UNDO_CLONE) {
+    loggy_rmtree(view->report, op->path, 0);
+  } else if (op->kind == UNDO_MOUNT) {
+    // nothing can be using a view that was never finished, so don't let anything stop it
+    int result = umount2(op->path, MNT_DETACH);
+    report_op(view->report, REPORT_UMOUNT, "umount", op->path, NULL, result ? errno : 0);
+    if (-1 == result)
+      report_errno(view->report, "umount '%s' failed", op->path);
+  } else {
+    int result = rmdir(op->path);
+    report_op(view->report, REPORT_REMOVE, "rmdir", op->path, NULL, result ? errno : 0);
+    if (-1 == result)
+      report_errno(view->report, "rmdir '%s' failed", op->path);
+  }
+}
+
+// adds a mkdir, mount or copy that just succeeded to the undo log, undoing it right away
+// if it can't be
+static err_t log_undo(struct view *view, enum undo_kind kind, const char *path)
+{
+  size_t path_size = strlen(path) + 1;
+  struct undo_op *op = malloc(sizeof(struct undo_op) + path_size);
+  if (op) {
+    op->kind = kind;
+    memcpy(op->path, path, path_size);
+    if (0 == undo_op_vector_add(&view->undo_log, op))
+      return err_pass;
+  }
+  report_errno(view->report, "out of memory for the undo log");
+  if (op) {
+    undo(view, op);
+    free(op);
+  }
+  return err_fail;
+}
+
+// undoes everything in the undo log from first on, newest first
+static void rollback(struct view *view, size_t first)
+{
+  for (size_t i = undo_op_vector_size(&view->undo_log); i > first; i--)
+    undo(view, undo_op_vector_get(&view->undo_log, i - 1));
+}
+
+static int loggy_mkdir(struct view *view, const char *dir, mode_t mode)
+{
+  int result = mkdir(dir, mode);
+  report_op(view->report, REPORT_MKDIR, "mkdir", dir, NULL, result ? errno : 0);
+  if (-1 == result) {
+    report_errno(view->report, "mkdir '%s' failed", dir);
+    return -1;
+  }
+  if (log_undo(view, UNDO_MKDIR, dir))
+    return -1;
+  state_record_mkdir(view->report, view->state_file, view->root_dir.source, dir);
+  return 0;
+}
+
+static int loggy_mount(struct view *view, const char *source, const char *target,
+                       const char *filesystemtype, const char *options)
+{
+  int result = mount(source, target, filesystemtype, 0, options);
+  report_op(view->report, REPORT_MOUNT, "mount", target, source, result ? errno : 0);
+  if (-1 == result) {
+    report_errno(view->report, "mount%s%s%s%s %s '%s' failed",
+                 filesystemtype ? " -t " : "", filesystemtype ? filesystemtype : "",
+                 options ? " -o " : "", options ? options : "",
+                 source ? source : "\"\"", target);
+    return -1; // fail
+  }
+  if (log_undo(view, UNDO_MOUNT, target))
+    return -1;
+  state_record_mount(view->report, view->state_file, view->root_dir.source, target);
+  return 0; // success
+}
+
+static int loggy_bind_mount(struct view *view, const char *source, const char *target)
+{
+  int result = mount(source, target, NULL, MS_BIND, NULL);
+  report_op(view->report, REPORT_MOUNT, "bind", target, source, result ? errno : 0);
+  if (-1 == result) {
+    report_errno(view->report, "bind mount '%s' to '%s' failed", source, target);
+    return -1; // fail
+  }
+  if (log_undo(view, UNDO_MOUNT, target))
+    return -1;
+  state_record_mount(view->report, view->state_file, view->root_dir.source, target);
+  return 0; // success
+}
+
+#define DEFAULT_MKDIR_MODE S_IRWXU | S_IRWXG| S_IROTH | S_IXOTH
+
+static err_t mkdirs_helper(struct view *view, char *dir, size_t length)
+{
+  if (dir[length] != '\0')
+    return report_error(view->report, EINVAL, "code bug: mkdirs was called with a string that did not end in null");
+  {
+    struct stat dir_stat;
+    if (0 == stat(dir, &dir_stat)) {
+      if (S_ISDIR(dir_stat.st_mode)) {
+        return err_pass;
+      }
+      return report_error(view->report, ENOTDIR, "'%s' exists but is not a directory", dir);
+    }
+  }
+  {
+    unsigned parent_dir_length = get_dir_length(dir);
+    if (parent_dir_length == length)
+      return report_error(view->report, EINVAL, "failed to create directory '%s'", dir);
+    if (parent_dir_length > 0) {
+      dir[parent_dir_length] = '\0';
+      err_t result = mkdirs_helper(view, dir, parent_dir_length);
+      dir[parent_dir_length] = '/';
+      if (result)
+        return result;
+    }
+  }
+  if (-1 == loggy_mkdir(view, dir, DEFAULT_MKDIR_MODE)) {
+    // error already reported
+    return err_fail;
+  }
+  return err_pass;
+}
+static err_t mkdirs(struct view *view, char *dir)
+{
+  return mkdirs_helper(view, dir, strlen(dir));
+}
+
+struct overlay_option
+{
+  const char *name;
+  // the values it accepts separated by '|', NULL if it doesn't take a value
+  const char *values;
+  // the overlay module parameter that only exists if the kernel supports this option
+  const char *param;
+  // the kernel version that added the option, used if the overlay module isn't loaded
+  unsigned major;
+  unsigned minor;
+};
+static const struct overlay_option overlay_options[] = {
+  { "volatile", NULL, NULL, 5, 10 },
+  { "metacopy", "on|off", "metacopy", 4, 19 },
+  { "index", "on|off", "index", 4, 13 },
+  { "xino", "on|off|auto", "xino_auto", 4, 17 },
+  { "redirect_dir", "on|off|follow|nofollow", "redirect_dir", 4, 10 },
+};
+
+static unsigned char value_in_list(const char *value, size_t value_length, const char *list)
+{
+  for (;;) {
+    const char *end = strchrnul(list, '|');
+    if (end - list == value_length && 0 == memcmp(value, list, value_length))
+      return 1;
+    if (end[0] == '\0')
+      return 0;
+    list = end + 1;
+  }
+}
+
+// returns: the option for the given "name[=value]", NULL if it isn't a valid overlay option
+static const struct overlay_option *find_overlay_option(const char *option, size_t length)
+{
+  const char *equals = memchr(option, '=', length);
+  size_t name_length = equals ? equals - option : length;
+  for (size_t i = 0; i < sizeof(overlay_options) / sizeof(overlay_options[0]); i++) {
+    const struct overlay_option *overlay_option = &overlay_options[i];
+    if (strlen(overlay_option->name) != name_length ||
+        0 != memcmp(overlay_option->name, option, name_length))
+      continue;
+    if (!overlay_option->values)
+      return equals ? NULL : overlay_option;
+    if (!equals)
+      return NULL;
+    return value_in_list(equals + 1, length - name_length - 1, overlay_option->values) ?
+      overlay_option : NULL;
+  }
+  return NULL;
+}
+
+// 'lazy' goes in the same list as the overlay options, but it's for mkview
+static unsigned char is_lazy_option(const char *option, size_t length)
+{
+  return length == 4 && 0 == memcmp(option, "lazy", 4);
+}
+
+// returns: 1 if every comma separated option in options is a valid overlay option or 'lazy'
+static unsigned char is_overlay_option_list(const char *options)
+{
+  if (options[0] == '\0')
+    return 0;
+  for (;;) {
+    const char *end = strchrnul(options, ',');
+    if (!is_lazy_option(options, end - options) && !find_overlay_option(options, end - options))
+      return 0;
+    if (end[0] == '\0')
+      return 1;
+    options = end + 1;
+  }
+}
+
+static unsigned char kernel_supports(const struct overlay_option *overlay_option)
+{
+  if (overlay_option->param) {
+    char *param_path = concat("/sys/module/overlay/parameters/", overlay_option->param);
+    if (param_path) {
+      int exists = access(param_path, F_OK);
+      free(param_path);
+      if (exists == 0)
+        return 1;
+    }
+  }
+  struct utsname name;
+  unsigned major, minor;
+  if (-1 == uname(&name) || 2 != sscanf(name.release, "%u.%u", &major, &minor)) {
+    // assume it's supported and let the mount fail if it isn't
+    return 1;
+  }
+  return major > overlay_option->major ||
+    (major == overlay_option->major && minor >= overlay_option->minor);
+}
+
+// verify options are valid overlay options that the running kernel supports
+static err_t check_overlay_options(struct report *report, const char *options)
+{
+  for (;;) {
+    const char *end = strchrnul(options, ',');
+    const struct overlay_option *overlay_option = find_overlay_option(options, end - options);
+    if (!overlay_option)
+      return report_error(report, EINVAL, "invalid overlay option '%.*s'", (int)(end - options), options);
+    if (!kernel_supports(overlay_option)) {
+      return report_error(report, ENOTSUP,
+                          "overlay option '%s' is not supported by the running kernel (needs %u.%u)",
+                          overlay_option->name, overlay_option->major, overlay_option->minor);
+    }
+    if (end[0] == '\0')
+      return err_pass;
+    options = end + 1;
+  }
+}
+
+static char *get_absolute_target(struct view *view, struct mount_point *mount_point)
+{
+  if (!mount_point->private_target_absolute) {
+    mount_point->private_target_absolute = plan_join_path(&view->plan, view->root_dir.source,
+                                                          mount_point->target_relative);
+    if (!mount_point->private_target_absolute)
+      report_errno(view->report, "concat paths failed");
+  }
+  return mount_point->private_target_absolute;
+}
+
+// overlayfs refuses more lower directories than this (OVL_MAX_STACK in the kernel)
+#define OVERLAY_MAX_LAYERS 500
+#define LOWERDIR_PREFIX "lowerdir="
+// "<stage_dir>/ov-<64 hex digits>"
+#define STAGE_NAME_LENGTH (4 + SHA256_DIGEST_SIZE * 2)
+
+// returns: the longest options string mount(2) accepts, it copies at most a page of them
+static size_t get_max_options_length(void)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  return (page_size > 0 ? (size_t)page_size : 4096) - 1;
+}
+
+// returns: the length of "<dir>:<dir>..."
+static size_t get_lower_dirs_length(const char **lower_dirs, size_t count)
+{
+  size_t length = count ? count - 1 : 0;
+  for (size_t i = 0; i < count; i++)
+    length += strlen(lower_dirs[i]);
+  return length;
+}
+
+// returns: "lowerdir=<dirs>[,upperdir=<dir>,workdir=<dir>][,<options>][,<options>]"
+static char *make_overlay_options(struct view *view, const char **lower_dirs, size_t count,
+                                  struct dir *upper_dir, const char *options1, const char *options2)
+{
+  size_t length = strlen(LOWERDIR_PREFIX) + get_lower_dirs_length(lower_dirs, count);
+  if (upper_dir)
+    length += strlen(",upperdir=") + strlen(upper_dir->source) +
+      strlen(",workdir=") + strlen(upper_dir->workdir);
+  if (options1)
+    length += 1 + strlen(options1);
+  if (options2)
+    length += 1 + strlen(options2);
+  char *options = malloc(length + 1);
+  if (!options) {
+    report_errno(view->report, "malloc failed");
+    return NULL;
+  }
+  char *end = stpcpy(options, LOWERDIR_PREFIX);
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0)
+      *end++ = ':';
+    end = stpcpy(end, lower_dirs[i]);
+  }
+  if (upper_dir) {
+    end = stpcpy(stpcpy(end, ",upperdir="), upper_dir->source);
+    end = stpcpy(stpcpy(end, ",workdir="), upper_dir->workdir);
+  }
+  if (options1)
+    end = stpcpy(stpcpy(end, ","), options1);
+  if (options2)
+    end = stpcpy(stpcpy(end, ","), options2);
+  return options;
+}
+
+// makes sure the stage directory exists and that only we can get into it
+static err_t init_stage_dir(struct view *view, struct stat *stage_stat)
+{
+  if (!view->stage_dir) {
+    char uid[24];
+    snprintf(uid, sizeof(uid), "%u", (unsigned)geteuid());
+    view->stage_dir = view_own(view, concat("/tmp/mkview-", uid));
+    if (!view->stage_dir)
+      return err_fail;
+  }
+  int result = mkdir(view->stage_dir, S_IRWXU);
+  if (result == 0 || errno != EEXIST)
+    report_op(view->report, REPORT_MKDIR, "mkdir", view->stage_dir, NULL, result ? errno : 0);
+  if (-1 == result && errno != EEXIST)
+    return report_errno(view->report, "mkdir stage directory '%s' failed", view->stage_dir);
+  if (-1 == lstat(view->stage_dir, stage_stat))
+    return report_errno(view->report, "stat stage directory '%s' failed", view->stage_dir);
+  if (view->stage_dir[0] != '/') {
+    // the groups are used as lower directories so they need absolute paths
+    char *stage_dir = realpath2(view->stage_dir);
+    if (!stage_dir)
+      return report_errno(view->report, "realpath('%s') failed", view->stage_dir);
+    if (!(view->stage_dir = view_own(view, stage_dir)))
+      return err_fail;
+  }
+  if (!S_ISDIR(stage_stat->st_mode) || stage_stat->st_uid != geteuid() ||
+      (stage_stat->st_mode & (S_IRWXG | S_IRWXO))) {
+    return report_error(view->report, EPERM,
+                        "stage directory '%s' must be a directory that only its owner can access",
+                        view->stage_dir);
+  }
+  return err_pass;
+}
+
+// returns: whether path is a filesystem of type magic mounted over a stage directory path
+static unsigned char is_stage_mount(const char *path, const struct stat *stage_stat, long magic)
+{
+  struct stat path_stat;
+  struct statfs path_statfs;
+  return 0 == stat(path, &path_stat) && path_stat.st_dev != stage_stat->st_dev &&
+    0 == statfs(path, &path_statfs) && path_statfs.f_type == magic;
+}
+
+// returns: the read-only overlay of lower_dirs in the stage directory, mounting it unless
+//          an earlier view already did, or NULL on error
+static const char *get_stage_overlay(struct view *view, const struct stat *stage_stat,
+                                     const char **lower_dirs, size_t count)
+{
+  char *options = make_overlay_options(view, lower_dirs, count, NULL, NULL, NULL);
+  if (!options)
+    return NULL;
+  // the order of the layers is what the overlay shows, so unlike a skeleton's paths they
+  // aren't sorted
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  {
+    struct sha256 sha;
+    sha256_init(&sha);
+    for (size_t i = 0; i < count; i++)
+      sha256_update(&sha, lower_dirs[i], strlen(lower_dirs[i]) + 1);
+    sha256_final(&sha, digest);
+  }
+  char name[STAGE_NAME_LENGTH + 1];
+  memcpy(name, "/ov-", 4);
+  for (unsigned i = 0; i < SHA256_DIGEST_SIZE; i++)
+    snprintf(name + 4 + i * 2, sizeof(name) - 4 - i * 2, "%02x", digest[i]);
+  char *path = view_own(view, concat(view->stage_dir, name));
+  if (!path) {
+    free(options);
+    return NULL;
+  }
+
+  if (is_stage_mount(path, stage_stat, OVERLAYFS_SUPER_MAGIC)) {
+    free(options);
+    return path;
+  }
+  if (-1 == mkdir(path, S_IRWXU) && errno != EEXIST) {
+    report_errno(view->report, "mkdir '%s' failed", path);
+    free(options);
+    return NULL;
+  }
+  // shared by every view that uses this group so it doesn't go in the state record
+  int result = mount("none", path, "overlay", 0, options);
+  report_op(view->report, REPORT_MOUNT, "mount", path, "none", result ? errno : 0);
+  free(options);
+  if (-1 == result) {
+    report_errno(view->report, "mount overlay of %lu staged directories at '%s' failed",
+                 count, path);
+    return NULL;
+  }
+  return path;
+}
+
+// returns: how many of the lower_dirs fit in a group of at most limit directories whose
+//          "<dir>:<dir>..." is at most max_length
+static size_t get_group_size(const char **lower_dirs, size_t count, size_t limit, size_t max_length)
+{
+  size_t size = 0;
+  size_t length = 0;
+  for (; size < count && size < limit; size++) {
+    length += (size ? 1 : 0) + strlen(lower_dirs[size]);
+    if (length > max_length)
+      break;
+  }
+  return size;
+}
+
+/*
+Overlayfs takes at most OVERLAY_MAX_LAYERS lower directories and mount(2) takes at most
+a page of options. When a mount point has more than that, its lower directories are split
+into balanced groups, each group is mounted as a read-only overlay in the stage directory
+and the groups become the lower directories instead. The kernel only stacks overlays two
+deep so there is one level of groups, which is up to 250000 directories.
+
+Groups are named by a SHA-256 of their directories, in order and with their terminating
+nulls, so views with the same groups share them and a group reused by name has the layers
+asked for. The name is only of the paths: a layer directory that is removed and made
+again keeps being served by the group mounted over the old one, until the stage
+directory is removed. An overlay keeps its own reference to its layers, so unmounting a
+group doesn't affect the views using it and the stage directory can be removed with rmr
+at any time.
+*/
+static err_t stage_lower_dirs(struct view *view, const char *target_dir, const char **lower_dirs,
+                              size_t *count, size_t other_options_length)
+{
+  size_t max_length = get_max_options_length();
+  if (*count <= OVERLAY_MAX_LAYERS &&
+      other_options_length + get_lower_dirs_length(lower_dirs, *count) <= max_length)
+    return err_pass;
+
+  struct stat stage_stat;
+  if (init_stage_dir(view, &stage_stat))
+    return err_fail;
+  size_t stage_path_length = strlen(view->stage_dir) + STAGE_NAME_LENGTH;
+  size_t max_group_length = max_length - strlen(LOWERDIR_PREFIX);
+
+  // try fewer, bigger groups first, each holding at most group_limit directories
+  size_t group_count = (*count + OVERLAY_MAX_LAYERS - 1) / OVERLAY_MAX_LAYERS;
+  for (; group_count <= OVERLAY_MAX_LAYERS; group_count++) {
+    size_t group_limit = (*count + group_count - 1) / group_count;
+    size_t groups = 0;
+    size_t top_length = other_options_length;
+    for (size_t i = 0; i < *count; groups++) {
+      size_t size = get_group_size(lower_dirs + i, *count - i, group_limit, max_group_length);
+      if (size == 0)
+        return report_error(view->report, ENAMETOOLONG, "lower directory '%s' is too long",
+                            lower_dirs[i]);
+      top_length += (groups ? 1 : 0) + (size == 1 ? strlen(lower_dirs[i]) : stage_path_length);
+      i += size;
+    }
+    if (groups > group_count)
+      continue;
+    // more groups would only make the mount point's own options longer
+    if (top_length > max_length)
+      break;
+
+    size_t group = 0;
+    for (size_t i = 0; i < *count; group++) {
+      size_t size = get_group_size(lower_dirs + i, *count - i, group_limit, max_group_length);
+      const char *group_dir = lower_dirs[i];
+      if (size > 1) {
+        group_dir = get_stage_overlay(view, &stage_stat, lower_dirs + i, size);
+        if (!group_dir)
+          return err_fail;
+      }
+      lower_dirs[group] = group_dir;
+      i += size;
+    }
+    *count = group;
+    return err_pass;
+  }
+  return report_error(view->report, E2BIG,
+                      "mount point at '%s' has too many lower directories (%lu) to overlay",
+                      target_dir, *count);
+}
+
+static err_t mount_overlay(struct view *view, const char *target_dir, struct mount_point *mount_point,
+                           unsigned char mount_point_has_files)
+{
+  if (mount_point_has_files)
+    return report_error(view->report, ENOTSUP, "not impl mount point has files");
+
+  //
+  // collect the lower directories and also,
+  // see if one of the directories has a 'workdir' meaning it should be the upper
+  //
+  struct dir *upper_dir = NULL;
+  // view options go first so the mount point's own options override them
+  const char *mount_point_options = NULL;
+  const char **lower_dirs = malloc(dir_vector_size(&mount_point->dirs) * sizeof(char*));
+  if (!lower_dirs)
+    return report_errno(view->report, "malloc failed");
+  size_t lower_dir_count = 0;
+  for (size_t i = 0; i < dir_vector_size(&mount_point->dirs); i++) {
+    struct dir *dir = dir_vector_get(&mount_point->dirs, i);
+    if (dir->overlay_options) {
+      if (!mount_point_options) {
+        mount_point_options = dir->overlay_options;
+      } else if (0 != strcmp(mount_point_options, dir->overlay_options)) {
+        free(lower_dirs);
+        return report_error(view->report, EINVAL,
+                            "mount point at '%s' has conflicting overlay options '%s' and '%s'",
+                            target_dir, mount_point_options, dir->overlay_options);
+      }
+    }
+    if (dir->workdir) {
+      if (upper_dir) {
+        free(lower_dirs);
+        return report_error(view->report, EINVAL,
+                            "mount point at '%s' has multiple upper directories '%s' and '%s'",
+                            target_dir, upper_dir->arg, dir->arg);
+      }
+      upper_dir = dir;
+    } else {
+      lower_dirs[lower_dir_count++] = dir->source;
+    }
+  }
+
+  // TODO: do not add the rootfs as a lowerdir if there are no non-root mounts
+  char *options = NULL;
+  {
+    char *other_options = make_overlay_options(view, NULL, 0, upper_dir, view->overlay_options,
+                                               mount_point_options);
+    if (other_options) {
+      size_t other_options_length = strlen(other_options);
+      free(other_options);
+      if (0 == stage_lower_dirs(view, target_dir, lower_dirs, &lower_dir_count, other_options_length))
+        options = make_overlay_options(view, lower_dirs, lower_dir_count, upper_dir,
+                                       view->overlay_options, mount_point_options);
+    }
+  }
+  free(lower_dirs);
+  if (!options)
+    return err_fail; // error already reported
+  if (-1 == loggy_mount(view, "none", target_dir, "overlay", options)) {
+    // error already reported
+    free(options);
+    return err_fail;
+  }
+  free(options);
+  return err_pass;
+}
+
+// returns: the '+tmpfs', '+image' or '+reflink' directory in the mount point, NULL if
+// there isn't one
+static struct dir *get_private_upper(struct mount_point *mount_point)
+{
+  for (size_t i = 0; i < dir_vector_size(&mount_point->dirs); i++) {
+    struct dir *dir = dir_vector_get(&mount_point->dirs, i);
+    if (dir->tmpfs_options || dir->image || dir->reflink)
+      return dir;
+  }
+  return NULL;
+}
+
+struct image_options
+{
+  unsigned long long size;
+  const char *fs_type;
+  // make a new image and delete it as soon as it's mounted
+  unsigned char temp;
+};
+
+// returns: the number of bytes in a size like 512k, 64m or 2g
+static err_t parse_size(struct report *report, const char *str, size_t length,
+                        unsigned long long *size)
+{
+  char *end;
+  errno = 0;
+  *size = strtoull(str, &end, 10);
+  size_t digits = end - str;
+  if (errno || digits == 0 || digits + 1 < length)
+    return report_error(report, EINVAL, "invalid size '%.*s'", (int)length, str);
+  if (digits < length) {
+    const char *units = "kmgt";
+    const char *unit = strchr(units, *end | 0x20);
+    if (!unit || !*unit)
+      return report_error(report, EINVAL, "invalid size '%.*s', expected a k, m, g or t suffix",
+                          (int)length, str);
+    *size <<= 10 * (1 + (unit - units));
+  }
+  return err_pass;
+}
+
+static err_t parse_image_options(struct report *report, const char *options,
+                                 struct image_options *image_options)
+{
+  memset(image_options, 0, sizeof(*image_options));
+  image_options->fs_type = "ext4";
+  while (options[0]) {
+    const char *end = strchrnul(options, ',');
+    size_t length = end - options;
+    if (length > 5 && 0 == strncmp(options, "size=", 5)) {
+      if (parse_size(report, options + 5, length - 5, &image_options->size))
+        return err_fail;
+    } else if (length == 7 && 0 == strncmp(options, "fs=ext4", 7)) {
+      image_options->fs_type = "ext4";
+    } else if (length == 6 && 0 == strncmp(options, "fs=xfs", 6)) {
+      image_options->fs_type = "xfs";
+    } else if (length == 4 && 0 == strncmp(options, "temp", 4)) {
+      image_options->temp = 1;
+    } else {
+      return report_error(report, EINVAL,
+                          "invalid image option '%.*s', expected size=<bytes>, fs=ext4|xfs or temp",
+                          (int)length, options);
+    }
+    options = end[0] ? end + 1 : end;
+  }
+  return err_pass;
+}
+
+// loop mounts the image of a '+image' directory at target_dir, making it first if needed
+static err_t mount_image(struct view *view, const char *target_dir, struct dir *dir)
+{
+  struct image_options options;
+  if (parse_image_options(view->report, dir->image_options, &options))
+    return err_fail;
+  if (options.temp && -1 == unlink(dir->image) && errno != ENOENT)
+    return report_errno(view->report, "remove old image '%s' failed", dir->image);
+  if (-1 == access(dir->image, F_OK)) {
+    if (errno != ENOENT)
+      return report_errno(view->report, "access image '%s' failed", dir->image);
+    if (options.size == 0)
+      return report_error(view->report, EINVAL, "image '%s' doesn't exist, it needs a size=<bytes>",
+                          dir->image);
+    if (loop_make_image(view->report, dir->image, options.size, options.fs_type))
+      return err_fail;
+  }
+  char device[32];
+  int loop = loop_attach(view->report, dir->image, 0, device, sizeof(device));
+  int result = -1;
+  if (loop != -1) {
+    // the device detaches itself once it's unmounted and this is closed
+    result = loggy_mount(view, device, target_dir, options.fs_type, NULL);
+    close(loop);
+  }
+  // a temp image lives on until it's unmounted, then its space is freed at once
+  if (options.temp)
+    unlink(dir->image);
+  return (-1 == result) ? err_fail : err_pass;
+}
+
+/*
+Copies a '+reflink' directory next to itself and bind mounts the copy at target_dir.
+On btrfs or xfs every file is a reflink, so copying one takes the same few syscalls
+whatever its size and a write only costs the extents it changes. The copy goes
+in the state record before anything is in it, so a view that fails partway or is
+removed with rmr takes it along.
+*/
+static err_t mount_clone(struct view *view, const char *target_dir, struct dir *dir)
+{
+  char *clone = view_own(view, state_clone_template(view->report, dir->reflink));
+  if (!clone)
+    return err_fail;
+  int result = mkdtemp(clone) ? 0 : -1;
+  report_op(view->report, REPORT_MKDIR, "mkdir", clone, NULL, result ? errno : 0);
+  if (-1 == result)
+    return report_errno(view->report, "mkdir '%s' failed", clone);
+  if (log_undo(view, UNDO_CLONE, clone))
+    return err_fail;
+  state_record_clone(view->report, view->state_file, clone);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (copy_tree(view->report, dir->reflink, clone, (cpus > 0) ? cpus : 1))
+    return err_fail;
+  return (-1 == loggy_bind_mount(view, clone, target_dir)) ? err_fail : err_pass;
+}
+
+/*
+Mounts the tmpfs, image or copy for a '+tmpfs', '+image' or '+reflink' directory at the
+mount point's target. If it is the only directory it is the mount, otherwise it gets an
+upper and work directory for the overlay that will be mounted over it.
+*/
+static err_t mount_private_upper(struct view *view, const char *target_dir, struct dir *dir,
+                                 unsigned char for_overlay)
+{
+  if (dir->reflink) {
+    // a copy is only useful without an overlay, it has nowhere to put a work directory
+    if (for_overlay)
+      return report_error(view->report, EINVAL,
+                          "'%s' has to be the only directory at '%s', a copy can't be an upper",
+                          dir->arg, target_dir);
+    if (mount_clone(view, target_dir, dir))
+      return err_fail;
+  } else if (dir->image) {
+    if (mount_image(view, target_dir, dir))
+      return err_fail;
+  } else if (-1 == loggy_mount(view, "tmpfs", target_dir, "tmpfs",
+                               dir->tmpfs_options[0] ? dir->tmpfs_options : NULL)) {
+    // error already reported
+    return err_fail;
+  }
+  if (!for_overlay) {
+    dir->source = target_dir;
+    return err_pass;
+  }
+  char *upper = view_own(view, concat(target_dir, "/upper"));
+  char *work = view_own(view, concat(target_dir, "/work"));
+  if (!upper || !work)
+    return err_fail;
+  // these go away with the tmpfs or image so they aren't put in the state record, a
+  // reused image already has them
+  const char *failed = NULL;
+  if (-1 == mkdir(upper, DEFAULT_MKDIR_MODE) && !(dir->image && errno == EEXIST))
+    failed = upper;
+  report_op(view->report, REPORT_MKDIR, "mkdir", upper, NULL, failed ? errno : 0);
+  if (!failed) {
+    if (-1 == mkdir(work, DEFAULT_MKDIR_MODE) && !(dir->image && errno == EEXIST))
+      failed = work;
+    report_op(view->report, REPORT_MKDIR, "mkdir", work, NULL, failed ? errno : 0);
+  }
+  if (failed)
+    return report_errno(view->report, "mkdir '%s' in %s failed", failed, dir->image ? "image" : "tmpfs");
+  dir->source = upper;
+  dir->workdir = work;
+  return err_pass;
+}
+
+static int compare_paths(const void *left, const void *right)
+{
+  return strcmp(*(const char**)left, *(const char**)right);
+}
+
+// creates path and its parents under dir, some of which may already exist
+static err_t make_skeleton_path(struct report *report, const char *dir, const char *path)
+{
+  char *full_path = concat(dir, "/", path);
+  if (!full_path)
+    return report_errno(report, "concat paths failed");
+  err_t result = err_pass;
+  for (char *slash = full_path + strlen(dir) + 1; !result; slash++) {
+    slash = strchrnul(slash, '/');
+    char saved = *slash;
+    *slash = '\0';
+    if (-1 == mkdir(full_path, DEFAULT_MKDIR_MODE) && errno != EEXIST)
+      result = report_errno(report, "mkdir '%s' failed", full_path);
+    *slash = saved;
+    if (saved == '\0')
+      break;
+  }
+  free(full_path);
+  return result;
+}
+
+/*
+Returns the tmpfs in the stage directory that holds the skeletons, mounting it if this is
+the first view that needs one. They can't just be directories in the stage directory,
+overlayfs refuses a layer inside another layer on the same filesystem, like '/'.
+*/
+static const char *get_skeletons_dir(struct view *view)
+{
+  struct stat stage_stat;
+  if (init_stage_dir(view, &stage_stat))
+    return NULL;
+  char *path = view_own(view, concat(view->stage_dir, "/skeletons"));
+  if (!path)
+    return NULL;
+  if (is_stage_mount(path, &stage_stat, TMPFS_MAGIC))
+    return path;
+  if (-1 == mkdir(path, S_IRWXU) && errno != EEXIST) {
+    report_errno(view->report, "mkdir '%s' failed", path);
+    return NULL;
+  }
+  // shared by every view so it doesn't go in the state record
+  int result = mount("tmpfs", path, "tmpfs", MS_NOSUID | MS_NODEV | MS_NOEXEC, "mode=0755");
+  report_op(view->report, REPORT_MOUNT, "mount", path, "tmpfs", result ? errno : 0);
+  if (-1 == result) {
+    report_errno(view->report, "mount tmpfs for skeletons at '%s' failed", path);
+    return NULL;
+  }
+  return path;
+}
+
+/*
+Returns a directory that only has the directories the sub mount points in need_dirs
+need, which the mount point gets as its bottom layer. Views on a host mostly need
+the same ones, so rather than each view mounting a tmpfs and making them, a skeleton
+is made once in the stage directory's skeleton tmpfs, named by a SHA-256 of its paths,
+and shared. It's built under a temporary name and renamed into place so a view never
+sees part of one. The hash is of the sorted paths with their terminating nulls, so
+one list of paths can't hash like another and a reused skeleton always has the layout
+the view asked for.
+*/
+static const char *get_skeleton(struct view *view, struct mount_point *mount_point,
+                                struct mount_point_vector *need_dirs)
+{
+  size_t count = mount_point_vector_size(need_dirs);
+  const char **paths = malloc(count * sizeof(char*));
+  if (!paths) {
+    report_errno(view->report, "malloc failed");
+    return NULL;
+  }
+  for (size_t i = 0; i < count; i++) {
+    struct mount_point *sub_mount_point = mount_point_vector_get(need_dirs, i);
+    paths[i] = lstrip(sub_mount_point->target_relative + strlen(mount_point->target_relative), '/');
+  }
+  qsort(paths, count, sizeof(char*), compare_paths);
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  {
+    struct sha256 sha;
+    sha256_init(&sha);
+    for (size_t i = 0; i < count; i++)
+      sha256_update(&sha, paths[i], strlen(paths[i]) + 1);
+    sha256_final(&sha, digest);
+  }
+
+  const char *skeleton = NULL;
+  const char *skeletons_dir = get_skeletons_dir(view);
+  if (!skeletons_dir)
+    goto done;
+  char name[2 + SHA256_DIGEST_SIZE * 2];
+  name[0] = '/';
+  for (unsigned i = 0; i < SHA256_DIGEST_SIZE; i++)
+    snprintf(name + 1 + i * 2, sizeof(name) - 1 - i * 2, "%02x", digest[i]);
+  char *path = view_own(view, concat(skeletons_dir, name));
+  if (!path)
+    goto done;
+  struct stat path_stat;
+  if (0 == lstat(path, &path_stat) && S_ISDIR(path_stat.st_mode)) {
+    skeleton = path;
+    goto done;
+  }
+
+  char *new_path = concat(path, ".XXXXXX");
+  if (!new_path) {
+    report_errno(view->report, "concat paths failed");
+    goto done;
+  }
+  err_t result = err_pass;
+  if (!mkdtemp(new_path) || -1 == chmod(new_path, DEFAULT_MKDIR_MODE))
+    result = report_errno(view->report, "mkdir '%s' failed", new_path);
+  for (size_t i = 0; !result && i < count; i++)
+    result = make_skeleton_path(view->report, new_path, paths[i]);
+  if (!result && -1 == rename(new_path, path)) {
+    // another view may have just made the same one
+    if (errno != EEXIST && errno != ENOTEMPTY)
+      result = report_errno(view->report, "rename '%s' to '%s' failed", new_path, path);
+    loggy_rmtree(view->report, new_path, 1);
+  }
+  report_op(view->report, REPORT_MKDIR, "mkdir", path, NULL, result ? view->report->last_error : 0);
+  free(new_path);
+  if (!result)
+    skeleton = path;
+ done:
+  free(paths);
+  return skeleton;
+}
+
+static err_t prepare_sub_mounts_helper(struct view *view, struct mount_point *mount_point,
+                                       struct mount_point_vector *need_dirs)
+{
+  // check if we need to make any directories for sub mount points
+  if (get_need_dirs(&plan_real_fs, view->report, mount_point, need_dirs))
+    return err_fail;
+
+  if (mount_point_vector_size(need_dirs) == 0)
+    return err_pass;
+
+  // a tmpfs or image upper is already mounted and private to this view, so the
+  // directories can go straight in it
+  {
+    struct dir *private_upper = get_private_upper(mount_point);
+    if (private_upper) {
+      for (size_t i = 0; i < mount_point_vector_size(need_dirs); i++) {
+        struct mount_point *sub_mount_point = mount_point_vector_get(need_dirs, i);
+        const char *target_diff = lstrip(sub_mount_point->target_relative +
+                                         strlen(mount_point->target_relative), '/');
+        char *dir = concat(private_upper->source, "/", target_diff);
+        if (!dir)
+          return report_errno(view->report, "concat paths failed");
+        err_t result = mkdirs(view, dir);
+        free(dir);
+        if (result)
+          return err_fail;
+      }
+      return err_pass;
+    }
+  }
+
+  // the mount_point is not writeable and there's no directory to hold one or more
+  // sub mounts. in this case the mount point gets a skeleton, a directory with just
+  // the directories we need for the sub mounts, as its bottom layer
+
+  // TODO: there is a corner case here where this mount_point is actually going to
+  //       be used as it's own sub mount point, in which case mounting over it here would mask out
+  //       the files we were trying to mount. I'm not 100% sure this can happen but I should see if I
+  //       can write a test for it.
+
+  struct dir *skeleton = plan_alloc(&view->plan, sizeof(struct dir));
+  if (!skeleton)
+    return report_errno(view->report, "out of memory");
+  skeleton->source = get_skeleton(view, mount_point, need_dirs);
+  if (!skeleton->source)
+    return err_fail;
+  skeleton->arg = skeleton->source;
+
+  // TODO: we may need to add the skeleton to the front so it
+  //       overwrites any other lower directories that may have
+  //       this path as a file or something.  But if we have a conflict
+  //       like this we may just consider it an invalid view.
+  if (mount_point_add_dir(&view->plan, mount_point, skeleton))
+    return report_errno(view->report, "out of memory");
+
+  return err_pass;
+}
+
+static err_t prepare_sub_mounts(struct view *view, struct mount_point *mount_point)
+{
+  if (mount_point->flags & MOUNT_POINT_CAN_MKDIRS) {
+    for (size_t i = 0; i < mount_point_vector_size(&mount_point->sub_mount_points); i++) {
+      struct mount_point *sub_mount_point = mount_point_vector_get(&mount_point->sub_mount_points, i);
+      char *target_dir = get_absolute_target(view, sub_mount_point);
+      if (!target_dir)
+        return err_fail;
+      if (mkdirs(view, target_dir))
+        return err_fail;
+    }
+    return err_pass;
+  }
+
+  struct mount_point_vector need_dirs;
+  memset(&need_dirs, 0, sizeof(need_dirs));
+  err_t result = prepare_sub_mounts_helper(view, mount_point, &need_dirs);
+  mount_point_vector_free(&need_dirs);
+  return result;
+}
+
+static err_t make_mount_point(struct view *view, struct mount_point *mount_point);
+
+// returns: 1 if one of the mount point's directories is '@lazy'
+static unsigned char is_lazy(struct mount_point *mount_point)
+{
+  for (size_t i = 0; i < dir_vector_size(&mount_point->dirs); i++) {
+    if (dir_vector_get(&mount_point->dirs, i)->lazy)
+      return 1;
+  }
+  return 0;
+}
+
+// returns: the lazy mount point whose trigger is the autofs mount on dev, or NULL
+static struct mount_point *find_trigger(struct view *view, struct mount_point_vector *mount_points,
+                                        uint32_t dev)
+{
+  for (size_t i = 0; i < mount_point_vector_size(mount_points); i++) {
+    struct mount_point *mount_point = mount_point_vector_get(mount_points, i);
+    if (is_lazy(mount_point)) {
+      const char *target_dir = get_absolute_target(view, mount_point);
+      struct stat target_stat;
+      if (target_dir && 0 == fstatat(AT_FDCWD, target_dir, &target_stat, AT_NO_AUTOMOUNT) &&
+          (uint32_t)target_stat.st_dev == dev)
+        return mount_point;
+    }
+    struct mount_point *found = find_trigger(view, &mount_point->sub_mount_points, dev);
+    if (found)
+      return found;
+  }
+  return NULL;
+}
+
+// makes the lazy mount point a trigger was set off for and tells autofs how it went
+static void serve_trigger(struct view *view, const char *realdir, struct autofs_v5_packet *packet)
+{
+  struct mount_point *mount_point = find_trigger(view, &view->root_mount_point.sub_mount_points,
+                                                 packet->dev);
+  if (!mount_point) {
+    report_error(view->report, ENOENT, "codebug: no lazy mount point for autofs device %u",
+                 packet->dev);
+    return;
+  }
+  const char *target_dir = get_absolute_target(view, mount_point);
+  // autofs ioctls go through a file on the trigger, the automounter can open it without
+  // setting it off
+  int trigger = open(target_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (-1 == trigger) {
+    report_errno(view->report, "open '%s' failed", target_dir);
+    return;
+  }
+  size_t first = undo_op_vector_size(&view->undo_log);
+  view->state_file = realdir ? state_append(view->report, realdir) : NULL;
+  err_t result = make_mount_point(view, mount_point);
+  if (result)
+    rollback(view, first);
+  if (view->state_file) {
+    fclose(view->state_file);
+    view->state_file = NULL;
+  }
+  if (-1 == ioctl(trigger, result ? AUTOFS_IOC_FAIL : AUTOFS_IOC_READY, packet->wait_queue_token))
+    report_errno(view->report, "autofs ioctl on '%s' failed", target_dir);
+  close(trigger);
+}
+
+#ifndef MKVIEW_AUTOMOUNT_HELPER
+#define MKVIEW_AUTOMOUNT_HELPER "/usr/local/libexec/mkview-automount"
+#endif
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+/*
+The automounter makes the view's lazy mount points. It reads what autofs writes to the
+pipe when something walks into a trigger, and autofs lets its own process group through
+the triggers, so it can make the mount point underneath. It stays in mkview's directory,
+the view's paths may be relative to it. The pipe reads end of file once every trigger is
+unmounted.
+*/
+int view_serve_automounts(struct view *view, int fd)
+{
+  view->in_automounter = 1;
+  // the mounts are added to the view's state record so rmr can undo them
+  char *realdir = realpath2(view->root_dir.source);
+  int error = 0;
+  for (;;) {
+    union autofs_v5_packet_union packet;
+    ssize_t size = read(fd, &packet, sizeof(packet));
+    if (size == -1 && errno == EINTR)
+      continue;
+    if (size == -1)
+      error = report_errno(view->report, "read the autofs pipe failed");
+    if (size <= 0)
+      break;
+    if (packet.hdr.type == autofs_ptype_missing_direct)
+      serve_trigger(view, realdir, &packet.v5_packet);
+  }
+  free(realdir);
+  return error ? view->report->last_error : 0;
+}
+
+// returns: the arguments for mkview-automount to plan this view again, or NULL on error
+static const char **get_automounter_args(struct view *view)
+{
+  const char **args = view_own(view, calloc(6 + view->dir_count, sizeof(const char *)));
+  if (!args)
+    return NULL;
+  args[0] = view->automount_helper ? view->automount_helper : MKVIEW_AUTOMOUNT_HELPER;
+  args[1] = "3";
+  args[2] = view->root_dir.source;
+  args[3] = view->overlay_options ? view->overlay_options : "";
+  args[4] = view->stage_dir ? view->stage_dir : "";
+  for (size_t i = 0; i < view->dir_count; i++)
+    args[5 + i] = dir_vector_get(&view->dirs, i)->arg;
+  return args;
+}
+
+// dup2 does nothing if from is to, it wouldn't clear close on exec
+static int move_fd(int from, int to)
+{
+  return (from == to) ? fcntl(to, F_SETFD, 0) : dup2(from, to);
+}
+
+/*
+Starts the automounter the first time the view needs it. It's mkview-automount, which
+plans the view again from the same specs, forked and exec'd right away: the caller's
+report and whatever else it has open can't be used in a forked child, and the report may
+write to an fd the automounter mustn't keep.
+*/
+static err_t start_automounter(struct view *view)
+{
+  if (view->automount_pipe != -1)
+    return err_pass;
+  // everything is allocated before the fork, the child only makes syscalls
+  const char **args = get_automounter_args(view);
+  if (!args)
+    return err_fail;
+  extern char **environ;
+  int trigger_pipe[2];
+  int ready_pipe[2];
+  if (-1 == pipe2(trigger_pipe, O_CLOEXEC))
+    return report_errno(view->report, "pipe failed");
+  if (-1 == pipe2(ready_pipe, O_CLOEXEC)) {
+    close(trigger_pipe[0]);
+    close(trigger_pipe[1]);
+    return report_errno(view->report, "pipe failed");
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    // it forks again so the automounter isn't left a zombie of a long running caller
+    pid_t automounter = fork();
+    if (automounter == 0) {
+      // its own session, for autofs and so it doesn't get the terminal's signals
+      setsid();
+      automounter = getpid();
+      if (sizeof(automounter) != write(ready_pipe[1], &automounter, sizeof(automounter)))
+        _exit(1);
+      // the fds it keeps are moved above 3 first so none is overwritten by another
+      int ready = fcntl(ready_pipe[1], F_DUPFD_CLOEXEC, 4);
+      int trigger = fcntl(trigger_pipe[0], F_DUPFD_CLOEXEC, 4);
+      int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+      int high_null = (null == -1) ? -1 : fcntl(null, F_DUPFD_CLOEXEC, 4);
+      int error = EBADF;
+      if (ready != -1 && trigger != -1 && high_null != -1 &&
+          -1 != move_fd(high_null, STDIN_FILENO) && -1 != move_fd(high_null, STDOUT_FILENO) &&
+          -1 != move_fd(trigger, 3)) {
+        // it mustn't hold anything of the caller's open, like the view's lock
+        syscall(SYS_close_range, 4, ~0U, CLOSE_RANGE_CLOEXEC);
+        execve(args[0], (char **)args, environ);
+        error = errno;
+      }
+      // the ready pipe is only written to again if it couldn't exec
+      if (ready != -1)
+        (void)!write(ready, &error, sizeof(error));
+      _exit(127);
+    }
+    _exit(automounter == -1);
+  }
+  close(trigger_pipe[0]);
+  close(ready_pipe[1]);
+  pid_t automounter = -1;
+  int error = ECHILD;
+  if (pid != -1) {
+    waitpid(pid, NULL, 0);
+    if (sizeof(automounter) != read(ready_pipe[0], &automounter, sizeof(automounter)))
+      automounter = -1;
+    // end of file once it has exec'd
+    else if (0 != read(ready_pipe[0], &error, sizeof(error)))
+      automounter = -1;
+  }
+  close(ready_pipe[0]);
+  if (automounter == -1) {
+    close(trigger_pipe[1]);
+    return report_error(view->report, error, "failed to start the automounter '%s'", args[0]);
+  }
+  view->automount_pipe = trigger_pipe[1];
+  view->automounter = automounter;
+  return err_pass;
+}
+
+// mounts an autofs trigger at a lazy mount point's target, the automounter makes the
+// mount point when something first walks into it
+static err_t make_trigger(struct view *view, struct mount_point *mount_point)
+{
+  if (mount_point->target_relative[0] == '\0')
+    return report_error(view->report, EINVAL, "the root of a view can't be lazy");
+  if (view->atomic)
+    return report_error(view->report, EINVAL, "a view with lazy directories can't be --atomic");
+  if (start_automounter(view))
+    return err_fail;
+  const char *target_dir = get_absolute_target(view, mount_point);
+  if (!target_dir)
+    return err_fail;
+  char options[96];
+  snprintf(options, sizeof(options), "fd=%d,pgrp=%d,minproto=%d,maxproto=%d,direct",
+           view->automount_pipe, (int)view->automounter, AUTOFS_PROTO_VERSION,
+           AUTOFS_PROTO_VERSION);
+  return (-1 == loggy_mount(view, "mkview", target_dir, "autofs", options)) ? err_fail : err_pass;
+}
+
+static err_t make_sub_mount_points(struct view *view, struct mount_point *mount_point)
+{
+  for (size_t i = 0; i < mount_point_vector_size(&mount_point->sub_mount_points); i++) {
+    struct mount_point *sub_mount_point = mount_point_vector_get(&mount_point->sub_mount_points, i);
+    err_t result = (is_lazy(sub_mount_point) && !view->in_automounter) ?
+      make_trigger(view, sub_mount_point) : make_mount_point(view, sub_mount_point);
+    if (result)
+      return err_fail;
+  }
+  return err_pass;
+}
+
+// mounts the mount point's directories at its target, but not its sub mount points
+static err_t mount_mount_point(struct view *view, struct mount_point *mount_point)
+{
+  const char *target_dir = get_absolute_target(view, mount_point);
+  if (target_dir == NULL)
+    return err_fail; // error already reported
+
+  {
+    struct dir *private_upper = get_private_upper(mount_point);
+    if (private_upper) {
+      unsigned char only_dir = (dir_vector_size(&mount_point->dirs) == 1);
+      if (mount_private_upper(view, target_dir, private_upper, !only_dir))
+        return err_fail;
+      if (only_dir) {
+        // the tmpfs, image or copy is the mount, the sub mount directories can go in it
+        mount_point->flags |= MOUNT_POINT_CAN_MKDIRS;
+        return prepare_sub_mounts(view, mount_point);
+      }
+    }
+  }
+
+  if (prepare_sub_mounts(view, mount_point))
+    return err_fail;
+
+  if (dir_vector_size(&mount_point->dirs) > 1) {
+    if (mount_overlay(view, target_dir, mount_point, 0))
+      return err_fail;
+  } else  {
+    struct dir *dir = dir_vector_get(&mount_point->dirs, 0);
+    if (dir->overlay_options) {
+      report_notice(view->report, "WARNING: ignoring overlay options '%s' for '%s', it is a bind mount",
+                    dir->overlay_options, dir->arg);
+    }
+    if (-1 == loggy_bind_mount(view, dir->source, target_dir)) {
+      // error already reported
+      return err_fail;
+    }
+    // remount it as readonly?
+    // see https://lwn.net/Articles/281157/
+    // it looks like if you want bind mounts to be readonly, you need to mount
+    // them as writeable first, and then remount them as readonly
+    // mount -o remount,ro <mount_point>
+  }
+  return err_pass;
+}
+
+static err_t make_mount_point(struct view *view, struct mount_point *mount_point)
+{
+  if (mount_mount_point(view, mount_point))
+    return err_fail;
+  return make_sub_mount_points(view, mount_point);
+}
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+
+// returns: a detached copy of the mount at path and everything mounted under it, or -1
+static int clone_tree(struct view *view, const char *path)
+{
+  int tree = syscall(SYS_open_tree, AT_FDCWD, path, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+  if (-1 == tree)
+    report_errno(view->report, "copy the mounts at '%s' failed", path);
+  return tree;
+}
+
+static int loggy_attach_tree(struct view *view, int tree, const char *source, const char *target)
+{
+  int result = syscall(SYS_move_mount, tree, "", AT_FDCWD, target, MOVE_MOUNT_F_EMPTY_PATH);
+  report_op(view->report, REPORT_MOUNT, "clone", target, source, result ? errno : 0);
+  if (-1 == result) {
+    report_errno(view->report, "attach the copy of '%s' to '%s' failed", source, target);
+    return -1;
+  }
+  if (log_undo(view, UNDO_MOUNT, target))
+    return -1;
+  state_record_tree(view->report, view->state_file, view->root_dir.source, target);
+  return 0;
+}
+
+// returns: 1 if path is inside dir
+static unsigned char is_under(const char *path, const char *dir)
+{
+  size_t length = strlen(dir);
+  return 0 == strncmp(path, dir, length) && path[length] == '/';
+}
+
+/*
+Gets the mounts directly under dir, a copy of one brings the mounts under it along.
+realdirs gets their real paths, which are also what /proc/mounts has.
+*/
+static err_t get_child_mounts(struct view *view, const char *realdir, struct string_vector *realdirs)
+{
+  struct string_vector mount_dirs;
+  memset(&mount_dirs, 0, sizeof(mount_dirs));
+  err_t result = read_mount_dirs(view->report, &mount_dirs);
+  for (size_t i = 0; !result && i < string_vector_size(&mount_dirs); i++) {
+    char *mount_dir = string_vector_get(&mount_dirs, i);
+    if (!is_under(mount_dir, realdir))
+      continue;
+    unsigned char covered = 0;
+    for (size_t j = 0; !covered && j < string_vector_size(&mount_dirs); j++) {
+      char *other = string_vector_get(&mount_dirs, j);
+      covered = is_under(other, realdir) && (is_under(mount_dir, other) ||
+                                             (j < i && 0 == strcmp(mount_dir, other)));
+    }
+    if (covered)
+      continue;
+    char *copy = strdup(mount_dir);
+    if (!copy || string_vector_add(realdirs, copy)) {
+      free(copy);
+      result = report_errno(view->report, "malloc failed");
+    }
+  }
+  for (size_t i = 0; i < string_vector_size(&mount_dirs); i++)
+    free(string_vector_get(&mount_dirs, i));
+  string_vector_free(&mount_dirs);
+  return result;
+}
+
+static err_t attach_child_mounts(struct view *view, const char *target_dir, const char *real_target,
+                                 struct string_vector *realdirs, int *trees)
+{
+  for (size_t i = 0; i < string_vector_size(realdirs); i++) {
+    char *realdir = string_vector_get(realdirs, i);
+    // the state record and undo log want paths under the view's own path
+    const char *sub_path = realdir + strlen(real_target);
+    if (target_dir[0] && target_dir[strlen(target_dir) - 1] == '/')
+      sub_path++;
+    char *path = concat(target_dir, sub_path);
+    if (!path)
+      return report_errno(view->report, "concat paths failed");
+    int result = loggy_attach_tree(view, trees[i], realdir, path);
+    free(path);
+    if (-1 == result)
+      return err_fail;
+  }
+  return err_pass;
+}
+
+/*
+Mounts one of the directories given with view_set_base over the copy of the base view.
+When the base has the target it becomes the bottom layer of the mount point, so the
+directories go on top of it rather than hide it, and the base's mounts under the
+target are copied before it's covered and attached again on top.
+*/
+static err_t make_mount_point_over_base(struct view *view, struct mount_point *mount_point)
+{
+  char *target_dir = get_absolute_target(view, mount_point);
+  if (!target_dir)
+    return err_fail;
+  struct stat target_stat;
+  if (-1 == stat(target_dir, &target_stat))
+    return report_errno(view->report, "stat '%s' failed", target_dir);
+  if (!S_ISDIR(target_stat.st_mode))
+    return report_error(view->report, ENOTDIR, "'%s' is in the base view but is not a directory", target_dir);
+
+  // a tmpfs upper covers the target before the overlay is mounted, so the base's layer
+  // refers to it through a descriptor
+  int base_fd = open(target_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (-1 == base_fd)
+    return report_errno(view->report, "open '%s' failed", target_dir);
+  char base_path[32];
+  snprintf(base_path, sizeof(base_path), "/proc/self/fd/%d", base_fd);
+  struct dir *base = plan_alloc(&view->plan, sizeof(struct dir));
+  if (base) {
+    base->arg = target_dir;
+    base->source = view_own(view, strdup(base_path));
+  }
+  if (!base || !base->source) {
+    close(base_fd);
+    return base ? err_fail : report_errno(view->report, "out of memory");
+  }
+  if (mount_point_add_dir(&view->plan, mount_point, base)) {
+    close(base_fd);
+    return report_errno(view->report, "out of memory");
+  }
+
+  char *real_target = realpath2(target_dir);
+  if (!real_target) {
+    close(base_fd);
+    return report_errno(view->report, "realpath('%s') failed", target_dir);
+  }
+  struct string_vector realdirs;
+  memset(&realdirs, 0, sizeof(realdirs));
+  int *trees = NULL;
+  err_t result = get_child_mounts(view, real_target, &realdirs);
+  size_t tree_count = 0;
+  if (!result && string_vector_size(&realdirs)) {
+    trees = malloc(string_vector_size(&realdirs) * sizeof(int));
+    if (!trees)
+      result = report_errno(view->report, "malloc failed");
+    for (; !result && tree_count < string_vector_size(&realdirs); tree_count++) {
+      trees[tree_count] = clone_tree(view, string_vector_get(&realdirs, tree_count));
+      if (-1 == trees[tree_count])
+        result = err_fail;
+    }
+  }
+  if (!result)
+    result = mount_mount_point(view, mount_point);
+  if (!result)
+    result = attach_child_mounts(view, target_dir, real_target, &realdirs, trees);
+  for (size_t i = 0; i < tree_count; i++) {
+    if (trees[i] != -1)
+      close(trees[i]);
+  }
+  free(trees);
+  close(base_fd);
+  for (size_t i = 0; i < string_vector_size(&realdirs); i++)
+    free(string_vector_get(&realdirs, i));
+  string_vector_free(&realdirs);
+  free(real_target);
+  if (result)
+    return err_fail;
+  return make_sub_mount_points(view, mount_point);
+}
+
+// returns: the deepest directory above the mount point's target that the view has, relative
+// to the view, or NULL on error
+static const char *get_existing_parent(struct view *view, struct mount_point *mount_point)
+{
+  size_t length = strlen(mount_point->target_relative);
+  char *parent = plan_alloc(&view->plan, length + 1);
+  if (!parent) {
+    report_errno(view->report, "out of memory");
+    return NULL;
+  }
+  memcpy(parent, mount_point->target_relative, length + 1);
+  for (;;) {
+    char *slash = strrchr(parent, '/');
+    if (slash)
+      slash[0] = '\0';
+    else
+      parent[0] = '\0';
+    char *path = concat(view->root_dir.source, "/", parent);
+    if (!path) {
+      report_errno(view->report, "concat paths failed");
+      return NULL;
+    }
+    struct stat path_stat;
+    int result = stat(path, &path_stat);
+    if (-1 == result && errno != ENOENT)
+      report_errno(view->report, "stat '%s' failed", path);
+    else if (0 == result && !S_ISDIR(path_stat.st_mode))
+      report_error(view->report, ENOTDIR, "'%s' is in the base view but is not a directory", path);
+    free(path);
+    if (0 == result)
+      return S_ISDIR(path_stat.st_mode) ? parent : NULL;
+    if (errno != ENOENT || !parent[0])
+      return NULL;
+  }
+}
+
+/*
+A target the base view doesn't have can't be made in the copy of it, the copy shares
+the base's filesystems, so a mkdir there would write into whatever the base mounted,
+like the host's root. Instead the deepest directory above it that the base has is
+covered with an overlay of itself on top of a skeleton with the missing directories,
+the way a mount point gets one for its sub mount points, and the base's mounts under
+it are copied and attached again on top. The deepest ones are covered first so one
+cover's mounts are copied along with the base's by the cover above it.
+*/
+static err_t cover_missing_targets(struct view *view, struct mount_point_vector *missing)
+{
+  size_t count = mount_point_vector_size(missing);
+  const char **parents = calloc(count, sizeof(char*));
+  if (!parents)
+    return report_errno(view->report, "calloc failed");
+  err_t result = err_pass;
+  for (size_t i = 0; !result && i < count; i++) {
+    parents[i] = get_existing_parent(view, mount_point_vector_get(missing, i));
+    if (!parents[i])
+      result = err_fail;
+  }
+  struct mount_point_vector group;
+  memset(&group, 0, sizeof(group));
+  while (!result) {
+    const char *parent = NULL;
+    for (size_t i = 0; i < count; i++) {
+      if (parents[i] && (!parent || strlen(parents[i]) > strlen(parent)))
+        parent = parents[i];
+    }
+    if (!parent)
+      break;
+    group.size = 0;
+    for (size_t i = 0; !result && i < count; i++) {
+      if (parents[i] && 0 == strcmp(parents[i], parent)) {
+        if (mount_point_vector_add(&group, mount_point_vector_get(missing, i)))
+          result = report_errno(view->report, "out of memory");
+        parents[i] = NULL;
+      }
+    }
+    if (result)
+      break;
+    struct mount_point *cover = plan_alloc(&view->plan, sizeof(struct mount_point));
+    struct dir *skeleton = plan_alloc(&view->plan, sizeof(struct dir));
+    if (!cover || !skeleton) {
+      result = report_errno(view->report, "out of memory");
+      break;
+    }
+    cover->target_relative = parent;
+    skeleton->source = skeleton->arg = get_skeleton(view, cover, &group);
+    if (!skeleton->source)
+      result = err_fail;
+    else if (mount_point_init(&view->plan, cover, skeleton, parent))
+      result = report_errno(view->report, "out of memory");
+    else
+      result = make_mount_point_over_base(view, cover);
+  }
+  mount_point_vector_free(&group);
+  free(parents);
+  return result;
+}
+
+// copies every mount of the base view in one step and mounts the view's own directories on top
+static err_t make_view_over_base(struct view *view)
+{
+  int tree = clone_tree(view, view->base_dir);
+  if (-1 == tree)
+    return err_fail;
+  int result = loggy_attach_tree(view, tree, view->base_dir, view->root_dir.source);
+  close(tree);
+  if (-1 == result)
+    return err_fail;
+  // the targets the base doesn't have are covered last, a cover stacked on the base's
+  // overlays would leave the ones made after it too deep for another overlay
+  struct mount_point_vector missing;
+  memset(&missing, 0, sizeof(missing));
+  err_t status = err_pass;
+  struct mount_point_vector *mount_points = &view->root_mount_point.sub_mount_points;
+  for (size_t i = 0; !status && i < mount_point_vector_size(mount_points); i++) {
+    struct mount_point *mount_point = mount_point_vector_get(mount_points, i);
+    const char *target_dir = get_absolute_target(view, mount_point);
+    struct stat target_stat;
+    if (!target_dir)
+      status = err_fail;
+    else if (-1 == stat(target_dir, &target_stat) && errno == ENOENT)
+      status = mount_point_vector_add(&missing, mount_point) ?
+        report_errno(view->report, "out of memory") : err_pass;
+    else
+      status = make_mount_point_over_base(view, mount_point);
+  }
+  if (!status && mount_point_vector_size(&missing))
+    status = cover_missing_targets(view, &missing);
+  // the targets are in the covers' skeletons now
+  for (size_t i = 0; !status && i < mount_point_vector_size(&missing); i++)
+    status = make_mount_point(view, mount_point_vector_get(&missing, i));
+  mount_point_vector_free(&missing);
+  return status;
+}
+
+// verify the root directory either does not exist, or is empty
+static err_t check_root_dir(struct view *view, const char *dir, enum dir_status *status)
+{
+ *status = DIR_STATUS_DOES_NOT_EXIST;
+ if (get_dir_status(view->report, status, dir))
+   return err_fail;
+ switch (*status) {
+ case DIR_STATUS_DOES_NOT_EXIST:
+ case DIR_STATUS_EMPTY:
+   return err_pass;
+ case DIR_STATUS_NOT_A_DIR:
+   return report_error(view->report, ENOTDIR, "root dir '%s' is not a directory", dir);
+ case DIR_STATUS_NOT_EMPTY:
+   return report_error(view->report, ENOTEMPTY, "root directory '%s' is not empty", dir);
+ }
+ return report_error(view->report, EINVAL, "codebug: path should not be taken");
+}
+
+static err_t init_root_dir(struct view *view, unsigned char *created)
+{
+ enum dir_status status;
+ if (check_root_dir(view, view->root_dir.source, &status))
+   return err_fail;
+ *created = (status == DIR_STATUS_DOES_NOT_EXIST);
+ if (*created)
+   return loggy_mkdir(view, view->root_dir.source, DEFAULT_MKDIR_MODE) ? err_fail : err_pass;
+ return err_pass;
+}
+
+static err_t verify_custom_target(struct report *report, const char *target)
+{
+  if (target[0] == '/')
+    return report_error(report, EINVAL, "invalid target '%s', cannot begin with '/'", target);
+  // TODO: verify target does not contain double slashes or '.' directories or '..' directories
+  return err_pass;
+}
+
+static err_t verify_tmpfs_options(struct report *report, const char *options)
+{
+  if (options[0] == '\0')
+    return err_pass;
+  for (;;) {
+    const char *end = strchrnul(options, ',');
+    size_t length = end - options;
+    if (!((length > 5 && 0 == strncmp(options, "size=", 5)) ||
+          (length > 10 && 0 == strncmp(options, "nr_inodes=", 10)))) {
+      return report_error(report, EINVAL,
+                          "invalid tmpfs option '%.*s', expected size=<bytes> or nr_inodes=<count>",
+                          (int)length, options);
+    }
+    if (end[0] == '\0')
+      return err_pass;
+    options = end + 1;
+  }
+}
+
+#ifndef EROFS_SUPER_MAGIC_V1
+#define EROFS_SUPER_MAGIC_V1 0xE0F5E1E2
+#endif
+
+// hex digits of a source file's sha-256 used to name its layer, 128 bits is plenty
+#define SOURCE_HASH_LENGTH 32
+
+enum source_type {
+  SOURCE_DIR = 0,
+  SOURCE_SQUASHFS,
+  SOURCE_EROFS,
+  SOURCE_TAR,
+};
+static const struct {
+  const char *suffix;
+  enum source_type type;
+} source_suffixes[] = {
+  {".squashfs", SOURCE_SQUASHFS},
+  {".sqfs", SOURCE_SQUASHFS},
+  {".erofs", SOURCE_EROFS},
+  {".tar", SOURCE_TAR},
+  {".tar.gz", SOURCE_TAR},
+  {".tgz", SOURCE_TAR},
+  {".tar.xz", SOURCE_TAR},
+  {".tar.zst", SOURCE_TAR},
+  {".tzst", SOURCE_TAR},
+};
+
+static enum source_type get_source_type(const char *file)
+{
+  size_t length = strlen(file);
+  for (size_t i = 0; i < sizeof(source_suffixes) / sizeof(source_suffixes[0]); i++) {
+    size_t suffix_length = strlen(source_suffixes[i].suffix);
+    if (length > suffix_length &&
+        0 == strcmp(file + length - suffix_length, source_suffixes[i].suffix))
+      return source_suffixes[i].type;
+  }
+  return SOURCE_DIR;
+}
+
+// returns: <stage_dir>/<name>, made if it doesn't exist yet, or NULL on error
+static const char *get_stage_subdir(struct view *view, const char *name)
+{
+  char *path = view_own(view, concat(view->stage_dir, "/", name));
+  if (!path)
+    return NULL;
+  if (-1 == mkdir(path, S_IRWXU) && errno != EEXIST) {
+    report_errno(view->report, "mkdir '%s' failed", path);
+    return NULL;
+  }
+  return path;
+}
+
+static err_t hash_file(struct report *report, const char *file, char hash[SOURCE_HASH_LENGTH + 1])
+{
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (-1 == fd)
+    return report_errno(report, "open '%s' failed", file);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  static const size_t buffer_size = 1024 * 1024;
+  unsigned char *buffer = malloc(buffer_size);
+  if (!buffer) {
+    close(fd);
+    return report_errno(report, "malloc failed");
+  }
+  struct sha256 sha;
+  sha256_init(&sha);
+  err_t result = err_pass;
+  for (;;) {
+    ssize_t size = read(fd, buffer, buffer_size);
+    if (size == 0)
+      break;
+    if (size == -1) {
+      if (errno == EINTR)
+        continue;
+      result = report_errno(report, "read '%s' failed", file);
+      break;
+    }
+    sha256_update(&sha, buffer, size);
+  }
+  free(buffer);
+  close(fd);
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  sha256_final(&sha, digest);
+  for (unsigned i = 0; i < SOURCE_HASH_LENGTH / 2; i++)
+    snprintf(hash + i * 2, 3, "%02x", digest[i]);
+  return result;
+}
+
+/*
+Gets the content hash of a source file. Hashing a big image takes as long as reading it,
+so the hash is kept in the stage directory under the file's device, inode, size and mtime,
+and only the first view that uses a file reads all of it.
+*/
+static err_t get_source_hash(struct view *view, const char *file, const struct stat *file_stat,
+                             char hash[SOURCE_HASH_LENGTH + 1])
+{
+  const char *hashes_dir = get_stage_subdir(view, "hashes");
+  if (!hashes_dir)
+    return err_fail;
+  char key[128];
+  snprintf(key, sizeof(key), "/%llx-%llx-%llx-%llx.%lx",
+           (unsigned long long)file_stat->st_dev, (unsigned long long)file_stat->st_ino,
+           (unsigned long long)file_stat->st_size, (unsigned long long)file_stat->st_mtim.tv_sec,
+           (unsigned long)file_stat->st_mtim.tv_nsec);
+  char *path = view_own(view, concat(hashes_dir, key));
+  if (!path)
+    return err_fail;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd != -1) {
+    ssize_t size = read(fd, hash, SOURCE_HASH_LENGTH);
+    close(fd);
+    if (size == SOURCE_HASH_LENGTH) {
+      hash[SOURCE_HASH_LENGTH] = '\0';
+      return err_pass;
+    }
+  }
+
+  if (hash_file(view->report, file, hash))
+    return err_fail;
+  // a cache we can't write only costs the next view a rehash
+  char *new_path = concat(path, ".XXXXXX");
+  if (!new_path)
+    return err_pass;
+  fd = mkostemp(new_path, O_CLOEXEC);
+  if (fd != -1) {
+    ssize_t size = write(fd, hash, SOURCE_HASH_LENGTH);
+    close(fd);
+    if (size != SOURCE_HASH_LENGTH || -1 == rename(new_path, path))
+      unlink(new_path);
+  }
+  free(new_path);
+  return err_pass;
+}
+
+// returns: the loop mounted squashfs or erofs image file in the stage directory, mounting
+//          it unless an earlier view already did, or NULL on error
+static const char *get_image_layer(struct view *view, const struct stat *stage_stat,
+                                   const char *file, enum source_type type, const char *hash)
+{
+  const char *fs_type = (type == SOURCE_SQUASHFS) ? "squashfs" : "erofs";
+  long magic = (type == SOURCE_SQUASHFS) ? SQUASHFS_MAGIC : EROFS_SUPER_MAGIC_V1;
+  char *path = view_own(view, concat(view->stage_dir, "/img-", hash));
+  if (!path)
+    return NULL;
+  if (is_stage_mount(path, stage_stat, magic))
+    return path;
+  if (-1 == mkdir(path, S_IRWXU) && errno != EEXIST) {
+    report_errno(view->report, "mkdir '%s' failed", path);
+    return NULL;
+  }
+  char device[32];
+  int loop = loop_attach(view->report, file, 1, device, sizeof(device));
+  if (loop == -1)
+    return NULL;
+  // shared by every view with the same image so it doesn't go in the state record
+  int result = mount(device, path, fs_type, MS_RDONLY, NULL);
+  report_op(view->report, REPORT_MOUNT, "mount", path, device, result ? errno : 0);
+  if (-1 == result)
+    report_errno(view->report, "mount %s image '%s' at '%s' failed", fs_type, file, path);
+  // the mount keeps the device now, it goes away with the mount
+  close(loop);
+  return result ? NULL : path;
+}
+
+/*
+Returns the extracted tar file, extracting it into the stage directory's "tars" cache
+unless an earlier view already did. Overlayfs refuses a layer inside another layer on the
+same filesystem, so the extracted directory isn't used directly, that would fail next to
+'/' for a stage directory in /tmp. It's mounted as a read-only overlay of its own, over an
+empty directory since overlayfs wants two lower directories, and that is the layer.
+*/
+static const char *get_tar_layer(struct view *view, const struct stat *stage_stat,
+                                 const char *file, const char *hash)
+{
+  char *path = view_own(view, concat(view->stage_dir, "/tar-", hash));
+  if (!path)
+    return NULL;
+  if (is_stage_mount(path, stage_stat, OVERLAYFS_SUPER_MAGIC))
+    return path;
+  const char *tars_dir = get_stage_subdir(view, "tars");
+  const char *empty_dir = get_stage_subdir(view, "empty");
+  char *tree = tars_dir ? view_own(view, concat(tars_dir, "/", hash)) : NULL;
+  if (!empty_dir || !tree)
+    return NULL;
+
+  struct stat tree_stat;
+  if (-1 == lstat(tree, &tree_stat)) {
+    char *new_tree = concat(tree, ".XXXXXX");
+    if (!new_tree) {
+      report_errno(view->report, "concat paths failed");
+      return NULL;
+    }
+    err_t result = err_pass;
+    if (!mkdtemp(new_tree) || -1 == chmod(new_tree, DEFAULT_MKDIR_MODE))
+      result = report_errno(view->report, "mkdir '%s' failed", new_tree);
+    if (!result) {
+      report_notice(view->report, "extracting '%s'", file);
+      // tar works out the compression itself, the layer keeps the archive's owners
+      const char *argv[] = {"tar", "--numeric-owner", "-xf", file, "-C", new_tree, NULL};
+      result = run_command(view->report, argv);
+    }
+    if (!result && -1 == rename(new_tree, tree)) {
+      // another view may have just extracted the same one
+      if (errno != EEXIST && errno != ENOTEMPTY)
+        result = report_errno(view->report, "rename '%s' to '%s' failed", new_tree, tree);
+    }
+    if (0 == lstat(new_tree, &tree_stat))
+      loggy_rmtree(view->report, new_tree, 1);
+    report_op(view->report, REPORT_MKDIR, "extract", tree, file,
+              result ? view->report->last_error : 0);
+    free(new_tree);
+    if (result)
+      return NULL;
+  }
+
+  if (-1 == mkdir(path, S_IRWXU) && errno != EEXIST) {
+    report_errno(view->report, "mkdir '%s' failed", path);
+    return NULL;
+  }
+  const char *lower_dirs[] = {tree, empty_dir};
+  char *options = make_overlay_options(view, lower_dirs, 2, NULL, NULL, NULL);
+  if (!options)
+    return NULL;
+  // shared by every view with the same archive so it doesn't go in the state record
+  int result = mount("none", path, "overlay", MS_RDONLY, options);
+  report_op(view->report, REPORT_MOUNT, "mount", path, "none", result ? errno : 0);
+  free(options);
+  if (-1 == result) {
+    report_errno(view->report, "mount overlay of extracted '%s' at '%s' failed", file, path);
+    return NULL;
+  }
+  return path;
+}
+
+// returns: the read-only layer for a squashfs, erofs or tar source file, or NULL on error
+static const char *get_source_layer(struct view *view, const char *file,
+                                    const struct stat *file_stat, enum source_type type)
+{
+  struct stat stage_stat;
+  if (init_stage_dir(view, &stage_stat))
+    return NULL;
+  char hash[SOURCE_HASH_LENGTH + 1];
+  if (get_source_hash(view, file, file_stat, hash))
+    return NULL;
+  if (type == SOURCE_TAR)
+    return get_tar_layer(view, &stage_stat, file, hash);
+  return get_image_layer(view, &stage_stat, file, type, hash);
+}
+
+// frees everything that belongs to the current view
+static void view_clear(struct view *view)
+{
+  plan_arena_reset(&view->plan);
+  for (size_t i = 0; i < vector_size(&view->allocations); i++)
+    free(vector_get(&view->allocations, i));
+  view->allocations.size = 0;
+  if (view->state_file) {
+    fclose(view->state_file);
+    view->state_file = NULL;
+  }
+  for (size_t i = 0; i < undo_op_vector_size(&view->undo_log); i++)
+    free(undo_op_vector_get(&view->undo_log, i));
+  view->undo_log.size = 0;
+  view->dir_count = 0;
+  view->overlay_options = NULL;
+  view->stage_dir = NULL;
+  view->atomic = 0;
+  view->base_dir = NULL;
+  view->import_image = NULL;
+  view->automount_helper = NULL;
+  if (view->automount_pipe != -1) {
+    close(view->automount_pipe);
+    view->automount_pipe = -1;
+  }
+}
+
+struct view *view_alloc(struct report *report)
+{
+  struct view *view = calloc(1, sizeof(struct view));
+  if (!view)
+    return NULL;
+  view->report = report;
+  view->automount_pipe = -1;
+  return view;
+}
+
+void view_free(struct view *view)
+{
+  view_clear(view);
+  plan_arena_free(&view->plan);
+  for (size_t i = 0; i < dir_vector_size(&view->dirs); i++)
+    free(dir_vector_get(&view->dirs, i));
+  dir_vector_free(&view->dirs);
+  undo_op_vector_free(&view->undo_log);
+  vector_free(&view->allocations);
+  free(view);
+}
+
+int view_reset(struct view *view, const char *view_dir)
+{
+  view_clear(view);
+  memset(&view->root_dir, 0, sizeof(view->root_dir));
+  view->root_dir.arg = view_own(view, strdup(view_dir));
+  if (!view->root_dir.arg)
+    return view->report->last_error;
+  view->root_dir.source = view_rstrip(view, view->root_dir.arg, '/');
+  if (!view->root_dir.source)
+    return view->report->last_error;
+  if (mount_point_init(&view->plan, &view->root_mount_point, &view->root_dir, "")) {
+    report_errno(view->report, "could not allocate the root mount point");
+    return view->report->last_error;
+  }
+  view->root_mount_point.flags |= MOUNT_POINT_CAN_MKDIRS;
+  return 0;
+}
+
+int view_set_overlay_options(struct view *view, const char *options)
+{
+  if (check_overlay_options(view->report, options))
+    return view->report->last_error;
+  view->overlay_options = view_own(view, strdup(options));
+  return view->overlay_options ? 0 : view->report->last_error;
+}
+
+int view_set_stage_dir(struct view *view, const char *stage_dir)
+{
+  const char *copy = view_own(view, strdup(stage_dir));
+  view->stage_dir = copy ? view_rstrip(view, copy, '/') : NULL;
+  return view->stage_dir ? 0 : view->report->last_error;
+}
+
+// returns: a cleared dir for the current view, reusing one from a previous view if it can
+// sets dir's overlay options to options without 'lazy', NULL if nothing else is left
+static err_t take_lazy_option(struct view *view, struct dir *dir, const char *options)
+{
+  char *overlay_options = view_own(view, malloc(strlen(options) + 1));
+  if (!overlay_options)
+    return err_fail;
+  size_t length = 0;
+  for (;;) {
+    const char *end = strchrnul(options, ',');
+    if (is_lazy_option(options, end - options)) {
+      dir->lazy = 1;
+    } else {
+      if (length)
+        overlay_options[length++] = ',';
+      memcpy(overlay_options + length, options, end - options);
+      length += end - options;
+    }
+    if (end[0] == '\0')
+      break;
+    options = end + 1;
+  }
+  overlay_options[length] = '\0';
+  dir->overlay_options = length ? overlay_options : NULL;
+  return err_pass;
+}
+
+static struct dir *next_dir(struct view *view)
+{
+  struct dir *dir;
+  if (view->dir_count < dir_vector_size(&view->dirs)) {
+    dir = dir_vector_get(&view->dirs, view->dir_count);
+  } else {
+    dir = malloc(sizeof(struct dir));
+    if (!dir || dir_vector_add(&view->dirs, dir)) {
+      report_errno(view->report, "malloc failed");
+      free(dir);
+      return NULL;
+    }
+  }
+  view->dir_count++;
+  memset(dir, 0, sizeof(*dir));
+  return dir;
+}
+
+static err_t add_spec(struct view *view, const char *spec)
+{
+  struct dir *dir = next_dir(view);
+  if (!dir)
+    return err_fail;
+  dir->arg = view_own(view, strdup(spec));
+  if (!dir->arg)
+    return err_fail;
+
+  const char *source = dir->arg;
+  {
+    // '@' is only treated as the start of overlay options if what follows is a
+    // valid list of them, otherwise it's part of the path
+    const char *at_str = strrchr(source, '@');
+    if (at_str && is_overlay_option_list(at_str + 1)) {
+      if (take_lazy_option(view, dir, at_str + 1))
+        return err_fail;
+      if (dir->overlay_options && check_overlay_options(view->report, dir->overlay_options))
+        return err_fail;
+      source = view_own(view, strndup(source, at_str - source));
+      if (!source)
+        return err_fail;
+    }
+  }
+  if (0 == strncmp(source, "+tmpfs", 6) && (source[6] == '=' || source[6] == ':')) {
+    const char *colon_str = strchr(source, ':');
+    if (!colon_str)
+      return report_error(view->report, EINVAL, "'%s' requires a target path", dir->arg);
+    dir->tmpfs_options = (source[6] == '=') ?
+      view_own(view, strndup(source + 7, colon_str - (source + 7))) : "";
+    if (!dir->tmpfs_options)
+      return err_fail;
+    if (verify_tmpfs_options(view->report, dir->tmpfs_options))
+      return err_fail;
+    const char *target_relative = view_rstrip(view, colon_str + 1, '/');
+    if (!target_relative || verify_custom_target(view->report, target_relative))
+      return err_fail;
+    return add_dir(view->report, &view->plan, &view->root_mount_point.sub_mount_points, dir,
+                   target_relative);
+  }
+  if (0 == strncmp(source, "+image=", 7)) {
+    const char *colon_str = strchr(source, ':');
+    if (!colon_str)
+      return report_error(view->report, EINVAL, "'%s' requires a target path", dir->arg);
+    const char *comma_str = memchr(source, ',', colon_str - source);
+    const char *image_end = comma_str ? comma_str : colon_str;
+    if (image_end == source + 7)
+      return report_error(view->report, EINVAL, "'%s' requires an image file", dir->arg);
+    dir->image = view_own(view, strndup(source + 7, image_end - (source + 7)));
+    dir->image_options = comma_str ?
+      view_own(view, strndup(comma_str + 1, colon_str - (comma_str + 1))) : "";
+    if (!dir->image || !dir->image_options)
+      return err_fail;
+    struct image_options image_options;
+    if (parse_image_options(view->report, dir->image_options, &image_options))
+      return err_fail;
+    const char *target_relative = view_rstrip(view, colon_str + 1, '/');
+    if (!target_relative || verify_custom_target(view->report, target_relative))
+      return err_fail;
+    return add_dir(view->report, &view->plan, &view->root_mount_point.sub_mount_points, dir,
+                   target_relative);
+  }
+  if (0 == strncmp(source, "+reflink=", 9)) {
+    const char *colon_str = strchrnul(source, ':');
+    if (colon_str == source + 9)
+      return report_error(view->report, EINVAL, "'%s' requires a directory to copy", dir->arg);
+    const char *copied = view_own(view, strndup(source + 9, colon_str - (source + 9)));
+    if (!copied)
+      return err_fail;
+    struct stat copied_stat;
+    if (-1 == stat(copied, &copied_stat))
+      return report_errno(view->report, "'%s'", copied);
+    if (!S_ISDIR(copied_stat.st_mode))
+      return report_error(view->report, ENOTDIR, "'%s' can't be copied, it isn't a directory", copied);
+    dir->reflink = realpath2(copied);
+    if (!dir->reflink)
+      return report_errno(view->report, "realpath('%s') failed", copied);
+    if (!view_own(view, (char*)dir->reflink))
+      return err_fail;
+    // the copy goes next to the directory, where it can share its extents
+    if (0 == strcmp(dir->reflink, "/"))
+      return report_error(view->report, EINVAL, "'%s' can't be copied, '/' has no parent", dir->arg);
+    const char *target_relative = colon_str[0] ? view_rstrip(view, colon_str + 1, '/') :
+      lstrip(dir->reflink, '/');
+    if (!target_relative || verify_custom_target(view->report, target_relative))
+      return err_fail;
+    return add_dir(view->report, &view->plan, &view->root_mount_point.sub_mount_points, dir,
+                   target_relative);
+  }
+  {
+    const char *comma_str = strchr(source, ',');
+    if (comma_str) {
+      dir->workdir = view_own(view, strndup(source, comma_str - source));
+      if (!dir->workdir)
+        return err_fail;
+      source = comma_str + 1;
+    }
+  }
+  const char *target_relative = NULL;
+  {
+    const char *colon_str = strchr(source, ':');
+    if (colon_str) {
+      target_relative = view_rstrip(view, colon_str + 1, '/');
+      if (!target_relative || verify_custom_target(view->report, target_relative))
+        return err_fail;
+      source = view_own(view, strndup(source, colon_str - source));
+      if (!source)
+        return err_fail;
+    }
+  }
+  struct stat path_stat;
+  if (-1 == stat(source, &path_stat))
+    return report_errno(view->report, "'%s'", source);
+  enum source_type type = S_ISREG(path_stat.st_mode) ? get_source_type(source) : SOURCE_DIR;
+  if (type != SOURCE_DIR) {
+    if (dir->workdir)
+      return report_error(view->report, EINVAL, "'%s' is read-only, it can't have a workdir",
+                          source);
+    if (target_relative == NULL)
+      return report_error(view->report, EINVAL, "'%s' requires a target path", dir->arg);
+    dir->source = get_source_layer(view, source, &path_stat, type);
+    if (!dir->source)
+      return err_fail;
+    return add_dir(view->report, &view->plan, &view->root_mount_point.sub_mount_points, dir,
+                   target_relative);
+  }
+  dir->source = realpath2(source);
+  if (dir->source == NULL)
+    return report_errno(view->report, "realpath('%s') failed", source);
+  if (!view_own(view, (char*)dir->source))
+    return err_fail;
+  if (target_relative == NULL)
+    target_relative = lstrip(dir->source, '/');
+  return add_dir(view->report, &view->plan, &view->root_mount_point.sub_mount_points, dir,
+                 target_relative);
+}
+
+int view_add(struct view *view, const char *spec)
+{
+  return add_spec(view, spec) ? view->report->last_error : 0;
+}
+
+void view_print_plan(struct view *view)
+{
+  print_mount_points(&view->root_mount_point.sub_mount_points, 0);
+}
+
+// returns: the deepest mount point in mount_points (or under them) whose target holds path
+static struct mount_point *find_mount_point(struct mount_point_vector *mount_points,
+                                            const char *path)
+{
+  for (size_t i = 0; i < mount_point_vector_size(mount_points); i++) {
+    struct mount_point *mount_point = mount_point_vector_get(mount_points, i);
+    const char *target = mount_point->target_relative;
+    size_t length = strlen(target);
+    if (length && (0 != strncmp(path, target, length) || (path[length] && path[length] != '/')))
+      continue;
+    struct mount_point *sub_mount_point = find_mount_point(&mount_point->sub_mount_points, path);
+    return sub_mount_point ? sub_mount_point : mount_point;
+  }
+  return NULL;
+}
+
+// returns: the dir on top of mount_point's layers that has path, or NULL if none of them do
+static struct dir *find_serving_dir(struct mount_point *mount_point, const char *path)
+{
+  const char *relative = lstrip(path + strlen(mount_point->target_relative), '/');
+  struct dir *found = NULL;
+  // the upper directory is on top, then the lower ones in the order they were given
+  for (size_t i = 0; i < dir_vector_size(&mount_point->dirs); i++) {
+    struct dir *dir = dir_vector_get(&mount_point->dirs, i);
+    if (found && !dir->workdir)
+      continue;
+    if (!dir->source)
+      continue; // a private upper that isn't mounted yet has nothing in it
+    char *dir_path = concat(dir->source, "/", relative);
+    struct stat path_stat;
+    if (dir_path && 0 == lstat(dir_path, &path_stat))
+      found = dir;
+    free(dir_path);
+    if (found && dir->workdir)
+      break;
+  }
+  return found;
+}
+
+int view_usage(struct view *view, const char *profile, unsigned long *counts)
+{
+  FILE *file = fopen(profile, "re");
+  if (!file) {
+    report_errno(view->report, "open profile '%s' failed", profile);
+    return view->report->last_error;
+  }
+  memset(counts, 0, view->dir_count * sizeof(unsigned long));
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t length;
+  while ((length = getline(&line, &line_size, file)) > 0) {
+    if (line[length - 1] == '\n')
+      line[--length] = '\0';
+    struct mount_point *mount_point =
+      find_mount_point(&view->root_mount_point.sub_mount_points, line);
+    struct dir *dir = mount_point ? find_serving_dir(mount_point, line) : NULL;
+    for (size_t i = 0; dir && i < view->dir_count; i++) {
+      if (dir_vector_get(&view->dirs, i) == dir)
+        counts[i]++;
+    }
+  }
+  free(line);
+  int error = 0;
+  if (ferror(file)) {
+    report_errno(view->report, "read profile '%s' failed", profile);
+    error = view->report->last_error;
+  }
+  fclose(file);
+  return error;
+}
+
+int view_set_automount_helper(struct view *view, const char *path)
+{
+  view->automount_helper = view_own(view, strdup(path));
+  return view->automount_helper ? 0 : view->report->last_error;
+}
+
+int view_set_base(struct view *view, const char *base_dir)
+{
+  view->base_dir = view_own(view, strdup(base_dir));
+  return view->base_dir ? 0 : view->report->last_error;
+}
+
+void view_set_atomic(struct view *view, unsigned char atomic)
+{
+  view->atomic = atomic;
+}
+
+int view_set_import(struct view *view, const char *image)
+{
+  enum source_type type = get_source_type(image);
+  if (type != SOURCE_SQUASHFS && type != SOURCE_EROFS) {
+    report_error(view->report, EINVAL, "can't import '%s', it isn't a .squashfs or .erofs image",
+                 image);
+    return view->report->last_error;
+  }
+  view->import_image = view_own(view, strdup(image));
+  return view->import_image ? 0 : view->report->last_error;
+}
+
+// mounts the imported image over the root directory, the whole view is this one mount
+static err_t mount_import(struct view *view)
+{
+  if (view->dir_count)
+    return report_error(view->report, EINVAL, "an imported view can't have other directories");
+  const char *fs_type = (get_source_type(view->import_image) == SOURCE_SQUASHFS) ?
+    "squashfs" : "erofs";
+  char device[32];
+  int loop = loop_attach(view->report, view->import_image, 1, device, sizeof(device));
+  if (loop == -1)
+    return err_fail;
+  // the device detaches itself once it's unmounted and this is closed
+  int result = loggy_mount(view, device, view->root_dir.source, fs_type, NULL);
+  close(loop);
+  return (-1 == result) ? err_fail : err_pass;
+}
+
+// returns: "<parent>/.<name>.mkview-new", where an atomic view is built
+static const char *get_build_dir(struct view *view, const char *view_dir)
+{
+  const char *name = strrchr(view_dir, '/');
+  name = name ? name + 1 : view_dir;
+  if (name[0] == '\0' || 0 == strcmp(name, ".") || 0 == strcmp(name, "..")) {
+    report_error(view->report, EINVAL, "cannot build '%s' under another name", view_dir);
+    return NULL;
+  }
+  char *parent = view_own(view, strndup(view_dir, name - view_dir));
+  if (!parent)
+    return NULL;
+  return view_own(view, concat(parent, ".", name, ".mkview-new"));
+}
+
+// returns: 1 if path is dir, ignoring trailing slashes
+static unsigned char is_dir_path(const char *path, const char *dir)
+{
+  size_t length = strlen(dir);
+  return 0 == strncmp(path, dir, length) && lstrip(path + length, '/')[0] == '\0';
+}
+
+static err_t move_mounts(struct view *view, const char *from, const char *to, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    if (-1 == mount(from, to, NULL, MS_MOVE, NULL))
+      return report_errno(view->report, "move mount '%s' to '%s' failed", from, to);
+  }
+  return err_pass;
+}
+
+/*
+Moves an atomic view from its build directory into place. If nothing is mounted on the
+build directory itself it's renamed, which also replaces an empty view directory.
+Otherwise the mounts stacked on it are moved, and since a move takes the top mount they
+go through a second directory to keep their order. Either way the mounts keep their ids
+and relative paths, so the state record is still right once it's renamed too.
+*/
+static err_t publish(struct view *view, const char *view_dir, const char *build_realdir)
+{
+  const char *build_dir = view->root_dir.source;
+  size_t root_mounts = 0;
+  for (size_t i = 0; i < undo_op_vector_size(&view->undo_log); i++) {
+    struct undo_op *op = undo_op_vector_get(&view->undo_log, i);
+    if (op->kind == UNDO_MOUNT && is_dir_path(op->path, build_dir))
+      root_mounts++;
+  }
+  if (root_mounts == 0) {
+    if (-1 == rename(build_dir, view_dir))
+      return report_errno(view->report, "rename '%s' to '%s' failed", build_dir, view_dir);
+  } else {
+    char *move_dir = view_own(view, concat(build_dir, "-move"));
+    if (!move_dir)
+      return err_fail;
+    if (-1 == mkdir(view_dir, DEFAULT_MKDIR_MODE) && errno != EEXIST)
+      return report_errno(view->report, "mkdir '%s' failed", view_dir);
+    if (-1 == mkdir(move_dir, S_IRWXU))
+      return report_errno(view->report, "mkdir '%s' failed", move_dir);
+    if (move_mounts(view, build_dir, move_dir, root_mounts) ||
+        move_mounts(view, move_dir, view_dir, root_mounts))
+      return report_error(view->report, view->report->last_error,
+                          "the view may be left partly in '%s'", move_dir);
+    rmdir(move_dir);
+    rmdir(build_dir);
+  }
+
+  char *realdir = realpath2(view_dir);
+  if (!realdir)
+    return report_errno(view->report, "realpath('%s') failed", view_dir);
+  char *old_state = state_path(view->report, build_realdir);
+  char *new_state = state_path(view->report, realdir);
+  free(realdir);
+  err_t result = err_fail;
+  if (old_state && new_state) {
+    result = err_pass;
+    if (-1 == rename(old_state, new_state))
+      result = report_errno(view->report, "rename '%s' to '%s' failed", old_state, new_state);
+  }
+  free(old_state);
+  free(new_state);
+  return result;
+}
+
+// realdir is set once the view's state record has been created
+static err_t apply(struct view *view, char **realdir)
+{
+  // make sure that root directory either does not exist or is empty
+  unsigned char created;
+  if (init_root_dir(view, &created))
+    return err_fail;
+  char *root_realdir = realpath2(view->root_dir.source);
+  if (!root_realdir)
+    return report_errno(view->report, "realpath('%s') failed", view->root_dir.source);
+  view->state_file = state_create(view->report, root_realdir);
+  if (!view->state_file) {
+    free(root_realdir);
+    return err_fail;
+  }
+  *realdir = root_realdir;
+  if (created)
+    state_record_mkdir(view->report, view->state_file, view->root_dir.source, view->root_dir.source);
+
+  if (view->import_image)
+    return mount_import(view);
+  if (view->base_dir)
+    return make_view_over_base(view);
+  if (prepare_sub_mounts(view, &view->root_mount_point))
+    return err_fail;
+  return make_sub_mount_points(view, &view->root_mount_point);
+}
+
+int view_apply(struct view *view)
+{
+  const char *view_dir = view->root_dir.source;
+  // another mkview or rmr of this view waits until this one is done
+  char *lock_path;
+  int lock = state_lock(view->report, view_dir, &lock_path);
+  if (-1 == lock)
+    return view->report->last_error;
+  if (view->atomic) {
+    // the view directory is checked now so the view isn't built for nothing
+    enum dir_status status;
+    if (check_root_dir(view, view_dir, &status))
+      view->root_dir.source = NULL;
+    else
+      view->root_dir.source = get_build_dir(view, view_dir);
+    if (!view->root_dir.source) {
+      view->root_dir.source = view_dir;
+      state_unlock(lock, lock_path);
+      return view->report->last_error;
+    }
+  }
+
+  char *realdir = NULL;
+  err_t result = apply(view, &realdir);
+  if (view->state_file) {
+    fclose(view->state_file);
+    view->state_file = NULL;
+  }
+  if (view->automount_pipe != -1) {
+    // the triggers keep the pipe open, the automounter is done once they're all unmounted
+    close(view->automount_pipe);
+    view->automount_pipe = -1;
+  }
+  if (!result && view->atomic)
+    result = publish(view, view_dir, realdir);
+  int error = result ? view->report->last_error : 0;
+  if (result) {
+    // undo whatever was done so the view directory is left as it was found
+    rollback(view, 0);
+    if (realdir)
+      state_remove(view->report, realdir);
+  }
+  view->root_dir.source = view_dir;
+  free(realdir);
+  state_unlock(lock, lock_path);
+  return error;
+}
+
+/*
+Writes everything the view shows into one image, which view_set_import can mount as the
+whole view with a single mount. The mounted view is already the resolved tree of every
+layer, so mkfs.erofs or mksquashfs reads it like any directory. The image is written
+under a temporary name and renamed once it's complete.
+*/
+int view_export(struct report *report, const char *view_dir, const char *image)
+{
+  enum source_type type = get_source_type(image);
+  if (type != SOURCE_SQUASHFS && type != SOURCE_EROFS) {
+    report_error(report, EINVAL, "can't export to '%s', it isn't a .squashfs or .erofs image",
+                 image);
+    return report->last_error;
+  }
+  char *new_image = concat(image, ".mkview-new");
+  if (!new_image) {
+    report_errno(report, "concat paths failed");
+    return report->last_error;
+  }
+  err_t result = err_pass;
+  if (-1 == unlink(new_image) && errno != ENOENT)
+    result = report_errno(report, "remove '%s' failed", new_image);
+  if (!result && type == SOURCE_EROFS) {
+    const char *argv[] = {"mkfs.erofs", "--quiet", new_image, view_dir, NULL};
+    result = run_command(report, argv);
+  } else if (!result) {
+    const char *argv[] = {"mksquashfs", view_dir, new_image, "-noappend", "-no-progress", NULL};
+    result = run_command(report, argv);
+  }
+  if (!result && -1 == rename(new_image, image))
+    result = report_errno(report, "rename '%s' to '%s' failed", new_image, image);
+  if (result)
+    unlink(new_image);
+  free(new_image);
+  return result ? report->last_error : 0;
+}
+
+int view_teardown(struct report *report, const char *dir, unsigned char sync)
+{
+  struct stat dir_stat;
+  if (-1 == stat(dir, &dir_stat)) {
+    if (errno == ENOENT)
+      return 0;
+    report_errno(report, "stat '%s' failed", dir);
+    return report->last_error;
+  }
+  if (!S_ISDIR(dir_stat.st_mode)) {
+    report_error(report, ENOTDIR, "'%s' exists but is not a directory", dir);
+    return report->last_error;
+  }
+  char *realdir = realpath2(dir);
+  if (!realdir) {
+    report_errno(report, "realpath '%s' failed", dir);
+    return report->last_error;
+  }
+  char *lock_path;
+  int lock = state_lock(report, realdir, &lock_path);
+  if (-1 == lock) {
+    free(realdir);
+    return report->last_error;
+  }
+  // undo exactly what mkview did if it left a state record, this only falls back
+  // to discovering the mounts and directories if the record is missing or stale
+  unsigned error_count = 0;
+  if (STATE_DONE != state_teardown(report, realdir)) {
+    error_count = loggy_rmtree(report, realdir, sync);
+    if (error_count == 0)
+      state_remove(report, realdir);
+  }
+  state_unlock(lock, lock_path);
+  free(realdir);
+  return error_count ? report->last_error : 0;
+}
+
+int view_enter(struct report *report, const char *root, const char *cwd)
+{
+  if (-1 == chdir(root)) {
+    report_errno(report, "chdir '%s' failed", root);
+    return report->last_error;
+  }
+  if (-1 == chroot(".")) {
+    report_errno(report, "chroot '%s' failed", root);
+    return report->last_error;
+  }
+  if (-1 == chdir(cwd ? cwd : "/")) {
+    report_errno(report, "chdir '%s' after chroot failed", cwd ? cwd : "/");
+    return report->last_error;
+  }
+  return 0;
+}
@@ -0,0 +1,98 @@
+/*
+libmkview, what mkview, rmr and inroot are built on. It's installed, so it includes
+what it needs and can be used from C or C++.
+
+None of these functions print or keep global state. Errors and operations go to
+the given report, and functions that return an int return 0 on success or the errno
+value of the error that stopped them. Views from different threads need their
+own struct view and report.
+
+A view is built in three steps: view_reset starts a new plan, view_add adds each
+directory to it (the same "[<workdir>,]<dir>[:<target>][@<options>]" and "+tmpfs"
+specs mkview takes) and view_apply makes the directories and mounts. A struct view
+can be reset and reused for any number of views, it keeps its allocations.
+*/
+#ifndef MKVIEW_VIEW_H
+#define MKVIEW_VIEW_H
+
+#include "report.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct view;
+
+struct view *view_alloc(struct report *report);
+void view_free(struct view *view);
+// forgets the previous view (it stays mounted) and starts planning one at view_dir
+int view_reset(struct view *view, const char *view_dir);
+// options applied to every overlay in the view, like 'mkview -o'
+int view_set_overlay_options(struct view *view, const char *options);
+// where mounts shared between views go, like the groups of layers for a mount point with
+// more lower directories than one overlay can take, defaults to /tmp/mkview-<euid>.
+// archive and image sources are mounted there by view_add, so set it before adding them.
+// it's only reclaimed by calling view_teardown on the stage directory itself once no view
+// uses it
+int view_set_stage_dir(struct view *view, const char *stage_dir);
+// the mkview-automount a view with '@lazy' specs starts, defaults to the one installed
+// with libmkview
+int view_set_automount_helper(struct view *view, const char *path);
+// copy every mount of base_dir (normally another view) in one step, the directories given to
+// view_add are then mounted on top of the copy, over whatever the base has at their targets.
+// a target the base doesn't have comes from a skeleton, the base is never written to
+int view_set_base(struct view *view, const char *base_dir);
+// build the view at "<parent>/.<name>.mkview-new" and only move it to view_dir once it's
+// done, so view_dir never holds part of a view
+void view_set_atomic(struct view *view, unsigned char atomic);
+// mounts image, a .squashfs or .erofs file from view_export, as the whole view in one
+// mount, no directories can be added
+int view_set_import(struct view *view, const char *image);
+// a spec whose source is a .squashfs, .erofs or .tar file mounts it in the stage directory
+// right away, the planner needs to see what's in it
+// a spec with '@lazy' is mounted by view_apply as an autofs trigger, and view_apply forks
+// and execs mkview-automount, a daemon in its own session that mounts the directory on
+// first access and exits once the view is torn down
+// a '+reflink=<dir>' spec is copied by view_apply to "<parent>/.<name>.mkview-clone-<random>"
+// next to dir, sharing every file's extents where the filesystem can, and teardown removes it
+int view_add(struct view *view, const char *spec);
+// counts how many files in a profile from view_record each directory added to the view
+// serves, the one on top of its target that has the file, counts[i] is for the i'th
+// view_add and needs room for all of them. A '+tmpfs', '+image' or '+reflink' directory isn't
+// mounted yet, so it never counts
+int view_usage(struct view *view, const char *profile, unsigned long *counts);
+// prints the planned tree of mount points to stdout
+void view_print_plan(struct view *view);
+// if it fails, every mkdir and mount it made is undone before it returns
+int view_apply(struct view *view);
+// what mkview-automount runs: makes the lazy mount points of the view as autofs asks for
+// them on fd, which view_apply gave it, until the view is torn down. view must be planned
+// from the same specs as the view view_apply made
+int view_serve_automounts(struct view *view, int fd);
+
+// writes the contents of the view at view_dir into image, a .squashfs or .erofs file
+int view_export(struct report *report, const char *view_dir, const char *image);
+// copies dir to a new layer whose files are hard links to objects in store (made next to
+// layer if it's NULL), so identical files in every layer from the store share one inode.
+// files is set to how many files were ingested and shared to how many were already there
+int view_ingest(struct report *report, const char *dir, const char *layer, const char *store,
+                unsigned long *files, unsigned long *shared);
+// unmounts and removes a view (or any directory) like rmr, sync removes files with
+// plain syscalls instead of io_uring, a missing directory is not an error
+int view_teardown(struct report *report, const char *dir, unsigned char sync);
+// runs argv in the view at root like inroot and writes every file it opens in the view's
+// mounts to profile, status is the command's wait status
+int view_record(struct report *report, const char *root, const char *cwd, const char *argv[],
+                const char *profile, int *status);
+// starts reading every file in a profile from view_record into the page cache, with
+// plain syscalls instead of io_uring if sync is set
+int view_prefetch(struct report *report, const char *root, const char *profile,
+                  unsigned char sync);
+// makes root the root directory of this process and changes to cwd inside it
+int view_enter(struct report *report, const char *root, const char *cwd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/fanotify.h>
+#include <sys/pidfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <linux/io_uring.h>
+#include <linux/limits.h>
+
+#include "common.h"
+#include "vector.h"
+#include "report.h"
+#include "clean.h"
+#include "uring.h"
+#include "view.h"
+
+/*
+Page cache warmup. The first job in a new view is slow because the dentries, inodes
+and pages of every file it touches are cold in every layer. view_record runs a job with
+a fanotify mark on each of the view's mounts and writes the path of every file it opens
+to a profile, and view_prefetch opens each file in a profile and starts reading it in
+with many in flight at once, before the next job in a view like it starts.
+
+A profile is a text file with one path per line relative to the view's root, in the
+order the job first opened them.
+*/
+
+#define URING_ENTRIES 256
+#define EVENT_BUFFER_SIZE (64 * 1024)
+
+static unsigned char is_under(const char *path, const char *dir, size_t dir_length)
+{
+  return 0 == strncmp(path, dir, dir_length) && (path[dir_length] == '/' || !path[dir_length]);
+}
+
+// marks every mount at or under realroot, so every file opened in the view is seen
+static err_t mark_mounts(struct report *report, int fan, const char *realroot)
+{
+  struct string_vector mount_dirs;
+  memset(&mount_dirs, 0, sizeof(mount_dirs));
+  err_t result = read_mount_dirs(report, &mount_dirs);
+  size_t root_length = strlen(realroot);
+  for (size_t i = 0; !result && i < string_vector_size(&mount_dirs); i++) {
+    const char *mount_dir = string_vector_get(&mount_dirs, i);
+    if (!is_under(mount_dir, realroot, root_length))
+      continue;
+    // a mount that's covered by another one can't be reached, so it can't be marked
+    if (-1 == fanotify_mark(fan, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN | FAN_OPEN_EXEC,
+                            AT_FDCWD, mount_dir) && errno != ENOENT)
+      result = report_errno(report, "fanotify_mark '%s' failed", mount_dir);
+  }
+  for (size_t i = 0; i < string_vector_size(&mount_dirs); i++)
+    free(string_vector_get(&mount_dirs, i));
+  string_vector_free(&mount_dirs);
+  return result;
+}
+
+// adds the file behind each event's fd to paths if it's in the view
+static err_t read_events(struct report *report, int fan, void *buffer, const char *realroot,
+                         struct string_vector *paths)
+{
+  size_t root_length = strlen(realroot);
+  for (;;) {
+    ssize_t size = read(fan, buffer, EVENT_BUFFER_SIZE);
+    if (size == -1) {
+      if (errno == EAGAIN)
+        return err_pass;
+      if (errno == EINTR)
+        continue;
+      return report_errno(report, "read fanotify events failed");
+    }
+    struct fanotify_event_metadata *event = (struct fanotify_event_metadata*)buffer;
+    for (; FAN_EVENT_OK(event, size); event = FAN_EVENT_NEXT(event, size)) {
+      if (event->fd < 0)
+        continue;
+      char fd_path[32];
+      char path[PATH_MAX];
+      snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", event->fd);
+      ssize_t length = readlink(fd_path, path, sizeof(path) - 1);
+      close(event->fd);
+      if (length <= 0)
+        continue;
+      path[length] = '\0';
+      if (!is_under(path, realroot, root_length) || !path[root_length] || strchr(path, '\n'))
+        continue;
+      char *relative = strdup(path + root_length + 1);
+      if (!relative || string_vector_add(paths, relative)) {
+        free(relative);
+        return report_errno(report, "malloc failed");
+      }
+    }
+  }
+}
+
+static int compare_path_ptrs(const void *left, const void *right)
+{
+  const char *left_path = **(const char***)left;
+  const char *right_path = **(const char***)right;
+  int result = strcmp(left_path, right_path);
+  if (result)
+    return result;
+  // the same path, the first one recorded sorts first
+  return (*(const char***)left > *(const char***)right) -
+    (*(const char***)left < *(const char***)right);
+}
+
+// writes each path once, in the order it was first opened
+static err_t write_profile(struct report *report, const char *profile, struct string_vector *paths)
+{
+  size_t count = string_vector_size(paths);
+  char ***sorted = malloc((count ? count : 1) * sizeof(char**));
+  if (!sorted)
+    return report_errno(report, "malloc failed");
+  for (size_t i = 0; i < count; i++)
+    sorted[i] = &paths->items[i];
+  qsort(sorted, count, sizeof(char**), compare_path_ptrs);
+  for (size_t i = 1; i < count; i++) {
+    if (0 == strcmp(*sorted[i], *sorted[i - 1])) {
+      free(*sorted[i]);
+      *sorted[i] = NULL;
+    }
+  }
+  free(sorted);
+
+  char *new_profile = malloc(strlen(profile) + 5);
+  if (!new_profile)
+    return report_errno(report, "malloc failed");
+  sprintf(new_profile, "%s.new", profile);
+  err_t result = err_pass;
+  FILE *file = fopen(new_profile, "we");
+  if (!file) {
+    result = report_errno(report, "create profile '%s' failed", new_profile);
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      if (paths->items[i])
+        fprintf(file, "%s\n", paths->items[i]);
+    }
+    if (ferror(file) | fclose(file))
+      result = report_errno(report, "write profile '%s' failed", new_profile);
+    else if (-1 == rename(new_profile, profile))
+      result = report_errno(report, "rename '%s' to '%s' failed", new_profile, profile);
+    if (result)
+      unlink(new_profile);
+  }
+  free(new_profile);
+  return result;
+}
+
+int view_record(struct report *report, const char *root, const char *cwd, const char *argv[],
+                const char *profile, int *status)
+{
+  char *realroot = realpath2(root);
+  if (!realroot) {
+    report_errno(report, "realpath '%s' failed", root);
+    return report->last_error;
+  }
+  struct string_vector paths;
+  memset(&paths, 0, sizeof(paths));
+  err_t result = err_pass;
+  int pidfd = -1;
+  void *buffer = malloc(EVENT_BUFFER_SIZE);
+  if (!buffer) {
+    free(realroot);
+    report_errno(report, "malloc failed");
+    return report->last_error;
+  }
+  int fan = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+  if (fan == -1) {
+    result = report_errno(report, "fanotify_init failed");
+    goto done;
+  }
+  // the marks are in place before the job starts so none of its opens are missed
+  if ((result = mark_mounts(report, fan, realroot)))
+    goto done;
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    result = report_errno(report, "fork failed");
+    goto done;
+  }
+  if (pid == 0) {
+    if (view_enter(report, root, cwd))
+      _exit(127);
+    execvp(argv[0], (char *const*)argv);
+    report_errno(report, "execvp '%s' failed", argv[0]);
+    _exit(127);
+  }
+  pidfd = pidfd_open(pid, 0);
+  if (pidfd == -1) {
+    result = report_errno(report, "pidfd_open %d failed", pid);
+    waitpid(pid, status, 0);
+    goto done;
+  }
+  struct pollfd fds[2] = {{ .fd = fan, .events = POLLIN }, { .fd = pidfd, .events = POLLIN }};
+  while (!result && !fds[1].revents) {
+    if (-1 == poll(fds, 2, -1)) {
+      if (errno != EINTR)
+        result = report_errno(report, "poll failed");
+      continue;
+    }
+    if (fds[0].revents)
+      result = read_events(report, fan, buffer, realroot, &paths);
+  }
+  if (-1 == waitpid(pid, status, 0))
+    result = report_errno(report, "wait for %d failed", pid);
+  // opens from just before the job exited may still be queued
+  if (!result)
+    result = read_events(report, fan, buffer, realroot, &paths);
+  if (!result)
+    result = write_profile(report, profile, &paths);
+ done:
+  if (pidfd != -1)
+    close(pidfd);
+  if (fan != -1)
+    close(fan);
+  for (size_t i = 0; i < string_vector_size(&paths); i++)
+    free(string_vector_get(&paths, i));
+  string_vector_free(&paths);
+  free(buffer);
+  free(realroot);
+  return result ? report->last_error : 0;
+}
+
+/*
+The io_uring version of prefetching. Each file gets an IORING_OP_OPENAT, which looks it
+up and so warms its dentries and inode in every layer, then an IORING_OP_FADVISE to start
+reading its pages and an IORING_OP_CLOSE hard linked after it, keeping up to a ring's
+worth of them in flight. The kernel does the reads in the background.
+*/
+struct prefetch_op
+{
+  unsigned char opened;
+  char path[];
+};
+
+struct prefetch
+{
+  struct report *report;
+  struct uring *ring;
+  int root_fd;
+  unsigned in_flight;
+  unsigned error_count;
+};
+
+static err_t reap_prefetch_ops(struct prefetch *prefetch, unsigned wait_count);
+
+// returns: the next free sqe, handling completions until one is free, or NULL on error
+static struct io_uring_sqe *get_prefetch_sqe(struct prefetch *prefetch)
+{
+  struct io_uring_sqe *sqe;
+  // never have more in flight than the completion queue can hold
+  while (prefetch->in_flight >= prefetch->ring->entries ||
+         !(sqe = uring_get_sqe(prefetch->ring))) {
+    if (reap_prefetch_ops(prefetch, 1))
+      return NULL;
+  }
+  prefetch->in_flight++;
+  return sqe;
+}
+
+static void complete_prefetch_op(struct prefetch *prefetch, struct prefetch_op *op, int result)
+{
+  if (!op)
+    return; // a close
+  if (op->opened || result < 0) {
+    // a file that's gone since the profile was recorded is nothing to warm
+    if (result < 0 && result != -ENOENT && !op->opened)
+      prefetch->error_count++;
+    free(op);
+    return;
+  }
+  op->opened = 1;
+  struct io_uring_sqe *sqe = get_prefetch_sqe(prefetch);
+  if (!sqe) {
+    close(result);
+    free(op);
+    return;
+  }
+  sqe->opcode = IORING_OP_FADVISE;
+  sqe->fd = result;
+  sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+  sqe->flags = IOSQE_IO_HARDLINK;
+  sqe->user_data = (uintptr_t)op;
+  sqe = get_prefetch_sqe(prefetch);
+  if (!sqe)
+    return; // the ring is broken, the file stays open
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = result;
+  sqe->user_data = 0;
+}
+
+static err_t reap_prefetch_ops(struct prefetch *prefetch, unsigned wait_count)
+{
+  if (uring_submit(prefetch->ring, wait_count))
+    return report_errno(prefetch->report, "io_uring_enter failed");
+  for (;;) {
+    struct io_uring_cqe *cqe = uring_peek_cqe(prefetch->ring);
+    if (!cqe)
+      return err_pass;
+    struct prefetch_op *op = (struct prefetch_op*)(uintptr_t)cqe->user_data;
+    int result = cqe->res;
+    uring_cqe_seen(prefetch->ring);
+    prefetch->in_flight--;
+    complete_prefetch_op(prefetch, op, result);
+  }
+}
+
+static err_t prefetch_uring(struct prefetch *prefetch, FILE *file)
+{
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t length;
+  err_t result = err_pass;
+  while (!result && (length = getline(&line, &line_size, file)) > 0) {
+    if (line[length - 1] == '\n')
+      line[--length] = '\0';
+    if (!length)
+      continue;
+    struct prefetch_op *op = malloc(sizeof(struct prefetch_op) + length + 1);
+    if (!op) {
+      result = report_errno(prefetch->report, "malloc failed");
+      break;
+    }
+    op->opened = 0;
+    memcpy(op->path, line, length + 1);
+    struct io_uring_sqe *sqe = get_prefetch_sqe(prefetch);
+    if (!sqe) {
+      free(op);
+      result = err_fail;
+      break;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = prefetch->root_fd;
+    sqe->addr = (uintptr_t)op->path;
+    sqe->open_flags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC;
+    sqe->user_data = (uintptr_t)op;
+  }
+  free(line);
+  while (!result && prefetch->in_flight)
+    result = reap_prefetch_ops(prefetch, 1);
+  return result;
+}
+
+static void prefetch_sync(struct prefetch *prefetch, FILE *file)
+{
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t length;
+  while ((length = getline(&line, &line_size, file)) > 0) {
+    if (line[length - 1] == '\n')
+      line[--length] = '\0';
+    if (!length)
+      continue;
+    int fd = openat(prefetch->root_fd, line, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+      if (errno != ENOENT)
+        prefetch->error_count++;
+      continue;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+  free(line);
+}
+
+int view_prefetch(struct report *report, const char *root, const char *profile,
+                  unsigned char sync)
+{
+  FILE *file = fopen(profile, "re");
+  if (!file) {
+    report_errno(report, "open profile '%s' failed", profile);
+    return report->last_error;
+  }
+  struct prefetch prefetch = { report, NULL, -1, 0, 0 };
+  prefetch.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (prefetch.root_fd == -1) {
+    report_errno(report, "open '%s' failed", root);
+    fclose(file);
+    return report->last_error;
+  }
+  static const unsigned char opcodes[] = { IORING_OP_OPENAT, IORING_OP_FADVISE, IORING_OP_CLOSE };
+  struct uring ring;
+  err_t result = err_pass;
+  if (sync || uring_init(&ring, URING_ENTRIES, opcodes, sizeof(opcodes))) {
+    prefetch_sync(&prefetch, file);
+  } else {
+    prefetch.ring = &ring;
+    result = prefetch_uring(&prefetch, file);
+    uring_free(&ring);
+  }
+  if (!result && ferror(file))
+    result = report_errno(report, "read profile '%s' failed", profile);
+  if (!result && prefetch.error_count)
+    report_notice(report, "%u files in profile '%s' couldn't be prefetched", prefetch.error_count,
+                  profile);
+  fclose(file);
+  close(prefetch.root_fd);
+  return result ? report->last_error : 0;
+}